@@ -0,0 +1,97 @@
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include "frame_bus.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define CAPTURE_MAGIC "SCCP"
+#define CAPTURE_VERSION 1
+
+// what a record marks, kept apart from the encoder's flags so a replay 
+// does not need to know what those mean
+#define CAPTURE_FRAME_END 1
+#define CAPTURE_FAILED 2
+
+// frames waiting for the writer thread, more are dropped
+#define CAPTURE_QUEUE_SIZE 256
+
+typedef struct capture_header_tag {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t framerate;
+    uint32_t reserved;
+} capture_header_t;
+
+// one frame as it was published on the bus, followed by its data.  a jpeg
+// is recorded whole and marked as the end of its frame, captures made 
+// from the camera callbacks can still hold fragments and failed frames
+typedef struct capture_record_tag {
+    // a frame_type_t
+    uint8_t type;
+    uint8_t marks;
+    uint16_t reserved;
+    // the encoder's buffer flags, handed on untouched
+    uint32_t flags;
+    int64_t pts;
+    // when the buffer arrived, in microseconds since the capture started
+    uint64_t time_us;
+    uint32_t length;
+    uint32_t reserved2;
+} capture_record_t;
+
+// a published frame waiting to be written, with a reference held on it
+typedef struct capture_entry_tag {
+    capture_record_t record;
+    snapshot_t * frame;
+} capture_entry_t;
+
+// a recording of everything the encoders produce, to replay later 
+// without a camera.  it subscribes to the frame bus and the bus thread
+// only queues a reference to each frame, a writer thread of its own does
+// the writing so neither the camera callbacks nor the bus wait on the disk
+typedef struct capture_tag {
+    FILE * file;
+    capture_header_t header;
+    uint64_t start_us;
+    // a write failed, nothing more is recorded
+    int failed;
+
+    // frames from the bus thread to the writer, under mutex
+    capture_entry_t queue[CAPTURE_QUEUE_SIZE];
+    unsigned int head;
+    unsigned int tail;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    pthread_t thread;
+    int writing;
+    int stopping;
+    // the time of the last record written, records never go back from it
+    uint64_t last_time_us;
+    // frames not recorded because the writer fell behind
+    unsigned long long dropped;
+} capture_t;
+
+// create path and start the writer thread
+int capture_create(capture_t * capture, const char * path, int width, int height, uint32_t framerate);
+// record every frame published on bus from now on.  call before anything
+// is posted, the subscriptions are only read by the bus thread
+int capture_subscribe(capture_t * capture, frame_bus_t * bus);
+
+// open a capture for reading, the header says what it was recorded at
+int capture_open(capture_t * capture, const char * path);
+// read the next record and its data into *data, which is grown as needed.
+// returns 1 for a record, 0 at the end and -1 for a broken file
+int capture_read(capture_t * capture, capture_record_t * record, uint8_t ** data, size_t * capacity);
+// back to the first record
+int capture_rewind(capture_t * capture);
+
+// a capture being written finishes the frames already queued first, 
+// which may hold frames from the bus, so close it before the bus goes
+void capture_close(capture_t * capture);
+
+#endif
@@ -3,6 +3,7 @@
 #define __COMPONENTS_H__
 
 #include "state.h"
+#include "encoder_control.h"
 
 #include "interface/mmal/mmal.h"
 
@@ -13,12 +14,17 @@
 
 #define VIDEO_OUTPUT_BUFFERS_NUM 3
 
+// extra jpeg buffers beyond what the port holds, so a finished frame can 
+// be lent to the http server while the encoder keeps going
+#define IMAGE_ENCODER_SPARE_BUFFERS 2
+
 
 int mmal_status_to_int(MMAL_STATUS_T status);
 void default_camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer);
 MMAL_STATUS_T create_camera_component(state_t * state);
 MMAL_STATUS_T create_encoder_component(state_t * state);
 MMAL_STATUS_T create_image_encoder_component(state_t * state);
+void encoder_control_mmal(encoder_control_t * control, MMAL_COMPONENT_T * encoder);
 void get_sensor_defaults(int camera_num, char *camera_name, int *width, int *height );
 int raspicamcontrol_set_stereo_mode(MMAL_PORT_T *port, MMAL_PARAMETER_STEREOSCOPIC_MODE_T *stereo_mode);
 void check_camera_model(int cam_num);
@@ -0,0 +1,13 @@
+#ifndef __ENCODER_CONTROL_H__
+#define __ENCODER_CONTROL_H__
+
+// what the servers may ask of the video encoder.  the mmal implementation
+// lives in components.c, anything else can fill in the function pointers
+// to run the servers without a camera
+typedef struct encoder_control_tag {
+    // ask for the next frame to be an idr.  returns 0 on success
+    int (*request_keyframe)(struct encoder_control_tag * control);
+    void * user;
+} encoder_control_t;
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef __FRAME_ASSEMBLER_H__
+#define __FRAME_ASSEMBLER_H__
+
+#include "snapshot.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FRAME_ASSEMBLER_WRAPPERS 4
+
+// lends a snapshot header to a buffer that somebody else owns
+typedef struct frame_wrapper_tag {
+    snapshot_t snapshot;
+    struct frame_assembler_tag * assembler;
+
+    void (*release)(void * user);
+    void * user;
+
+    struct frame_wrapper_tag * next;
+} frame_wrapper_t;
+
+// collects the fragments of an encoded frame straight into a pooled 
+// snapshot so every byte is copied exactly once.  once the pool has warmed 
+// up to the largest frame size assembling a frame does not allocate
+typedef struct frame_assembler_tag {
+    snapshot_pool_t pool;
+
+    // frame being filled, NULL until the first fragment arrives
+    snapshot_t * frame;
+
+    // capacity to ask the pool for, follows the largest frame seen
+    size_t capacity;
+
+    // headers for frames published in place, guarded by pool.mutex
+    frame_wrapper_t wrappers[FRAME_ASSEMBLER_WRAPPERS];
+    frame_wrapper_t * free_wrappers;
+
+    // frames that needed a bigger buffer while being assembled
+    unsigned int grown;
+} frame_assembler_t;
+
+int frame_assembler_init(frame_assembler_t * a, size_t capacity, int pool_size);
+void frame_assembler_destroy(frame_assembler_t * a);
+
+// copies a fragment onto the end of the current frame
+int frame_assembler_append(frame_assembler_t * a, const uint8_t * data, size_t length);
+
+// bytes collected for the current frame so far
+size_t frame_assembler_length(frame_assembler_t * a);
+
+// hands over the finished frame, or NULL if nothing was collected.  the 
+// caller owns the returned reference
+snapshot_t * frame_assembler_finish(frame_assembler_t * a);
+
+// publishes a frame that arrived in one piece without copying it.  release 
+// is called with user once the last reader lets go.  returns NULL when all 
+// wrappers are in use, the caller should append the data instead
+snapshot_t * frame_assembler_wrap(frame_assembler_t * a, uint8_t * data, size_t length, 
+    void (*release)(void * user), void * user);
+
+// throws away a partially assembled frame
+void frame_assembler_reset(frame_assembler_t * a);
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef __FRAME_BUS_H__
+#define __FRAME_BUS_H__
+
+#include "snapshot.h"
+
+#include <stddef.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+struct latency_tag;
+
+// most subscribers per frame type
+#define FRAME_BUS_MAX_SUBSCRIBERS 8
+
+// pooled frames come in power of two size classes starting at 4kB, so a 
+// released frame can always be reused for anything of its class
+#define FRAME_BUS_MIN_SHIFT 12
+#define FRAME_BUS_CLASSES 10
+// released frames kept per size class
+#define FRAME_BUS_POOL_SIZE 32
+
+// one queue per producing callback, each holding this many frames
+#define FRAME_BUS_QUEUES 2
+#define FRAME_BUS_QUEUE_SIZE 256
+
+typedef enum {
+    FRAME_VIDEO = 0,
+    FRAME_MOTION,
+    FRAME_JPEG,
+    FRAME_TYPE_COUNT
+} frame_type_t;
+
+// called for every published frame of a type.  the frame is only borrowed
+// for the call, a subscriber that keeps it takes its own reference
+typedef void (*frame_bus_fn)(void * user, snapshot_t * frame);
+
+typedef struct frame_subscriber_tag {
+    frame_bus_fn fn;
+    void * user;
+} frame_subscriber_t;
+
+typedef struct frame_queue_entry_tag {
+    frame_type_t type;
+    snapshot_t * frame;
+} frame_queue_entry_t;
+
+// single producer, single consumer ring from a camera callback to the bus
+// thread.  the producer only moves tail and the consumer only head
+typedef struct frame_queue_tag {
+    frame_queue_entry_t entries[FRAME_BUS_QUEUE_SIZE];
+    atomic_uint head;
+    atomic_uint tail;
+    // frames thrown away because the bus thread fell behind
+    atomic_uint dropped;
+} frame_queue_t;
+
+// hands every encoded frame to whoever wants it without copying.  the
+// camera callbacks fill a pooled frame once and publish it, the last 
+// subscriber to let go returns it to the pool
+typedef struct frame_bus_tag {
+    // set up before the first publish and never changed after
+    frame_subscriber_t subscribers[FRAME_TYPE_COUNT][FRAME_BUS_MAX_SUBSCRIBERS];
+    int subscriber_count[FRAME_TYPE_COUNT];
+
+    snapshot_pool_t pools[FRAME_BUS_CLASSES];
+
+    // frames posted by the callbacks, published by the bus thread so the
+    // callbacks never wait on the network side
+    frame_queue_t queues[FRAME_BUS_QUEUES];
+    pthread_t thread;
+    sem_t wake;
+    // set while the thread has a wake up it has not picked up yet
+    atomic_int wake_pending;
+    int running;
+
+    // where the stages up to publishing are recorded, if anywhere
+    struct latency_tag * latency;
+} frame_bus_t;
+
+int frame_bus_init(frame_bus_t * bus);
+// every frame has to be back by now, so destroy the bus after its subscribers
+void frame_bus_destroy(frame_bus_t * bus);
+
+int frame_bus_subscribe(frame_bus_t * bus, frame_type_t type, frame_bus_fn fn, void * user);
+
+// record how long frames took to reach the subscribers in latency.  call
+// before the first publish
+void frame_bus_set_latency(frame_bus_t * bus, struct latency_tag * latency);
+
+// an empty frame with room for length bytes, from the pools when it fits
+snapshot_t * frame_bus_alloc(frame_bus_t * bus, size_t length);
+
+// hands frame to every subscriber of type and drops the caller's reference
+void frame_bus_publish(frame_bus_t * bus, frame_type_t type, snapshot_t * frame);
+
+// start and stop the bus thread.  stop before closing what subscribes, 
+// frames posted after that wait in the queues until drained or destroyed
+int frame_bus_start(frame_bus_t * bus);
+void frame_bus_stop(frame_bus_t * bus);
+// release whatever is still queued without publishing it, once the bus 
+// thread and every producer have stopped
+void frame_bus_drain(frame_bus_t * bus);
+
+// queue frame for the bus thread to publish and return right away.  each
+// queue must only ever be posted to from one thread.  takes the caller's
+// reference, the frame is dropped if the queue is full
+int frame_bus_post(frame_bus_t * bus, int queue, frame_type_t type, snapshot_t * frame);
+
+// frames waiting in a queue, for a producer that would rather wait than
+// have them dropped.  only meaningful on the posting thread
+int frame_bus_backlog(frame_bus_t * bus, int queue);
+
+#endif
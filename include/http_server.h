@@ -3,43 +3,212 @@
 #define __HTTP_SERVER_H__
 
 #include "http_parser.h"
+#include "snapshot.h"
+#include "motion_history.h"
 
 #include <pthread.h>
 #include <stdatomic.h>
 #include <semaphore.h>
 #include <netinet/in.h>
 
+// maximum request size
+#define HTTP_REQUEST_MAX 4096
+
+// connection slots per worker, further connections are turned away
+#define HTTP_MAX_CONNECTIONS 128
+
+// upper bound on the number of worker loops, one per core below that
+#define HTTP_MAX_WORKERS 4
+
+#define HTTP_MAX_EVENTS 64
+
+// most buffers handed to a single sendmsg call
+#define HTTP_MAX_IOV 16
+
+// most responses queued on one connection before we stop parsing
+// pipelined requests and wait for the client to read
+#define HTTP_MAX_PIPELINE 8
+
+// keep-alive connections with no activity for this long are closed
+#define HTTP_IDLE_TIMEOUT_MS 10000
+
+// largest /zones response
+#define HTTP_ZONES_MAX 8192
+
+// /motion/history ranges, in milliseconds since the epoch.  without from
+// the last HTTP_HISTORY_DEFAULT_MS up to to are sent, which defaults to now.
+// times that do not fit in microseconds and limit=0 get a 400, a limit 
+// over HTTP_HISTORY_LIMIT_MAX is cut down to it
+#define HTTP_HISTORY_DEFAULT_MS 60000
+#define HTTP_HISTORY_LIMIT_DEFAULT 1000
+#define HTTP_HISTORY_LIMIT_MAX 10000
+// largest grid /motion/history/grid sends
+#define HTTP_HISTORY_GRID_MAX (256 * 1024)
+
+// default and longest wait for a /frame.jpg?after=N long poll
+#define HTTP_LONGPOLL_DEFAULT_MS 10000
+#define HTTP_LONGPOLL_MAX_MS 30000
+// how long a plain /frame.jpg waits for the jpeg encoder to start back up
+#define HTTP_FRAME_WAKE_MS 2000
+
+// boundary between parts of the multipart jpeg stream
+#define HTTP_STREAM_BOUNDARY "simplecamframe"
+
 struct http_server_tag;
-struct http_processor_tag;
+struct http_worker_tag;
+struct latency_tag;
+
+// one queued response, sent in the order the requests arrived.  the body 
+// is either a pinned snapshot or copied in after the header
+typedef struct http_response_tag {
+    struct http_response_tag * next;
+    snapshot_t * snapshot;
+    const uint8_t * body;
+    size_t body_length;
+    size_t header_length;
+    // bytes of header and body already sent
+    size_t offset;
+    // the frame_type_t of a snapshot body sent as soon as it came off the
+    // bus: a stream part or a released long poll.  -1 for anything else,
+    // cached replies included
+    int frame_type;
+    uint8_t data[];
+} http_response_t;
 
-typedef struct http_processor_tag {
+typedef struct http_conn_tag {
     int sock;
-    pthread_t thread;
-    struct http_processor_tag * next;
-    struct http_server_tag * server;
+    // bumped every time the slot is reused so stale epoll events are ignored
+    uint32_t generation;
+    // index of the next free slot while this one is on the free list
+    int next_free;
+    struct http_worker_tag * worker;
     struct sockaddr_in client_addr;
-    int closed;
-} http_processor_t;
+
+    http_parser parser;
+    int keep_alive;
+    // the peer has shut down its side, or we are closing after the last response
+    int read_closed;
+    int closing;
+
+    // url location inside in
+    size_t url_offset;
+    size_t url_length;
+
+    // header currently being parsed and the If-None-Match value, if any,
+    // also as locations inside in
+    size_t field_offset;
+    size_t field_length;
+    int in_header_value;
+    int field_is_if_none_match;
+    size_t if_none_match_offset;
+    size_t if_none_match_length;
+
+    // buffered input, the first parsed bytes have been fed to the parser
+    char in[HTTP_REQUEST_MAX];
+    size_t in_length;
+    size_t parsed;
+
+    // responses waiting to be sent
+    http_response_t * out_head;
+    http_response_t ** out_tail;
+    int out_count;
+
+    // subscribed to the jpeg stream.  a subscriber only ever has one frame
+    // in flight and skips straight to the latest one when it is done, so
+    // slow readers get fewer frames rather than more latency
+    int streaming;
+    uint64_t stream_seq;
+    uint64_t stream_last_sent;
+    // minimum time between frames for this subscriber, 0 for every frame
+    unsigned int stream_interval_ms;
+    uint64_t stream_sent;
+    uint64_t stream_skipped;
+
+    // parked on a long poll until wait_slot publishes something newer than
+    // wait_after or wait_deadline passes.  later pipelined requests wait 
+    // behind it
+    int waiting;
+    snapshot_slot_t * wait_slot;
+    const char * wait_type;
+    uint64_t wait_after;
+    uint64_t wait_deadline;
+    // answer a timed out wait with whatever is in the slot instead of 204
+    int wait_fallback;
+
+    // the current request is /motion.bin?enc=rle, motion snapshots it is
+    // answered with are sent as motion codec keyframes
+    int motion_rle;
+
+    // position in the worker idle list, least recently active first
+    uint64_t last_active;
+    struct http_conn_tag * idle_prev;
+    struct http_conn_tag * idle_next;
+} http_conn_t;
+
+typedef struct http_worker_tag {
+    struct http_server_tag * server;
+    int sock;
+    int epollfd;
+    int wakefd;
+    pthread_t thread;
+
+    // fixed connection table and the head of its free list
+    http_conn_t * conns;
+    int free_head;
+    int conn_count;
+
+    // connections in use ordered by last activity
+    http_conn_t * idle_head;
+    http_conn_t * idle_tail;
+
+    // jpeg stream subscribers and long polls on this worker, and whether 
+    // wakefd has been signalled for a publish the worker has not handled yet
+    atomic_int stream_count;
+    atomic_int waiter_count;
+    atomic_int wake_pending;
+} http_worker_t;
 
 typedef struct http_server_tag {
-    sem_t processor_cleanup;
     int completed;
-    int sock;
-    pthread_t listen_thread;
-    pthread_t cleanup_thread;
     int wait_queue;
-    pthread_mutex_t mutex;
-    struct http_processor_tag * processors;
-    atomic_int processor_count;
+    int worker_count;
+    http_worker_t workers[HTTP_MAX_WORKERS];
+
+    // part of every ETag so tags from before a restart never match
+    uint32_t boot_id;
+
+    // jpeg stream subscribers across all workers
+    atomic_int stream_subscribers;
+
+    // frame demand, so the jpeg encoder only runs while someone looks.
+    // frame_stale is set while the encoder is off and cleared by the next
+    // published frame, frame_demand is called when a request finds it set
+    atomic_int frame_waiters;
+    atomic_ullong frame_requested;
+    atomic_int frame_stale;
+    void (*frame_demand)(void * user);
+    void * frame_demand_user;
+
+    // handles /zones, called from worker threads.  returns the length of 
+    // the json it wrote to out, or -1 with an error message in out
+    int (*zones)(void * user, const char * query, size_t query_length, char * out, size_t size);
+    void * zones_user;
 
-    uint8_t * motion;
-    size_t motion_size;
+    // answers /motion/history, read by the workers without a lock
+    motion_history_t * history;
 
-    uint8_t * frame;
-    size_t frame_size;
+    // per stage frame latencies, served on /latency and fed the send
+    // times of frames that came off the bus
+    struct latency_tag * latency;
 
-    uint8_t * config;
-    size_t config_size;
+    // latest published buffers, pinned by readers without a lock
+    snapshot_slot_t motion;
+    snapshot_slot_t frame;
+    snapshot_slot_t config;
+    // the latest motion events, one json object per line
+    snapshot_slot_t events;
+    // per zone motion scores of the latest field
+    snapshot_slot_t zone_scores;
 
 } http_server_t;
 
@@ -47,7 +216,36 @@ int http_server_create(http_server_t * server, int portno);
 int http_server_destroy(http_server_t * server);
 
 int http_server_frame_jpeg(http_server_t * server, uint8_t * data, size_t length);
+// publishes a finished frame without copying it, takes ownership of the 
+// caller's reference
+int http_server_frame_snapshot(http_server_t * server, snapshot_t * frame);
 int http_server_motion(http_server_t * server, uint8_t * data, size_t length);
+// like http_server_frame_snapshot for motion vectors
+int http_server_motion_snapshot(http_server_t * server, snapshot_t * motion);
+// replaces the recent motion events, takes ownership like the above
+int http_server_events_snapshot(http_server_t * server, snapshot_t * events);
+// 1 while frames are being streamed, waited on or were requested within 
+// the last linger_ms
+int http_server_frame_wanted(http_server_t * server, uint64_t linger_ms);
+// the jpeg encoder has stopped, the current frame will go stale
+void http_server_frame_paused(http_server_t * server);
+// called from a worker thread when a frame is requested while paused
+void http_server_on_frame_demand(http_server_t * server, void (*demand)(void * user), void * user);
+
+// replaces the zone scores, takes ownership like the above
+int http_server_zone_scores_snapshot(http_server_t * server, snapshot_t * scores);
+// answer /zones requests through handler
+void http_server_on_zones(http_server_t * server, 
+    int (*handler)(void * user, const char * query, size_t query_length, char * out, size_t size), void * user);
+
+// serve the records in history on /motion/history.  call before any 
+// client connects
+void http_server_set_motion_history(http_server_t * server, motion_history_t * history);
+
+// serve latency on /latency and record the send times of frames in it.
+// call before any client connects
+void http_server_set_latency(http_server_t * server, struct latency_tag * latency);
+
 int http_server_config(http_server_t * server, uint8_t * data, size_t length);
 
-#endif
\ No newline at end of file
+#endif
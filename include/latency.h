@@ -0,0 +1,85 @@
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include "frame_bus.h"
+#include "snapshot.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// histogram buckets keep the top LATENCY_SUB_BITS bits of a value, so a
+// recorded latency is reported to within 1/64 of itself.  values are in
+// microseconds, anything over LATENCY_MAX_BITS bits (about 71 minutes)
+// counts as that
+#define LATENCY_SUB_BITS 7
+#define LATENCY_MAX_BITS 32
+#define LATENCY_COUNTS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 2) << (LATENCY_SUB_BITS - 1))
+
+// longest /latency response
+#define LATENCY_FORMAT_MAX 4096
+
+// where a frame's time goes, each stage is measured from the end of the
+// one before
+typedef enum {
+    // sensor capture to the encoder callback: readout, isp and encoding
+    LATENCY_ENCODE = 0,
+    // the callback copying or assembling the frame and posting it
+    LATENCY_COPY,
+    // waiting in the bus queue for the bus thread
+    LATENCY_QUEUE,
+    // handed to the servers until a client's socket took the last byte,
+    // once per client
+    LATENCY_SEND,
+    // sensor capture to the last byte, once per client
+    LATENCY_TOTAL,
+    LATENCY_STAGES
+} latency_stage_t;
+
+// counts per bucket.  any thread records with relaxed atomic adds, readers
+// see each counter on its own so a snapshot taken while recording can be
+// off by the few values in flight
+typedef struct latency_histogram_tag {
+    atomic_ullong counts[LATENCY_COUNTS];
+    atomic_ullong total;
+    atomic_ullong sum;
+    atomic_ullong max;
+} latency_histogram_t;
+
+// per frame type and stage latencies from the sensor to the sockets
+typedef struct latency_tag {
+    // FRAME_TYPE_COUNT x LATENCY_STAGES
+    latency_histogram_t * histograms;
+
+    // the camera stamps frames with the videocore's clock.  monotonic
+    // minus stc, in microseconds, once stc_known is set
+    atomic_llong stc_offset;
+    atomic_int stc_known;
+} latency_t;
+
+int latency_init(latency_t * latency);
+void latency_destroy(latency_t * latency);
+
+// the clock every stamp is taken on, monotonic microseconds
+uint64_t latency_now();
+
+// the stc read at monotonic time now, for mapping pts onto our clock
+void latency_set_stc(latency_t * latency, int64_t stc, uint64_t now);
+// when a frame with pts was captured on the monotonic clock, 0 until the
+// stc offset is known or for frames without a pts
+uint64_t latency_sensor_time(latency_t * latency, int64_t pts);
+
+// from to to in stage, ignored when from is 0
+void latency_record(latency_t * latency, frame_type_t type, latency_stage_t stage, uint64_t from, uint64_t to);
+// the stages up to the bus thread handing frame out, from its stamps
+void latency_frame_published(latency_t * latency, frame_type_t type, snapshot_t * frame);
+// a client's socket took the last byte of frame at now
+void latency_frame_sent(latency_t * latency, frame_type_t type, snapshot_t * frame, uint64_t now);
+
+// one json object per frame type and stage with samples: count, mean,
+// percentiles and max in microseconds.  returns the length written
+size_t latency_format(latency_t * latency, char * out, size_t size);
+// start counting afresh
+void latency_reset(latency_t * latency);
+
+#endif
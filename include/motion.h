@@ -0,0 +1,88 @@
+#ifndef __MOTION_H__
+#define __MOTION_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// sad histogram buckets, each covering 1 << MOTION_SAD_SHIFT of sad
+#define MOTION_SAD_BUCKETS 16
+#define MOTION_SAD_SHIFT 8
+
+// squared vector length a macroblock needs to count as active
+#define MOTION_DEFAULT_THRESHOLD 16
+
+// the encoder writes one of these per macroblock with INLINE_VECTORS on,
+// with one more column per row than the frame has macroblocks
+typedef struct motion_vector_tag {
+    int8_t x;
+    int8_t y;
+    uint16_t sad;
+} motion_vector_t;
+
+// per frame summary of a motion field
+typedef struct motion_stats_tag {
+    // macroblocks whose squared magnitude reached the threshold
+    uint32_t active;
+    // active over all macroblocks, 0 to 1
+    float activity;
+    uint64_t magnitude_sum;
+    uint32_t sad_histogram[MOTION_SAD_BUCKETS];
+} motion_stats_t;
+
+// rates for one update of a background model, see motion_background.h
+typedef struct motion_background_params_tag {
+    // how fast the mean and variance follow macroblocks within the noise
+    // band, and the slower rate for ones above it
+    float alpha;
+    float alpha_foreground;
+    // standard deviations above the mean a value must be to stand out
+    float k;
+} motion_background_params_t;
+
+// the kernels behind decode, analyze and the background model.  there is
+// a scalar version and, where the compiler targets it, a NEON or SSE2 one
+typedef struct motion_kernels_tag {
+    const char * name;
+    // deinterleave n vectors and compute their squared magnitudes
+    void (*decode)(const uint8_t * src, int8_t * x, int8_t * y, uint16_t * sad, uint16_t * magnitude, int n);
+    // count magnitudes >= threshold and sum them all
+    void (*activity)(const uint16_t * magnitude, int n, uint16_t threshold, uint32_t * active, uint64_t * sum);
+    // replace each value with how far it is above mean + k * sigma, 0 when
+    // it is not, then fold it into the mean and variance
+    void (*background)(uint16_t * value, float * mean, float * variance, int n, 
+        const motion_background_params_t * params);
+} motion_kernels_t;
+
+extern const motion_kernels_t motion_kernels_scalar;
+// the fastest kernels this build has
+extern const motion_kernels_t * motion_kernels_best;
+
+// a decoded motion field as a struct of arrays, without the padding column
+typedef struct motion_field_tag {
+    // macroblocks per row and rows
+    int width;
+    int height;
+    int count;
+
+    // bytes of an encoder buffer for this field
+    size_t length;
+
+    // 16 byte aligned, each padded to a multiple of 16 entries
+    int8_t * x;
+    int8_t * y;
+    uint16_t * sad;
+    // x * x + y * y
+    uint16_t * magnitude;
+
+    const motion_kernels_t * kernels;
+} motion_field_t;
+
+int motion_field_init(motion_field_t * field, int frame_width, int frame_height);
+void motion_field_destroy(motion_field_t * field);
+
+// unpack an encoder motion buffer, -1 if it is not the size we expect
+int motion_field_decode(motion_field_t * field, const uint8_t * data, size_t length);
+
+void motion_field_analyze(const motion_field_t * field, uint16_t threshold, motion_stats_t * stats);
+
+#endif
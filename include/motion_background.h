@@ -0,0 +1,64 @@
+#ifndef __MOTION_BACKGROUND_H__
+#define __MOTION_BACKGROUND_H__
+
+#include "motion.h"
+
+#include <stdint.h>
+
+// default update rates.  a macroblock's baseline follows its noise over 
+// roughly 1 / alpha fields, something that stops in view is absorbed into
+// it over roughly 1 / alpha_foreground
+#define MOTION_BACKGROUND_ALPHA 0.01f
+#define MOTION_BACKGROUND_FOREGROUND_ALPHA 0.0005f
+#define MOTION_BACKGROUND_K 3.0f
+
+// fields a cold model learns from before it reports anything
+#define MOTION_BACKGROUND_WARMUP 30
+
+#define MOTION_BACKGROUND_MAGIC "SCBG"
+#define MOTION_BACKGROUND_VERSION 1
+
+// exponential moving mean and variance of vector magnitude and sad per 
+// macroblock.  one cache line aligned block holding four arrays, each 
+// padded to whole cache lines, so the kernels stream through them
+typedef struct motion_background_tag {
+    int width;
+    int height;
+    int count;
+    int stride;
+
+    float * block;
+    float * magnitude_mean;
+    float * magnitude_variance;
+    float * sad_mean;
+    float * sad_variance;
+
+    // fields learned from.  the rates start at 1 / fields so a cold model
+    // begins as the plain average of what it has seen
+    uint32_t fields;
+    motion_background_params_t params;
+} motion_background_t;
+
+// the file is this header followed by the four arrays, count floats each
+typedef struct motion_background_header_tag {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t fields;
+} motion_background_header_t;
+
+int motion_background_init(motion_background_t * bg, const motion_field_t * field);
+void motion_background_destroy(motion_background_t * bg);
+
+// learn from field and replace its magnitudes and sads with how far they 
+// stand out from the baseline, 0 for anything within the noise
+void motion_background_apply(motion_background_t * bg, motion_field_t * field);
+
+// -1 if there is no model at path or it is for another resolution
+int motion_background_load(motion_background_t * bg, const char * path);
+int motion_background_save(const motion_background_t * bg, const char * path);
+// copy the learned model, to has been set up for the same field as from
+void motion_background_copy(motion_background_t * to, const motion_background_t * from);
+
+#endif
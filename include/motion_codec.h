@@ -0,0 +1,82 @@
+#ifndef __MOTION_CODEC_H__
+#define __MOTION_CODEC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// compressed motion vector frames.  a frame is a 16 byte header
+//
+//   'M' 'V' type version  seq (u32)  raw length (u32)  payload length (u32)
+//
+// all little endian, type 'K' for a keyframe and 'D' for a delta against
+// the frame with seq - 1.  the payload is two planes covering every 
+// macroblock of the encoder buffer, padding column included, each a
+// sequence of
+//
+//   skip count (varint)  literal count (varint)  literals
+//
+// the vector plane skips vectors equal to the reference, 0 in a keyframe,
+// and its literals are x and y as two bytes.  the sad plane of a keyframe
+// is all literals, each the zigzag varint difference from the previous 
+// macroblock's sad.  in a delta it skips sads within the tolerance of the
+// reference and its literals are zigzag varint differences from it.
+// vectors are exact, sads of a delta are within the tolerance the encoder
+// was given and exact again at every keyframe
+
+#define MOTION_CODEC_MAGIC0 'M'
+#define MOTION_CODEC_MAGIC1 'V'
+#define MOTION_CODEC_VERSION 1
+#define MOTION_CODEC_KEY 'K'
+#define MOTION_CODEC_DELTA 'D'
+#define MOTION_CODEC_HEADER 16
+
+// defaults for the stream, a keyframe about every two seconds and sads
+// that are only resent when they move by more than this
+#define MOTION_CODEC_KEY_INTERVAL 50
+#define MOTION_CODEC_SAD_TOLERANCE 64
+
+// decode results besides the raw length
+#define MOTION_CODEC_ERROR -1
+// a delta that does not follow the last decoded frame, wait for a keyframe
+#define MOTION_CODEC_NEED_KEY -2
+
+// encoder or decoder state, the planes as the decoder holds them
+typedef struct motion_codec_tag {
+    // bytes of a raw frame and macroblocks in it
+    size_t length;
+    int count;
+
+    uint16_t * vectors;
+    uint16_t * sad;
+    int have_reference;
+    // of the last frame coded
+    uint32_t seq;
+
+    // encoder only
+    unsigned int key_interval;
+    unsigned int since_key;
+    uint16_t sad_tolerance;
+} motion_codec_t;
+
+int motion_codec_init(motion_codec_t * codec, size_t length, unsigned int key_interval, uint16_t sad_tolerance);
+void motion_codec_destroy(motion_codec_t * codec);
+
+// most bytes a frame of length raw bytes can encode to
+size_t motion_codec_bound(size_t length);
+
+// encode the next frame, a keyframe when key is set or one is due.  
+// returns the encoded length, 0 if out is too small
+size_t motion_codec_encode(motion_codec_t * codec, const uint8_t * raw, size_t length, int key, 
+    uint8_t * out, size_t size);
+// a standalone keyframe, no state needed
+size_t motion_codec_encode_key(const uint8_t * raw, size_t length, uint32_t seq, uint8_t * out, size_t size);
+
+// decode one frame into raw, which must hold codec->length bytes.  returns
+// the raw length, MOTION_CODEC_ERROR or MOTION_CODEC_NEED_KEY
+int motion_codec_decode(motion_codec_t * codec, const uint8_t * in, size_t length, uint8_t * raw, size_t size);
+
+// length of the whole frame starting at in, 0 if fewer than 
+// MOTION_CODEC_HEADER bytes are there yet, -1 if it is not a frame header
+long motion_codec_frame_length(const uint8_t * in, size_t available);
+
+#endif
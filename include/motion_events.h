@@ -0,0 +1,115 @@
+#ifndef __MOTION_EVENTS_H__
+#define __MOTION_EVENTS_H__
+
+#include "motion.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+// regions smaller than this many macroblocks are noise
+#define MOTION_MIN_REGION 4
+// regions labelled per field, any further ones are ignored
+#define MOTION_MAX_REGIONS 64
+// regions followed at once
+#define MOTION_MAX_TRACKS 16
+// fields a region has to persist for before it starts an event, and
+// fields it has to be gone for before the event stops
+#define MOTION_START_FIELDS 3
+#define MOTION_STOP_FIELDS 15
+// a region continues a track whose box it overlaps once both are grown
+// by this many macroblocks
+#define MOTION_TRACK_MARGIN 1
+
+// most events one field can produce, a stop and a start per track
+#define MOTION_MAX_EVENTS (2 * MOTION_MAX_TRACKS)
+// recent events kept for http clients
+#define MOTION_EVENT_HISTORY 32
+// longest formatted event, including the newline
+#define MOTION_EVENT_LINE_MAX 160
+
+typedef enum {
+    MOTION_EVENT_START,
+    MOTION_EVENT_STOP
+} motion_event_type_t;
+
+// boxes are in macroblocks, right and bottom exclusive
+typedef struct motion_box_tag {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+} motion_box_t;
+
+typedef struct motion_event_tag {
+    motion_event_type_t type;
+    // increases by one with every event
+    uint64_t seq;
+    // the same for a start and its stop
+    uint32_t id;
+    int64_t pts;
+    // the region when it started, or everywhere it went by the time it 
+    // stopped
+    motion_box_t box;
+    // macroblocks in the region, the largest it got for a stop
+    int area;
+    // microseconds between start and stop, 0 for a start
+    int64_t duration;
+} motion_event_t;
+
+typedef struct motion_region_tag {
+    motion_box_t box;
+    int area;
+} motion_region_t;
+
+typedef struct motion_track_tag {
+    int used;
+    // start has been reported
+    int started;
+    uint32_t id;
+    motion_box_t box;
+    motion_box_t extent;
+    int peak_area;
+    int hits;
+    int misses;
+    int64_t start_pts;
+    // set while matching a field
+    int matched;
+} motion_track_t;
+
+typedef struct motion_detector_tag {
+    int width;
+    int height;
+
+    // union-find forest over the macroblock grid, -1 for quiet macroblocks.
+    // a component's root is always its first macroblock in raster order
+    int * parent;
+    // region index of each root
+    int * region_of;
+
+    motion_region_t regions[MOTION_MAX_REGIONS];
+    int region_count;
+
+    motion_track_t tracks[MOTION_MAX_TRACKS];
+    uint32_t next_id;
+    uint64_t next_seq;
+
+    motion_event_t history[MOTION_EVENT_HISTORY];
+    int history_count;
+    int history_next;
+} motion_detector_t;
+
+int motion_detector_init(motion_detector_t * d, const motion_field_t * field);
+void motion_detector_destroy(motion_detector_t * d);
+
+// label the macroblocks of field at or above threshold, follow the regions
+// from the previous field and write the events this one caused.  returns
+// the number of events, at most MOTION_MAX_EVENTS
+int motion_detector_update(motion_detector_t * d, const motion_field_t * field, uint16_t threshold, 
+    int64_t pts, motion_event_t * events);
+
+// one json object and a newline, returns its length
+int motion_event_format(const motion_event_t * event, char * buf, size_t size);
+// the recent events oldest first, one per line.  returns the length
+size_t motion_detector_history(const motion_detector_t * d, char * buf, size_t size);
+
+#endif
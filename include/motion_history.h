@@ -0,0 +1,99 @@
+#ifndef __MOTION_HISTORY_H__
+#define __MOTION_HISTORY_H__
+
+#include "motion.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define MOTION_HISTORY_MAGIC "SCMH"
+#define MOTION_HISTORY_VERSION 1
+// the records start one page in
+#define MOTION_HISTORY_HEADER_SIZE 4096
+// longest formatted record, including the newline
+#define MOTION_HISTORY_LINE_MAX 320
+
+// one field.  sequence is odd while the writer is changing the record, a
+// reader copies it out and only trusts the copy if sequence was even and
+// unchanged on both sides
+typedef struct motion_record_tag {
+    atomic_uint sequence;
+    uint32_t active;
+    // the record number, a reader that finds another one in the slot was
+    // lapped by the writer
+    uint64_t index;
+    // wall clock in microseconds since the epoch, and the camera's pts
+    uint64_t time_us;
+    int64_t pts;
+    uint64_t magnitude_sum;
+    // position of the field's motion codec keyframe in the grid ring, 
+    // grid_length is 0 when the field was not kept
+    uint64_t grid_offset;
+    uint32_t grid_length;
+    float activity;
+    uint16_t sad_histogram[MOTION_SAD_BUCKETS];
+    uint8_t reserved[40];
+} motion_record_t;
+
+// the first page of the file.  head and grid_head only ever grow, record
+// i lives in slot i % capacity and grid byte n at n % grid_capacity
+typedef struct motion_history_header_tag {
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t capacity;
+    uint64_t grid_capacity;
+    atomic_ullong head;
+    atomic_ullong grid_head;
+} motion_history_header_t;
+
+// a fixed size ring of motion records and an optional ring of compressed
+// grids, both in one memory mapped file.  one thread appends, any number 
+// read at the same time without locks.  the file survives restarts and 
+// is picked up again when its layout matches.  header is NULL while it
+// is not open
+typedef struct motion_history_tag {
+    int fd;
+    size_t size;
+    uint8_t * map;
+    motion_history_header_t * header;
+    motion_record_t * records;
+    uint8_t * grids;
+
+    // writer only: keep a grid every grid_interval fields, encoded into 
+    // scratch first so only its real length is taken from the ring
+    unsigned int grid_interval;
+    unsigned int since_grid;
+    uint8_t * scratch;
+    size_t scratch_size;
+    // writer only: time of the newest record.  a pi has no clock until ntp
+    // or fake-hwclock sets it, so the wall clock can be behind the records
+    // in the file.  new records never go back before this, which keeps the
+    // times sorted for the readers' binary search
+    uint64_t last_time_us;
+} motion_history_t;
+
+int motion_history_open(motion_history_t * history, const char * path, uint64_t capacity, 
+    uint64_t grid_capacity, unsigned int grid_interval);
+void motion_history_close(motion_history_t * history);
+
+// add a field, raw is the encoder's motion buffer and is only used for 
+// the grid.  writer thread only
+void motion_history_append(motion_history_t * history, int64_t pts, const motion_stats_t * stats, 
+    const uint8_t * raw, size_t length);
+
+// records with from_us <= time < to_us, oldest first, one json object per
+// line with t in milliseconds, at most limit of them.  *next is set to the
+// time to continue from when the limit cut the range short, otherwise to 
+// 0.  returns the length
+size_t motion_history_format(motion_history_t * history, uint64_t from_us, uint64_t to_us, 
+    int limit, char * out, size_t size, uint64_t * next);
+
+// copy out the latest kept grid at or before at_us, returns its length or
+// 0 if there is none or it does not fit
+size_t motion_history_grid(motion_history_t * history, uint64_t at_us, uint8_t * out, size_t size, 
+    motion_record_t * record);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef __MOTION_ZONES_H__
+#define __MOTION_ZONES_H__
+
+#include "motion.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// zones that can be configured at once
+#define MOTION_MAX_ZONES 32
+// longest zone name, including the terminator
+#define MOTION_ZONE_NAME_MAX 32
+// longest formatted zone, in the zone list or the scores
+#define MOTION_ZONE_LINE_MAX 160
+
+// summed-area tables over a motion field, (width + 1) x (height + 1) with
+// a zero first row and column.  entry (x, y) holds the sum over every
+// macroblock above and to the left of it, so any rectangle is four lookups.
+// 32 bits hold the sad sum of a 5MP field
+typedef struct motion_integral_tag {
+    int width;
+    int height;
+    int stride;
+
+    // macroblocks at or above the threshold
+    uint32_t * active;
+    uint32_t * magnitude;
+    uint32_t * sad;
+} motion_integral_t;
+
+// a rectangle in macroblocks
+typedef struct motion_zone_tag {
+    char name[MOTION_ZONE_NAME_MAX];
+    int x;
+    int y;
+    int w;
+    int h;
+} motion_zone_t;
+
+// zones are changed by http workers and read by the bus thread once per 
+// field, the mutex is only ever held to copy them
+typedef struct motion_zones_tag {
+    pthread_mutex_t mutex;
+    motion_zone_t zones[MOTION_MAX_ZONES];
+    int count;
+
+    // field size in macroblocks, zones are checked against it
+    int width;
+    int height;
+} motion_zones_t;
+
+int motion_integral_init(motion_integral_t * ii, const motion_field_t * field);
+void motion_integral_destroy(motion_integral_t * ii);
+void motion_integral_build(motion_integral_t * ii, const motion_field_t * field, uint16_t threshold);
+
+// sum of a table over the rectangle, which must lie inside the field
+static inline uint32_t motion_integral_sum(const motion_integral_t * ii, const uint32_t * table, 
+    int x, int y, int w, int h) 
+{
+    const uint32_t * top = table + y * ii->stride + x;
+    const uint32_t * bottom = top + h * ii->stride;
+
+    // unsigned wraparound cancels out
+    return bottom[w] - bottom[0] - top[w] + top[0];
+}
+
+int motion_zones_init(motion_zones_t * zones, const motion_field_t * field);
+void motion_zones_destroy(motion_zones_t * zones);
+
+// add or replace a zone, -1 if it is not inside the field or the list is full
+int motion_zones_add(motion_zones_t * zones, const char * name, int x, int y, int w, int h);
+// -1 if there was no such zone
+int motion_zones_remove(motion_zones_t * zones, const char * name);
+// zones configured right now
+int motion_zones_count(motion_zones_t * zones);
+
+// apply ?add=name,x,y,w,h and ?remove=name from a query string, with the
+// values url decoded, and write
+// the resulting zones as json.  returns the length written, or -1 with an
+// error message in out if the request was bad
+int motion_zones_command(motion_zones_t * zones, const char * query, size_t query_length, char * out, size_t size);
+
+// score every zone against ii as one json object, returns the length
+// written or 0 when there are no zones
+size_t motion_zones_score(motion_zones_t * zones, const motion_integral_t * ii, int64_t pts, char * out, size_t size);
+
+#endif
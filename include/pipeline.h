@@ -0,0 +1,112 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include "server.h"
+#include "http_server.h"
+#include "frame_assembler.h"
+#include "frame_bus.h"
+#include "motion.h"
+#include "motion_events.h"
+#include "motion_zones.h"
+#include "motion_background.h"
+#include "motion_codec.h"
+#include "motion_history.h"
+#include "latency.h"
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define PIPELINE_VIDEO_PORT 8888
+#define PIPELINE_MOTION_PORT 8889
+#define PIPELINE_EVENT_PORT 8890
+#define PIPELINE_HTTP_PORT 8080
+
+// frame bus queues, one per producer so each has a single producer
+#define PIPELINE_ENCODER_QUEUE 0
+#define PIPELINE_IMAGE_QUEUE 1
+
+// starting size of a jpeg frame buffer, grows to the largest frame seen
+#define PIPELINE_JPEG_FRAME_CAPACITY (512 * 1024)
+// frames being assembled, published and still being sent
+#define PIPELINE_JPEG_FRAME_POOL 4
+
+// the frame rate the field counts below are sized for
+#define PIPELINE_FRAMERATE 25
+
+// the learned motion baseline survives restarts here.  every 
+// PIPELINE_BACKGROUND_SAVE_FIELDS fields it is set aside for pipeline_persist
+// to write out, and it is written on exit
+#define PIPELINE_BACKGROUND_PATH "/var/tmp/simplecam-background.bin"
+#define PIPELINE_BACKGROUND_SAVE_FIELDS (5 * 60 * PIPELINE_FRAMERATE)
+
+// per field motion summaries for the last hour, with a compressed grid
+// once a second for as long as the grid ring holds them
+#define PIPELINE_HISTORY_PATH "/var/tmp/simplecam-history.bin"
+#define PIPELINE_HISTORY_RECORDS (3600 * PIPELINE_FRAMERATE)
+#define PIPELINE_HISTORY_GRID_BYTES (32 * 1024 * 1024)
+#define PIPELINE_HISTORY_GRID_INTERVAL PIPELINE_FRAMERATE
+
+// everything downstream of the encoders: the frame bus, the servers and
+// the motion analysis.  nothing in here knows about mmal, whatever makes
+// the frames copies them into the bus and posts them on the queue that
+// belongs to it, the camera callbacks in main.c or a replayed capture
+typedef struct pipeline_tag {
+    // every encoded frame goes out through the bus
+    frame_bus_t bus;
+    // jpeg fragments are collected here into whole frames
+    frame_assembler_t image_assembler;
+
+    // motion vectors are decoded and summarised on the bus thread, the
+    // field is sized once the sensor resolution is known
+    motion_field_t motion_field;
+    motion_stats_t motion_stats;
+    uint16_t motion_threshold;
+    motion_detector_t motion_detector;
+    // per zone scores from summed-area tables of the field, zones are
+    // set up over http
+    motion_integral_t motion_integral;
+    motion_zones_t motion_zones;
+    // per macroblock noise baseline, persisted across restarts
+    motion_background_t motion_background;
+    const char * motion_background_path;
+    // a copy of the model waiting to be written, so the bus thread never
+    // waits on the sd card.  the mutex guards the copy and dirty
+    motion_background_t motion_background_pending;
+    pthread_mutex_t motion_background_mutex;
+    atomic_int motion_background_dirty;
+    // the "rle" variant of the motion stream and its encoder state
+    int motion_rle_variant;
+    motion_codec_t motion_codec;
+    // every field's summary in a ring file, served on /motion/history
+    motion_history_t motion_history;
+    const char * motion_history_path;
+
+    // how long frames take from the sensor to each client, served on
+    // /latency.  whatever makes the frames stamps them on the way in
+    latency_t latency;
+
+    server_t video_server;
+    server_t motion_server;
+    // motion start and stop events, one json object per line
+    server_t event_server;
+    http_server_t http_server;
+} pipeline_t;
+
+// create the servers and start the bus thread
+int pipeline_init(pipeline_t * pipeline);
+
+// set up the motion analysis for a width x height sensor, motion buffers
+// are ignored until this is done
+int pipeline_set_resolution(pipeline_t * pipeline, int width, int height);
+
+// write out whatever the bus thread set aside, from a thread that may block
+void pipeline_persist(pipeline_t * pipeline);
+
+// stop the bus thread, close the servers and release the frames still
+// queued.  whatever posts frames has to have stopped first
+void pipeline_stop(pipeline_t * pipeline);
+// free the rest
+void pipeline_destroy(pipeline_t * pipeline);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include "capture.h"
+#include "pipeline.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// how long a replay keeps sending jpeg frames after the last request, 
+// like the camera's jpeg branch
+#define REPLAY_JPEG_LINGER_MS 5000
+
+// in fast mode the replay waits while this many frames sit in a bus queue
+// instead of letting the bus drop them
+#define REPLAY_BACKLOG_MAX (FRAME_BUS_QUEUE_SIZE / 2)
+
+// plays a capture into a pipeline in place of the camera callbacks.  every
+// record becomes one bus frame, so fragmentation, flags and pts are what 
+// the encoders produced.  in real time records go out when they arrived
+// during the recording, otherwise as fast as the bus drains them
+typedef struct replay_tag {
+    capture_t capture;
+    pipeline_t * pipeline;
+    int realtime;
+    int loop;
+
+    pthread_t thread;
+    int running;
+    atomic_int completed;
+    atomic_int finished;
+
+    // jpeg frames only go out while the http server wants them, the rest
+    // of a frame that started unwanted is skipped
+    int jpeg_active;
+    int jpeg_skipping;
+
+    // a looped capture keeps pts and time moving forward
+    int64_t pts_offset;
+    uint64_t time_offset_us;
+
+    // records and bytes posted, passes over the capture, and the worst 
+    // a real time replay fell behind the recording
+    uint64_t records[FRAME_TYPE_COUNT];
+    uint64_t bytes;
+    unsigned int passes;
+    uint64_t late_max_us;
+    // start to last frame published, once played out
+    uint64_t elapsed_us;
+} replay_t;
+
+// open a capture for pipeline, its header has the resolution to set the
+// pipeline up with before starting
+int replay_open(replay_t * replay, pipeline_t * pipeline, const char * path, int realtime, int loop);
+int replay_start(replay_t * replay);
+// 1 once a capture that does not loop has been played out
+int replay_finished(replay_t * replay);
+// stop the replay thread and close the capture
+void replay_close(replay_t * replay);
+
+#endif
@@ -1,46 +1,227 @@
-
 #ifndef __SERVER_H__
 #define __SERVER_H__
 
-#include "interface/vcos/vcos_mutex.h"
+#include "encoder_control.h"
+#include "snapshot.h"
 
+#include <pthread.h>
 #include <stdatomic.h>
 
+// number of chunks a single client may have waiting before we start dropping
+#define SERVER_RING_SIZE 64
+
+// most chunks handed to a single sendmsg call
+#define SERVER_MAX_IOV 16
+
+// most events handled per epoll_wait
+#define SERVER_MAX_EVENTS 64
+
+// limits on the h264 gop cache.  a gop that grows past either is dropped 
+// and caching resumes at the next idr
+#define SERVER_GOP_CHUNKS 512
+#define SERVER_GOP_BYTES (8 * 1024 * 1024)
+// chunks holding the latest sps and pps
+#define SERVER_CONFIG_CHUNKS 4
+// a cached gop bigger than this is not worth priming a client with, it 
+// asks the encoder for an idr instead
+#define SERVER_PRIME_BYTES (2 * 1024 * 1024)
+// default minimum time between idr requests
+#define SERVER_KEYFRAME_INTERVAL_MS 1000
+
+// sends smaller than this are copied even with zerocopy on, pinning pages
+// and handling the completion costs more than copying a few pages
+#define SERVER_ZEROCOPY_MIN (16 * 1024)
+// chunk references a client may hold for zerocopy sends in flight
+#define SERVER_ZEROCOPY_PENDING 256
+// completions the kernel reports as copied before a client stops asking
+// for zerocopy, which is what happens on loopback
+#define SERVER_ZEROCOPY_COPIED_LIMIT 32
+
+// a client may ask for another encoding of the stream by sending a line
+// "enc=<name>" right after it connects.  while a server has variants 
+// nothing is queued for a new client until it asks or SERVER_NEGOTIATE_MS
+// passes, then it gets the plain stream, which is called "raw"
+#define SERVER_MAX_VARIANTS 4
+#define SERVER_VARIANT_NAME_MAX 16
+#define SERVER_NEGOTIATE_MS 100
+// longest line a client may send
+#define SERVER_REQUEST_MAX 64
+
 struct socket_list_tag;
+struct latency_tag;
 
 typedef struct buffer_tag {
     uint8_t * data;
     size_t length;
 } buffer_t;
 
+// a chunk pinned until the zerocopy send numbered seq completes
+typedef struct server_zc_pending_tag {
+    uint32_t seq;
+    snapshot_t * chunk;
+} server_zc_pending_t;
+
 typedef struct server_tag {
     int socketfd;
+    int epollfd;
+    int wakefd;
     int wait_queue;
     atomic_int socket_count;
     int completed;
     struct socket_list_tag * sockets;
-    struct buffer_tag buffer;
-    pthread_t listen_thread;
+    pthread_t loop_thread;
+
+    // set when server_write has already signalled wakefd and the loop
+    // has not yet picked it up
+    atomic_int wake_pending;
     
-    VCOS_MUTEX_T mutex;
+    // guards the socket list between server_write and the loop
+    pthread_mutex_t mutex;
+
+    // h264 gop cache, only kept when gop_cache is set.  new clients are 
+    // sent the latest sps/pps and every chunk since the last idr before 
+    // they join the live stream.  guarded by mutex
+    int gop_cache;
+    snapshot_t * config[SERVER_CONFIG_CHUNKS];
+    int config_count;
+    snapshot_t * gop[SERVER_GOP_CHUNKS];
+    int gop_count;
+    size_t gop_bytes;
+    // nal types of the previous chunk
+    uint32_t gop_last_types;
+
+    // start code scanner state carried between writes: the last two bytes
+    // seen and whether the nal header is the first byte of the next write
+    uint8_t nal_last[2];
+    int nal_pending;
+
+    // asks the encoder for an idr when a client joins that the gop cache 
+    // cannot prime.  requests are at least keyframe_interval_ms apart, 
+    // joins in between share the next one.  only touched by the loop
+    encoder_control_t * encoder_control;
+    unsigned int keyframe_interval_ms;
+    int keyframe_pending;
+    uint64_t keyframe_last;
+    unsigned int keyframe_requests;
+
+    // send with MSG_ZEROCOPY to clients whose socket supports it
+    int zerocopy;
 
-    VCOS_SEMAPHORE_T write_ready;
-    VCOS_SEMAPHORE_T write_complete;
+    // dead clients are only ever closed and freed by the loop, after it 
+    // has unlinked them under the mutex.  reap_* is the time from a client
+    // being marked completed to it being freed, written by the loop.
+    // write_wait_max_us is the longest server_write_frame waited for the
+    // mutex, written by the writer
+    unsigned int reaped;
+    uint64_t reap_total_us;
+    uint64_t reap_max_us;
+    uint64_t write_wait_max_us;
+
+    // encodings of the stream, variant 0 is the plain one.  names are set
+    // before clients connect.  variant_clients counts the clients on each
+    // variant, variant_joined is set when one switches to it
+    char variant_names[SERVER_MAX_VARIANTS][SERVER_VARIANT_NAME_MAX];
+    int variant_count;
+    atomic_int variant_clients[SERVER_MAX_VARIANTS];
+    atomic_int variant_joined[SERVER_MAX_VARIANTS];
+
+    // when each client's socket takes the last byte of a frame, the time
+    // since the bus handed it out is recorded here under latency_type
+    struct latency_tag * latency;
+    int latency_type;
 } server_t;
 
 typedef struct socket_list_tag {
     int socket;
-    pthread_t thread;
     server_t * server;
     int completed;
+    // when completed was set, in monotonic microseconds
+    uint64_t completed_at;
     struct socket_list_tag * next;
+
+    // pending chunks for this client.  server_write is the only producer
+    // (under server->mutex) and the loop thread the only consumer
+    snapshot_t * ring[SERVER_RING_SIZE];
+    atomic_uint ring_head;
+    atomic_uint ring_tail;
+
+    // cached chunks to send ahead of the ring, taken when the client
+    // joined.  only touched by the loop thread
+    snapshot_t ** prime;
+    int prime_count;
+    int prime_pos;
+
+    // bytes of the first unsent chunk already sent
+    size_t offset;
+    // the socket returned EAGAIN, wait for EPOLLOUT before sending again
+    int blocked;
+
+    // chunks discarded because the ring was full, and the number of 
+    // separate episodes in which the ring filled up
+    atomic_uint dropped;
+    atomic_uint overflows;
+    int overflowing;
+    // lost a chunk of a gop cached stream, skip ahead to the next idr
+    int resync;
+
+    // MSG_ZEROCOPY state, only touched by the loop thread.  zerocopy is 
+    // set when SO_ZEROCOPY was accepted and zc_active while we still use
+    // it.  every zerocopy sendmsg gets the next sequence number and the 
+    // chunks it covered stay referenced in zc_pending until the kernel
+    // reports that sequence complete on the error queue
+    int zerocopy;
+    int zc_active;
+    uint32_t zc_next;
+    server_zc_pending_t zc_pending[SERVER_ZEROCOPY_PENDING];
+    unsigned int zc_head;
+    unsigned int zc_tail;
+    unsigned int zc_sends;
+    unsigned int zc_copied;
+
+    // the variant this client gets, -1 while it may still choose one.  
+    // guarded by server->mutex
+    int variant;
+    uint64_t joined_at;
+    // the line the client is sending, request_length is -1 once it has 
+    // been handled.  only touched by the loop thread
+    char request[SERVER_REQUEST_MAX];
+    int request_length;
 } socket_list_t;
 
 
 
+// queue a shared frame on every client, each client ring takes its own 
+// reference.  the caller keeps its reference
+int server_write_frame(server_t * server, snapshot_t * frame);
+// copies data into a new frame and queues that
 int server_write(server_t * server, uint8_t * data, size_t length);
 int server_create(server_t * server, int portno);
+
+// add an encoding clients can ask for by name, returns its variant number
+// or -1.  call before any client connects
+int server_add_variant(server_t * server, const char * name);
+// queue a frame on the clients of a variant.  key marks frames a client 
+// can start from, clients that joined or lost a frame wait for one
+int server_write_variant(server_t * server, int variant, snapshot_t * frame, int key);
+// clients on a variant
+int server_variant_clients(server_t * server, int variant);
+// 1 if a client switched to variant since the last call
+int server_variant_joined(server_t * server, int variant);
 int server_close(server_t * server);
 
+// keep the latest h264 gop so new clients can start decoding right away
+void server_enable_gop_cache(server_t * server);
+
+// send large writes with MSG_ZEROCOPY.  call before any client connects
+void server_enable_zerocopy(server_t * server);
+
+// request an idr through control when a client joins, at most once every
+// interval_ms.  call before any client connects
+void server_set_encoder_control(server_t * server, encoder_control_t * control, unsigned int interval_ms);
+
+// record send latencies of frames of type, a frame_type_t.  call before 
+// any client connects
+void server_set_latency(server_t * server, struct latency_tag * latency, int type);
+
 
-#endif
\ No newline at end of file
+#endif
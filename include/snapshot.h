@@ -0,0 +1,96 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+struct snapshot_tag;
+
+// called instead of free() when the last reference to a snapshot goes, 
+// e.g. to return it to a pool or to release a buffer it wraps
+typedef void (*snapshot_recycle_fn)(struct snapshot_tag * s);
+
+// an immutable, reference counted buffer.  the data either follows the 
+// struct or, for wrapped snapshots, belongs to someone else
+typedef struct snapshot_tag {
+    atomic_int refs;
+    // set when published, increases by one with every publish to a slot
+    uint64_t seq;
+    size_t length;
+    uint8_t * data;
+
+    // presentation time in microseconds and MMAL buffer flags of the 
+    // frame this holds, 0 when it did not come from the camera
+    int64_t pts;
+    uint32_t flags;
+    // monotonic microseconds when the frame was posted to the frame bus,
+    // 0 for anything else
+    uint64_t time_us;
+    // and when it was captured, reached the encoder callback and was
+    // handed out by the bus thread, 0 when not known
+    uint64_t sensor_us;
+    uint64_t callback_us;
+    uint64_t published_us;
+
+    // room at data for snapshots that are filled in place
+    size_t capacity;
+
+    snapshot_recycle_fn recycle;
+    void * user;
+
+    // link while sitting in a pool
+    struct snapshot_tag * next;
+} snapshot_t;
+
+// holds the latest snapshot of something.  readers pin the current 
+// snapshot without taking a lock, publishers swap in a new one and drop
+// the old reference once no reader can still be about to pin it
+typedef struct snapshot_slot_tag {
+    _Atomic(snapshot_t *) current;
+
+    // readers register in active[epoch & 1] while they load current
+    atomic_uint epoch;
+    atomic_int active[2];
+
+    // sequence number of the last published snapshot
+    atomic_ullong sequence;
+
+    // serializes publishers, readers never touch it
+    pthread_mutex_t publish;
+} snapshot_slot_t;
+
+// keeps released snapshots for reuse so steady state publishing does not 
+// allocate
+typedef struct snapshot_pool_tag {
+    pthread_mutex_t mutex;
+    snapshot_t * free;
+    int count;
+    int max;
+} snapshot_pool_t;
+
+snapshot_t * snapshot_alloc(size_t capacity);
+snapshot_t * snapshot_create(const uint8_t * data, size_t length);
+snapshot_t * snapshot_wrap(uint8_t * data, size_t length, snapshot_recycle_fn recycle, void * user);
+snapshot_t * snapshot_retain(snapshot_t * s);
+void snapshot_release(snapshot_t * s);
+
+int snapshot_slot_init(snapshot_slot_t * slot);
+void snapshot_slot_destroy(snapshot_slot_t * slot);
+
+// takes ownership of the caller's reference to s, which may be NULL
+void snapshot_slot_publish(snapshot_slot_t * slot, snapshot_t * s);
+
+// returns a new reference to the current snapshot, or NULL if nothing has 
+// been published.  release it with snapshot_release
+snapshot_t * snapshot_slot_pin(snapshot_slot_t * slot);
+
+int snapshot_pool_init(snapshot_pool_t * pool, int max);
+void snapshot_pool_destroy(snapshot_pool_t * pool);
+
+// an empty snapshot with room for at least capacity bytes, reused from the 
+// pool when possible.  it goes back to the pool on its last release
+snapshot_t * snapshot_pool_get(snapshot_pool_t * pool, size_t capacity);
+
+#endif
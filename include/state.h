@@ -1,8 +1,9 @@
 #ifndef __STATE_H__
 #define __STATE_H__
 
-#include "server.h"
-#include "http_server.h"
+#include "pipeline.h"
+#include "capture.h"
+#include "encoder_control.h"
 
 #include "interface/mmal/mmal.h"
 #include "interface/mmal/util/mmal_connection.h"
@@ -10,19 +11,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-typedef struct buffer_list_tag {
-    uint8_t * data;
-    size_t length;
-
-    struct buffer_list_tag * next;
-} buffer_list;
-
 typedef struct {
     char camera_name[MMAL_PARAMETER_CAMERA_INFO_MAX_STR_LEN];
     int width;
     int height;
     uint32_t framerate;
     uint32_t bitrate;
+    // frames between idrs, 0 leaves the encoder default.  new clients 
+    // ask for an idr so this can be long
+    uint32_t intra_period;
     int cameraNum;
     MMAL_COMPONENT_T * camera;
     MMAL_COMPONENT_T * encoder;
@@ -33,8 +30,6 @@ typedef struct {
     MMAL_CONNECTION_T * image_encoder_connection;
     MMAL_POOL_T * encoder_pool;
     MMAL_POOL_T * image_encoder_pool;
-    buffer_list * image_buffer_list;
-    buffer_list ** image_buffer_end;
 
     MMAL_FOURCC_T encoding;
     int profile;
@@ -45,14 +40,29 @@ typedef struct {
     uint32_t jpeg_restart_interval;
     uint32_t jpeg_quality;
 
+    // the jpeg branch only runs while frames are wanted and keeps going 
+    // for jpeg_linger_ms after the last request.  only every 
+    // jpeg_decimation-th splitter frame reaches the image encoder, the 
+    // rest are never encoded
+    uint32_t jpeg_linger_ms;
+    uint32_t jpeg_decimation;
+    uint32_t jpeg_frame_count;
+
     int iso;
     int video_stabilization;
     MMAL_PARAM_EXPOSUREMETERINGMODE_T metering_mode;
     MMAL_PARAM_FLICKERAVOID_T flicker_avoid_mode;
 
-    server_t video_server;
-    server_t motion_server;
-    http_server_t http_server;
+    encoder_control_t encoder_control;
+    // send the video stream with MSG_ZEROCOPY
+    int video_zerocopy;
+
+    // the bus, the servers and the motion analysis
+    pipeline_t pipeline;
+
+    // where to record the encoder output, if anywhere
+    const char * capture_path;
+    capture_t capture;
 } state_t;
 
 #endif
\ No newline at end of file
@@ -1,7 +1,7 @@
 
 #include "state.h"
 #include "components.h"
-#include "server.h"
+#include "capture.h"
 
 #include "bcm_host.h"
 #include "interface/vcos/vcos.h"
@@ -21,6 +21,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
 
 
 
@@ -32,7 +35,12 @@
 #define DEFAULT_WIDTH 1920
 #define DEFAULT_HEIGHT 1080
 #define DEFAULT_BITRATE 25000000
+// ten seconds between idrs, new clients get one on request
+#define DEFAULT_INTRA_PERIOD (10 * DEFAULT_FRAMERATE)
 #define DEFAULT_CAMERA_NUM 0
+// MSG_ZEROCOPY pays off with many clients on a real nic, on loopback the 
+// kernel ends up copying anyway
+#define DEFAULT_VIDEO_ZEROCOPY 0
 
 #define DEFAULT_ENCODING MMAL_ENCODING_H264
 #define DEFAULT_ENCODING_PROFILE MMAL_VIDEO_PROFILE_H264_HIGH
@@ -44,9 +52,22 @@
 #define DEFAULT_VIDEO_STABILIZATION 0
 #define DEFAULT_FLICKERAVOID_MODE MMAL_PARAM_FLICKERAVOID_60HZ
 
+#define DEFAULT_JPEG_LINGER_MS 5000
+#define DEFAULT_JPEG_DECIMATION 1
+
+// how often the main loop looks at jpeg demand when nothing wakes it
+#define JPEG_DEMAND_POLL_MS 500
+
+// wakes the main loop, either to exit or to look at jpeg demand
 VCOS_SEMAPHORE_T interrupt;
+volatile sig_atomic_t interrupted = 0;
 
 void handle_interrupt(int signal) {
+    interrupted = 1;
+    vcos_semaphore_post(&interrupt);
+}
+
+static void handle_frame_demand(void * user) {
     vcos_semaphore_post(&interrupt);
 }
 
@@ -68,76 +89,78 @@ void initialize_state(state_t * state) {
     state->level = DEFAULT_ENCODING_LEVEL;
     state->sensor_mode = DEFAULT_SENSOR_MODE;
     state->bitrate = DEFAULT_BITRATE;
+    state->intra_period = DEFAULT_INTRA_PERIOD;
+    state->video_zerocopy = DEFAULT_VIDEO_ZEROCOPY;
     state->iso = DEFAULT_ISO;
     state->metering_mode = DEFAULT_METERING_MODE;
     state->video_stabilization = DEFAULT_VIDEO_STABILIZATION;
     state->flicker_avoid_mode = DEFAULT_FLICKERAVOID_MODE;
     state->jpeg_quality = 85;
     state->jpeg_restart_interval = 0;
-    state->image_buffer_list = NULL;
-    state->image_buffer_end = &state->image_buffer_list;
+    state->jpeg_linger_ms = DEFAULT_JPEG_LINGER_MS;
+    state->jpeg_decimation = DEFAULT_JPEG_DECIMATION;
+    state->jpeg_frame_count = 0;
+    state->capture_path = NULL;
+    memset(&state->capture, 0, sizeof(state->capture));
 
     state->abort = 0;
     // state->video_file = NULL;
 }
 
 
-static void image_buffer_callback(MMAL_PORT_T * port, MMAL_BUFFER_HEADER_T * buffer) {
-    state_t * state = (state_t*)port->userdata;
-
-    if (buffer->length > 0) {
-        mmal_buffer_header_mem_lock(buffer);
-
-        *state->image_buffer_end = (buffer_list*)malloc(sizeof(buffer_list));
-
-        buffer_list * p = *state->image_buffer_end;
+// the last reader of a frame published straight out of an encoder buffer 
+// is done with it
+static void image_buffer_release(void * user) {
+    MMAL_BUFFER_HEADER_T * buffer = (MMAL_BUFFER_HEADER_T*)user;
 
-        p->data = (uint8_t*)malloc(buffer->length);
-        p->length = buffer->length;
-        p->next = NULL;
+    mmal_buffer_header_mem_unlock(buffer);
+    mmal_buffer_header_release(buffer);
+}
 
-        memcpy(p->data, buffer->data, buffer->length);
-        state->image_buffer_end = &p->next;
+static void image_buffer_callback(MMAL_PORT_T * port, MMAL_BUFFER_HEADER_T * buffer) {
+    uint64_t received = latency_now();
+    state_t * state = (state_t*)port->userdata;
+    frame_assembler_t * assembler = &state->pipeline.image_assembler;
 
-        mmal_buffer_header_mem_unlock(buffer);
+    if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED) {
+        fprintf(stderr, "jpeg frame failed, dropping %zu bytes\n", frame_assembler_length(assembler));
+        frame_assembler_reset(assembler);
+    } else if (buffer->length > 0) {
+        int end = buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+        snapshot_t * frame = NULL;
 
-        // Now flag if we have completed
-        if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END)) {
-            // write the whole buffer list to the http server.
+        mmal_buffer_header_mem_lock(buffer);
 
-            size_t total_size = 0;
-            for(buffer_list * p = state->image_buffer_list; p; p = p->next) {
-                total_size += p->length;
+        // a frame that fits in one buffer is lent to the http server as 
+        // is, as long as there is a spare buffer to keep the encoder busy
+        if (end && frame_assembler_length(assembler) == 0 && 
+            mmal_queue_length(state->image_encoder_pool->queue) > 0) 
+        {
+            frame = frame_assembler_wrap(assembler, buffer->data + buffer->offset, buffer->length, 
+                image_buffer_release, buffer);
+            if (frame != NULL) {
+                mmal_buffer_header_acquire(buffer);
             }
+        }
 
-            if (total_size > 0) {
-                uint8_t * buf = (uint8_t*)malloc(total_size);
-
-                size_t cur = 0;
-                for(buffer_list * p = state->image_buffer_list; p; p = p->next) {
-                    memcpy(buf + cur, p->data, p->length);
-                    cur += p->length;
-                }
-
-                http_server_frame_jpeg(&state->http_server, buf, total_size);
-
-                // free all the memory
-                for(buffer_list * p = state->image_buffer_list; p;) {
-                    buffer_list * t = p->next;
-
-                    free(p->data);
-                    p->data = NULL;
-                    p->length = 0;
-                    p->next = NULL;
-                    free(p);
+        if (frame == NULL) {
+            if (frame_assembler_append(assembler, buffer->data + buffer->offset, buffer->length) != 0) {
+                frame_assembler_reset(assembler);
+            }
+            mmal_buffer_header_mem_unlock(buffer);
 
-                    p = t;
-                }
+            if (end) {
+                frame = frame_assembler_finish(assembler);
             }
         }
 
-        if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED))
-            fprintf(stderr, "frame ended or something: %x\n", buffer->flags);
+        if (frame != NULL) {
+            frame->pts = buffer->pts;
+            frame->flags = buffer->flags;
+            frame->sensor_us = latency_sensor_time(&state->pipeline.latency, buffer->pts);
+            frame->callback_us = received;
+            frame_bus_post(&state->pipeline.bus, PIPELINE_IMAGE_QUEUE, FRAME_JPEG, frame);
+        }
     }
 
     mmal_buffer_header_release(buffer);
@@ -157,7 +180,36 @@ static void image_buffer_callback(MMAL_PORT_T * port, MMAL_BUFFER_HEADER_T * buf
 }
 
 
+// the splitter to image_encoder connection is not tunnelled so frames can
+// be dropped before the gpu encodes them.  the buffers are opaque handles,
+// passing one on or handing it back moves no pixels.  only every 
+// jpeg_decimation-th frame goes on to the image encoder
+static void image_connection_callback(MMAL_CONNECTION_T * connection) {
+    state_t * state = (state_t*)connection->user_data;
+    MMAL_BUFFER_HEADER_T * buffer;
+
+    while ((buffer = mmal_queue_get(connection->queue)) != NULL) {
+        if (buffer->length > 0 && state->jpeg_frame_count++ % state->jpeg_decimation == 0 &&
+            mmal_port_send_buffer(connection->in, buffer) == MMAL_SUCCESS) 
+        {
+            continue;
+        }
+        mmal_buffer_header_release(buffer);
+    }
+
+    // give the splitter back everything the encoder and the dropped frames
+    // are done with
+    while (connection->out->is_enabled && (buffer = mmal_queue_get(connection->pool->queue)) != NULL) {
+        if (mmal_port_send_buffer(connection->out, buffer) != MMAL_SUCCESS) {
+            fprintf(stderr, "could not return a buffer to the splitter\n");
+            mmal_buffer_header_release(buffer);
+            break;
+        }
+    }
+}
+
 static void encoder_buffer_callback(MMAL_PORT_T * port, MMAL_BUFFER_HEADER_T * buffer) {
+    uint64_t received = latency_now();
     MMAL_BUFFER_HEADER_T * new_buffer;
     size_t bytes_written = 0;
 
@@ -166,25 +218,25 @@ static void encoder_buffer_callback(MMAL_PORT_T * port, MMAL_BUFFER_HEADER_T * b
     state_t * state = (state_t*)port->userdata;
 
     if (buffer->length > 0) {
-        mmal_buffer_header_mem_lock(buffer);
-
-        if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO) {
-            // fprintf(stderr, "got motion vectors\n");
-            // motion vectors
-            // do nothing for now
-            server_write(&state->motion_server, buffer->data, buffer->length);
-            http_server_motion(&state->http_server, buffer->data, buffer->length);
+        // one copy out of the encoder buffer, every output shares it
+        snapshot_t * frame = frame_bus_alloc(&state->pipeline.bus, buffer->length);
+
+        if (frame != NULL) {
+            mmal_buffer_header_mem_lock(buffer);
+            memcpy(frame->data, buffer->data + buffer->offset, buffer->length);
+            mmal_buffer_header_mem_unlock(buffer);
+
+            frame->length = buffer->length;
+            frame->pts = buffer->pts;
+            frame->flags = buffer->flags;
+            frame->sensor_us = latency_sensor_time(&state->pipeline.latency, buffer->pts);
+            frame->callback_us = received;
             bytes_written = buffer->length;
-        } else {
-            // fprintf(stderr, "writing video data\n");
-            // video data
-            server_write(&state->video_server, buffer->data, buffer->length);
-            bytes_written = buffer->length;
-            // bytes_written = fwrite(buffer->data, 1, buffer->length, state->video_file);
 
+            // motion vectors or video data
+            frame_type_t type = buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO ? FRAME_MOTION : FRAME_VIDEO;
+            frame_bus_post(&state->pipeline.bus, PIPELINE_ENCODER_QUEUE, type, frame);
         }
-
-        mmal_buffer_header_mem_unlock(buffer);
     }
 
     if (bytes_written != buffer->length) {
@@ -207,9 +259,43 @@ static void encoder_buffer_callback(MMAL_PORT_T * port, MMAL_BUFFER_HEADER_T * b
     }
 }
 
-#define DEFAULT_VIDEO_PORT 8888
-#define DEFAULT_MOTION_PORT 8889
-#define DEFAULT_HTTP_PORT 8080
+// start the jpeg branch when someone wants frames and stop it once they
+// have gone quiet for jpeg_linger_ms
+static void update_jpeg_demand(state_t * state) {
+    MMAL_CONNECTION_T * connection = state->image_encoder_connection;
+    int wanted = http_server_frame_wanted(&state->pipeline.http_server, state->jpeg_linger_ms);
+    MMAL_STATUS_T status;
+
+    if (wanted && !connection->is_enabled) {
+        state->jpeg_frame_count = 0;
+        if ((status = mmal_connection_enable(connection)) != MMAL_SUCCESS) {
+            fprintf(stderr, "could not enable image_encoder connection: %s\n", mmal_status_to_string(status));
+            return;
+        }
+        fprintf(stderr, "jpeg encoder started\n");
+    } else if (!wanted && connection->is_enabled) {
+        http_server_frame_paused(&state->pipeline.http_server);
+
+        if ((status = mmal_connection_disable(connection)) != MMAL_SUCCESS) {
+            fprintf(stderr, "could not disable image_encoder connection: %s\n", mmal_status_to_string(status));
+            return;
+        }
+        fprintf(stderr, "jpeg encoder idle\n");
+    }
+}
+
+// the camera stamps frames with the videocore's stc in microseconds.  the
+// read is a round trip to the videocore, take the stc as read halfway
+static void update_stc_offset(state_t * state) {
+    uint64_t stc;
+    uint64_t before = latency_now();
+
+    if (mmal_port_parameter_get_uint64(state->camera->control, MMAL_PARAMETER_SYSTEM_TIME, &stc) != MMAL_SUCCESS) {
+        return;
+    }
+    uint64_t after = latency_now();
+    latency_set_stc(&state->pipeline.latency, (int64_t)stc, before + (after - before) / 2);
+}
 
 int main(int ac, char ** av) {
     MMAL_STATUS_T status = MMAL_SUCCESS;
@@ -218,6 +304,25 @@ int main(int ac, char ** av) {
 
     initialize_state(&state);
 
+    // -c file records everything the encoders produce, for simplecam-replay.
+    // -l ms keeps the jpeg branch running that long after the last request,
+    // -d n encodes only every nth frame into a jpeg
+    int opt;
+    while ((opt = getopt(ac, av, "c:l:d:")) != -1) {
+        switch(opt) {
+        case 'c': state.capture_path = optarg; break;
+        case 'l': state.jpeg_linger_ms = strtoul(optarg, NULL, 10); break;
+        case 'd': state.jpeg_decimation = strtoul(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "usage: %s [-c capture-file] [-l jpeg-linger-ms] [-d jpeg-decimation]\n", av[0]);
+            return -1;
+        }
+    }
+    if (state.jpeg_decimation == 0) {
+        fprintf(stderr, "jpeg decimation must be at least 1\n");
+        return -1;
+    }
+
     MMAL_PORT_T * camera_preview_port = NULL;
     MMAL_PORT_T * camera_video_port = NULL;
     MMAL_PORT_T * camera_still_port = NULL;
@@ -232,39 +337,34 @@ int main(int ac, char ** av) {
     bcm_host_init();
     vcos_log_register("simplecam", VCOS_LOG_CATEGORY);
 
-    if (server_create(&state.video_server, DEFAULT_VIDEO_PORT) != 0) {
-        fprintf(stderr, "could not create server\n");
-        vcos_log_error("could not create server");
+    if (pipeline_init(&state.pipeline) != 0) {
         goto cleanup;
     }
-
-    if (server_create(&state.motion_server, DEFAULT_MOTION_PORT) != 0) {
-        fprintf(stderr, "could not create motion vector server\n");
-        goto cleanup;
+    if (state.video_zerocopy) {
+        server_enable_zerocopy(&state.pipeline.video_server);
     }
 
-    if (http_server_create(&state.http_server, DEFAULT_HTTP_PORT) != 0) {
-        fprintf(stderr, "could not create http server\n");
-        goto cleanup;
-    }
-
-    char config[4096];
-    int config_length = snprintf(config, sizeof(config),
-            "video: \":%d\"\n"
-            "motion: \":%d\"\n"
-            "api: \":%d\"\n",
-            DEFAULT_VIDEO_PORT,
-            DEFAULT_MOTION_PORT,
-            DEFAULT_HTTP_PORT);
-
-    http_server_config(&state.http_server, (uint8_t*)config, config_length);
-
     get_sensor_defaults(state.cameraNum, state.camera_name, &state.width, &state.height);
 
     fprintf(stderr, "sensor defaults: %s -- %dx%d\n", state.camera_name, state.width, state.height);
 
     check_camera_model(state.cameraNum);
 
+    // motion buffers that do not match the field are skipped until this
+    if (pipeline_set_resolution(&state.pipeline, state.width, state.height) != 0) {
+        goto cleanup;
+    }
+
+    if (state.capture_path != NULL) {
+        // recorded off the bus, before the camera posts anything
+        if (capture_create(&state.capture, state.capture_path, state.width, state.height, state.framerate) != 0 ||
+            capture_subscribe(&state.capture, &state.pipeline.bus) != 0) 
+        {
+            goto cleanup;
+        }
+        fprintf(stderr, "recording to %s\n", state.capture_path);
+    }
+
     if ((status = create_camera_component(&state)) != MMAL_SUCCESS) {
         fprintf(stderr, "failed to create camera component\n"); 
         goto cleanup;
@@ -275,6 +375,10 @@ int main(int ac, char ** av) {
         goto cleanup;
     }
 
+    // joining video clients ask for an idr rather than waiting out the gop
+    encoder_control_mmal(&state.encoder_control, state.encoder);
+    server_set_encoder_control(&state.pipeline.video_server, &state.encoder_control, SERVER_KEYFRAME_INTERVAL_MS);
+
     if ((status = mmal_component_create(MMAL_COMPONENT_DEFAULT_SPLITTER, &state.splitter)) != MMAL_SUCCESS) {
         fprintf(stderr, "could not create splitter component %s\n", mmal_status_to_string(status));
         goto cleanup;
@@ -324,17 +428,18 @@ int main(int ac, char ** av) {
     }
 
 
+    // not tunnelled, image_connection_callback decides which frames the 
+    // image encoder sees
     if ((status = mmal_connection_create(&state.image_encoder_connection, splitter_output_port1, image_encoder_input,
-        MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT)) != MMAL_SUCCESS) 
+        MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT)) != MMAL_SUCCESS) 
     {
         fprintf(stderr, "could not create splitter to image_encoder connection\n");
         goto cleanup;
     }
+    state.image_encoder_connection->callback = image_connection_callback;
+    state.image_encoder_connection->user_data = (void*)&state;
 
-    if ((status = mmal_connection_enable(state.image_encoder_connection)) != MMAL_SUCCESS) {
-        fprintf(stderr, "could not enable image_encoder connection\n");
-        goto cleanup;
-    }
+    // the image_encoder connection is enabled on demand by update_jpeg_demand
 
     encoder_output_port->userdata = (struct MMAL_PORT_USERDATA_T*)&state;
     image_encoder_output->userdata = (struct MMAL_PORT_USERDATA_T*)&state;
@@ -364,7 +469,8 @@ int main(int ac, char ** av) {
         goto cleanup;
     }
      
-    for(int num = mmal_queue_length(state.image_encoder_pool->queue); num > 0; num--) {
+    // the spare buffers stay in the pool
+    for(int num = image_encoder_output->buffer_num; num > 0; num--) {
         MMAL_BUFFER_HEADER_T * buffer = mmal_queue_get(state.image_encoder_pool->queue);
 
         if (!buffer) {
@@ -379,6 +485,9 @@ int main(int ac, char ** av) {
         fprintf(stderr, "enabled buffer %d\n", num);
     }
 
+    // frames carry stc pts from the first one on
+    update_stc_offset(&state);
+
     // start capturing
     if((status = mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, MMAL_TRUE)) != MMAL_SUCCESS) {
         fprintf(stderr, "unable to start capture: %s\n", mmal_status_to_string(status));
@@ -387,10 +496,18 @@ int main(int ac, char ** av) {
 
 
     vcos_semaphore_create(&interrupt, "simplecam_interrupt", 0);
+    http_server_on_frame_demand(&state.pipeline.http_server, handle_frame_demand, NULL);
 
-    // wait until interrupted
+    // wait until interrupted, starting and stopping the jpeg branch as 
+    // frames are wanted, keeping the stc offset from drifting and saving
+    // the motion background off the bus thread
     signal(SIGINT, handle_interrupt);
-    vcos_semaphore_wait(&interrupt);
+    while (!interrupted) {
+        vcos_semaphore_wait_timeout(&interrupt, JPEG_DEMAND_POLL_MS);
+        update_jpeg_demand(&state);
+        update_stc_offset(&state);
+        pipeline_persist(&state.pipeline);
+    }
     signal(SIGINT, SIG_DFL);
     
 
@@ -399,9 +516,18 @@ cleanup:
 
     mmal_status_to_int(status);
 
-    server_close(&state.video_server);
-    server_close(&state.motion_server);
-    http_server_destroy(&state.http_server);
+    // no more callbacks posting into the pipeline once the encoder outputs
+    // are off, then the frames still queued give their buffers back before
+    // any of mmal goes away
+    if (encoder_output_port != NULL && encoder_output_port->is_enabled) {
+        mmal_port_disable(encoder_output_port);
+    }
+    if (image_encoder_output != NULL && image_encoder_output->is_enabled) {
+        mmal_port_disable(image_encoder_output);
+    }
+    pipeline_stop(&state.pipeline);
+    // the writer still holds frames from the bus, some lent by the encoder
+    capture_close(&state.capture);
 
     if (state.encoder_connection != NULL) {
         if (state.encoder_connection->is_enabled) {
@@ -420,9 +546,6 @@ cleanup:
     if (camera_video_port != NULL && camera_video_port->is_enabled) {
         mmal_port_disable(camera_video_port);
     }
-    if (encoder_output_port != NULL && encoder_output_port->is_enabled) {
-        mmal_port_disable(encoder_output_port);
-    }
     if (state.encoder_connection != NULL) {
         mmal_connection_destroy(state.encoder_connection);
     }
@@ -439,6 +562,8 @@ cleanup:
         mmal_component_destroy(state.image_encoder);
     }
 
+    pipeline_destroy(&state.pipeline);
+
     // if (state.video_file != NULL) {
     //     fclose(state.video_file);
     // }
@@ -0,0 +1,71 @@
+#include "pipeline.h"
+#include "replay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+// runs the servers and the motion analysis from a capture recorded with
+// simplecam -c, on any linux box.  -f replays as fast as the bus takes the
+// frames instead of at the recorded pace and -l starts over at the end
+
+#define REPLAY_POLL_US 100000
+
+volatile sig_atomic_t interrupted = 0;
+
+static void handle_interrupt(int signal) {
+    interrupted = 1;
+}
+
+int main(int ac, char ** av) {
+    pipeline_t pipeline;
+    replay_t replay;
+    int realtime = 1;
+    int loop = 0;
+    int exit_code = 0;
+    int opt;
+
+    while ((opt = getopt(ac, av, "fl")) != -1) {
+        if (opt == 'f') {
+            realtime = 0;
+        } else if (opt == 'l') {
+            loop = 1;
+        } else {
+            break;
+        }
+    }
+    if (optind != ac - 1) {
+        fprintf(stderr, "usage: %s [-f] [-l] capture-file\n", av[0]);
+        return -1;
+    }
+
+    if (replay_open(&replay, &pipeline, av[optind], realtime, loop) != 0) {
+        return -1;
+    }
+
+    if (pipeline_init(&pipeline) != 0 ||
+        pipeline_set_resolution(&pipeline, replay.capture.header.width, replay.capture.header.height) != 0 ||
+        replay_start(&replay) != 0) 
+    {
+        exit_code = -1;
+        goto cleanup;
+    }
+
+    signal(SIGINT, handle_interrupt);
+    while (!interrupted && !replay_finished(&replay)) {
+        usleep(REPLAY_POLL_US);
+        pipeline_persist(&pipeline);
+    }
+    signal(SIGINT, SIG_DFL);
+
+cleanup:
+    fprintf(stderr, "cleaning up...\n");
+
+    replay_close(&replay);
+    pipeline_stop(&pipeline);
+    pipeline_destroy(&pipeline);
+
+    return exit_code;
+}
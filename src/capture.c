@@ -0,0 +1,253 @@
+#include "capture.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+_Static_assert(sizeof(capture_header_t) == 24, "capture header layout");
+_Static_assert(sizeof(capture_record_t) == 32, "capture record layout");
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// write one record and its data, on the writer thread
+static int record_write(capture_t * capture, capture_record_t * r, const uint8_t * data) {
+    if (fwrite(r, sizeof(*r), 1, capture->file) != 1 || 
+        (r->length > 0 && fwrite(data, r->length, 1, capture->file) != 1)) 
+    {
+        perror("could not write capture, recording stopped");
+        return -1;
+    }
+    return 0;
+}
+
+static void * writer_thread(void * user) {
+    capture_t * capture = (capture_t*)user;
+
+    pthread_mutex_lock(&capture->mutex);
+    while (1) {
+        if (capture->head == capture->tail) {
+            if (capture->stopping) {
+                break;
+            }
+            pthread_cond_wait(&capture->ready, &capture->mutex);
+            continue;
+        }
+
+        capture_entry_t e = capture->queue[capture->head % CAPTURE_QUEUE_SIZE];
+        capture->head++;
+        int failed = capture->failed;
+        pthread_mutex_unlock(&capture->mutex);
+
+        // the two bus queues are published in turn, keep the times in order
+        if (e.record.time_us < capture->last_time_us) {
+            e.record.time_us = capture->last_time_us;
+        }
+        capture->last_time_us = e.record.time_us;
+
+        int status = failed ? 0 : record_write(capture, &e.record, e.frame->data);
+        snapshot_release(e.frame);
+
+        pthread_mutex_lock(&capture->mutex);
+        if (status != 0) {
+            capture->failed = 1;
+        }
+    }
+    pthread_mutex_unlock(&capture->mutex);
+
+    return NULL;
+}
+
+int capture_create(capture_t * capture, const char * path, int width, int height, uint32_t framerate) {
+    capture_header_t * h = &capture->header;
+
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, CAPTURE_MAGIC, sizeof(h->magic));
+    h->version = CAPTURE_VERSION;
+    h->width = width;
+    h->height = height;
+    h->framerate = framerate;
+    capture->failed = 0;
+    capture->start_us = now_us();
+    capture->head = 0;
+    capture->tail = 0;
+    capture->writing = 0;
+    capture->stopping = 0;
+    capture->last_time_us = 0;
+    capture->dropped = 0;
+
+    if ((capture->file = fopen(path, "wb")) == NULL) {
+        perror("could not create capture");
+        return -1;
+    }
+    if (fwrite(h, sizeof(*h), 1, capture->file) != 1) {
+        perror("could not write capture");
+        goto error;
+    }
+    if (pthread_mutex_init(&capture->mutex, NULL) != 0) {
+        fprintf(stderr, "could not create capture mutex\n");
+        goto error;
+    }
+    if (pthread_cond_init(&capture->ready, NULL) != 0) {
+        fprintf(stderr, "could not create capture condition\n");
+        pthread_mutex_destroy(&capture->mutex);
+        goto error;
+    }
+    if (pthread_create(&capture->thread, NULL, writer_thread, capture) != 0) {
+        fprintf(stderr, "could not start capture writer\n");
+        pthread_cond_destroy(&capture->ready);
+        pthread_mutex_destroy(&capture->mutex);
+        goto error;
+    }
+    capture->writing = 1;
+
+    return 0;
+
+error:
+    fclose(capture->file);
+    capture->file = NULL;
+    return -1;
+}
+
+// queue a reference to frame for the writer, on the bus thread.  a whole
+// published frame is one record, so a jpeg always ends its frame
+static void capture_post(capture_t * capture, frame_type_t type, snapshot_t * frame) {
+    uint64_t arrived = frame->callback_us != 0 ? frame->callback_us : now_us();
+
+    pthread_mutex_lock(&capture->mutex);
+    if (capture->failed) {
+        pthread_mutex_unlock(&capture->mutex);
+        return;
+    }
+    if (capture->tail - capture->head == CAPTURE_QUEUE_SIZE) {
+        capture->dropped++;
+        pthread_mutex_unlock(&capture->mutex);
+        return;
+    }
+
+    capture_entry_t * e = &capture->queue[capture->tail % CAPTURE_QUEUE_SIZE];
+    memset(&e->record, 0, sizeof(e->record));
+    e->record.type = type;
+    e->record.marks = type == FRAME_JPEG ? CAPTURE_FRAME_END : 0;
+    e->record.flags = frame->flags;
+    e->record.pts = frame->pts;
+    e->record.time_us = arrived > capture->start_us ? arrived - capture->start_us : 0;
+    e->record.length = frame->length;
+    e->frame = snapshot_retain(frame);
+    capture->tail++;
+
+    pthread_cond_signal(&capture->ready);
+    pthread_mutex_unlock(&capture->mutex);
+}
+
+static void capture_video(void * user, snapshot_t * frame) {
+    capture_post((capture_t*)user, FRAME_VIDEO, frame);
+}
+
+static void capture_motion(void * user, snapshot_t * frame) {
+    capture_post((capture_t*)user, FRAME_MOTION, frame);
+}
+
+static void capture_jpeg(void * user, snapshot_t * frame) {
+    capture_post((capture_t*)user, FRAME_JPEG, frame);
+}
+
+int capture_subscribe(capture_t * capture, frame_bus_t * bus) {
+    if (frame_bus_subscribe(bus, FRAME_VIDEO, capture_video, capture) != 0 ||
+        frame_bus_subscribe(bus, FRAME_MOTION, capture_motion, capture) != 0 ||
+        frame_bus_subscribe(bus, FRAME_JPEG, capture_jpeg, capture) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int capture_open(capture_t * capture, const char * path) {
+    capture_header_t * h = &capture->header;
+
+    capture->failed = 0;
+    capture->writing = 0;
+    if ((capture->file = fopen(path, "rb")) == NULL) {
+        perror("could not open capture");
+        return -1;
+    }
+
+    if (fread(h, sizeof(*h), 1, capture->file) != 1 ||
+        memcmp(h->magic, CAPTURE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != CAPTURE_VERSION)
+    {
+        fprintf(stderr, "%s is not a capture\n", path);
+        fclose(capture->file);
+        capture->file = NULL;
+        return -1;
+    }
+    if (pthread_mutex_init(&capture->mutex, NULL) != 0) {
+        fprintf(stderr, "could not create capture mutex\n");
+        fclose(capture->file);
+        capture->file = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int capture_read(capture_t * capture, capture_record_t * record, uint8_t ** data, size_t * capacity) {
+    if (fread(record, sizeof(*record), 1, capture->file) != 1) {
+        // a record cut short by the recording being killed ends it too
+        return 0;
+    }
+    if (record->type >= FRAME_TYPE_COUNT) {
+        fprintf(stderr, "capture record of unknown type %u\n", record->type);
+        return -1;
+    }
+
+    if (record->length > *capacity) {
+        uint8_t * grown = realloc(*data, record->length);
+        if (grown == NULL) {
+            fprintf(stderr, "could not allocate %u byte capture record\n", record->length);
+            return -1;
+        }
+        *data = grown;
+        *capacity = record->length;
+    }
+
+    if (record->length > 0 && fread(*data, record->length, 1, capture->file) != 1) {
+        return 0;
+    }
+    return 1;
+}
+
+int capture_rewind(capture_t * capture) {
+    if (fseek(capture->file, sizeof(capture_header_t), SEEK_SET) != 0) {
+        perror("could not rewind capture");
+        return -1;
+    }
+    return 0;
+}
+
+void capture_close(capture_t * capture) {
+    if (capture->file == NULL) {
+        return;
+    }
+    if (capture->writing) {
+        pthread_mutex_lock(&capture->mutex);
+        capture->stopping = 1;
+        pthread_cond_signal(&capture->ready);
+        pthread_mutex_unlock(&capture->mutex);
+        pthread_join(capture->thread, NULL);
+        pthread_cond_destroy(&capture->ready);
+        capture->writing = 0;
+
+        if (capture->dropped > 0) {
+            fprintf(stderr, "capture fell behind, %llu frames not recorded\n", capture->dropped);
+        }
+    }
+    if (fclose(capture->file) != 0) {
+        perror("could not close capture");
+    }
+    capture->file = NULL;
+    pthread_mutex_destroy(&capture->mutex);
+}
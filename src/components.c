@@ -366,7 +366,7 @@ MMAL_STATUS_T create_image_encoder_component(state_t * state) {
 
    mmal_format_copy(out->format, in->format);
    out->format->encoding = MMAL_ENCODING_JPEG; // TODO: replace with variable
-   out->buffer_size = out->buffer_num_recommended;
+   out->buffer_size = out->buffer_size_recommended;
    if (out->buffer_size < out->buffer_size_min)
       out->buffer_size = out->buffer_size_min;
    out->buffer_num = out->buffer_num_recommended;
@@ -400,7 +400,7 @@ MMAL_STATUS_T create_image_encoder_component(state_t * state) {
       goto error;
    }
 
-   pool = mmal_port_pool_create(out, out->buffer_num, out->buffer_size);
+   pool = mmal_port_pool_create(out, out->buffer_num + IMAGE_ENCODER_SPARE_BUFFERS, out->buffer_size);
    if (!pool) {
       fprintf(stderr, "failed to create buffer pool for port %s\n", out->name);
       goto error;
@@ -519,6 +519,14 @@ MMAL_STATUS_T create_encoder_component(state_t * state) {
         // Continue rather than abort..
     }
 
+    if (state->intra_period > 0) {
+        if (mmal_port_parameter_set_uint32(encoder_output, MMAL_PARAMETER_INTRAPERIOD, state->intra_period) != MMAL_SUCCESS)
+        {
+            fprintf(stderr, "failed to set intra period\n");
+            // Continue rather than abort..
+        }
+    }
+
     //set INLINE VECTORS flag to request motion vector estimates
     if (mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS, MMAL_TRUE) != MMAL_SUCCESS)
     {
@@ -556,6 +564,21 @@ error:
     return status;
 }
 
+static int mmal_request_keyframe(encoder_control_t * control) {
+    MMAL_COMPONENT_T * encoder = (MMAL_COMPONENT_T*)control->user;
+
+    if (mmal_port_parameter_set_boolean(encoder->output[0], MMAL_PARAMETER_VIDEO_REQUEST_I_FRAME, MMAL_TRUE) != MMAL_SUCCESS) {
+        fprintf(stderr, "could not request an I-frame\n");
+        return -1;
+    }
+    return 0;
+}
+
+void encoder_control_mmal(encoder_control_t * control, MMAL_COMPONENT_T * encoder) {
+    control->request_keyframe = mmal_request_keyframe;
+    control->user = encoder;
+}
+
 void get_sensor_defaults(int camera_num, char *camera_name, int *width, int *height )
 {
    MMAL_COMPONENT_T *camera_info;
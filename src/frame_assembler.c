@@ -0,0 +1,143 @@
+#include "frame_assembler.h"
+
+#include <stdio.h>
+#include <string.h>
+
+int frame_assembler_init(frame_assembler_t * a, size_t capacity, int pool_size) {
+    a->frame = NULL;
+    a->capacity = capacity;
+    a->grown = 0;
+
+    if (snapshot_pool_init(&a->pool, pool_size) != 0) {
+        return -1;
+    }
+
+    a->free_wrappers = NULL;
+    for(int i = 0; i < FRAME_ASSEMBLER_WRAPPERS; i++) {
+        a->wrappers[i].assembler = a;
+        a->wrappers[i].next = a->free_wrappers;
+        a->free_wrappers = &a->wrappers[i];
+    }
+
+    // fill the pool up front so the first frames do not allocate either
+    snapshot_t * warm[pool_size];
+    int n = 0;
+    for(; n < pool_size; n++) {
+        if ((warm[n] = snapshot_pool_get(&a->pool, capacity)) == NULL) {
+            break;
+        }
+    }
+    for(int i = 0; i < n; i++) {
+        snapshot_release(warm[i]);
+    }
+
+    return 0;
+}
+
+void frame_assembler_destroy(frame_assembler_t * a) {
+    snapshot_release(a->frame);
+    a->frame = NULL;
+
+    // frames handed out go back to the pool when released, so whoever
+    // holds them has to be gone by now
+    snapshot_pool_destroy(&a->pool);
+}
+
+int frame_assembler_append(frame_assembler_t * a, const uint8_t * data, size_t length) {
+    size_t have = a->frame != NULL ? a->frame->length : 0;
+
+    if (a->frame == NULL || have + length > a->frame->capacity) {
+        size_t capacity = a->capacity;
+        while (capacity < have + length) {
+            capacity *= 2;
+        }
+
+        snapshot_t * s = snapshot_pool_get(&a->pool, capacity);
+        if (s == NULL) {
+            fprintf(stderr, "could not get a %zu byte frame buffer\n", capacity);
+            return -1;
+        }
+
+        if (a->frame != NULL) {
+            // outgrew the buffer mid frame, this only happens until the
+            // pool has caught up with the frame size
+            memcpy(s->data, a->frame->data, have);
+            s->length = have;
+            snapshot_release(a->frame);
+            a->grown++;
+        }
+
+        a->frame = s;
+        a->capacity = capacity;
+    }
+
+    memcpy(a->frame->data + have, data, length);
+    a->frame->length = have + length;
+
+    return 0;
+}
+
+size_t frame_assembler_length(frame_assembler_t * a) {
+    return a->frame != NULL ? a->frame->length : 0;
+}
+
+snapshot_t * frame_assembler_finish(frame_assembler_t * a) {
+    snapshot_t * s = a->frame;
+    a->frame = NULL;
+
+    return s;
+}
+
+static void wrapper_recycle(snapshot_t * s) {
+    frame_wrapper_t * w = (frame_wrapper_t*)s;
+    frame_assembler_t * a = w->assembler;
+
+    w->release(w->user);
+
+    pthread_mutex_lock(&a->pool.mutex);
+    w->next = a->free_wrappers;
+    a->free_wrappers = w;
+    pthread_mutex_unlock(&a->pool.mutex);
+}
+
+snapshot_t * frame_assembler_wrap(frame_assembler_t * a, uint8_t * data, size_t length, 
+    void (*release)(void * user), void * user) 
+{
+    pthread_mutex_lock(&a->pool.mutex);
+    frame_wrapper_t * w = a->free_wrappers;
+    if (w != NULL) {
+        a->free_wrappers = w->next;
+    }
+    pthread_mutex_unlock(&a->pool.mutex);
+
+    if (w == NULL) {
+        return NULL;
+    }
+
+    w->release = release;
+    w->user = user;
+    w->next = NULL;
+
+    snapshot_t * s = &w->snapshot;
+    atomic_init(&s->refs, 1);
+    s->seq = 0;
+    s->length = length;
+    s->data = data;
+    s->pts = 0;
+    s->flags = 0;
+    s->time_us = 0;
+    s->sensor_us = 0;
+    s->callback_us = 0;
+    s->published_us = 0;
+    s->capacity = length;
+    s->recycle = wrapper_recycle;
+    s->user = NULL;
+    s->next = NULL;
+
+    return s;
+}
+
+void frame_assembler_reset(frame_assembler_t * a) {
+    snapshot_release(a->frame);
+    a->frame = NULL;
+}
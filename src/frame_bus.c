@@ -0,0 +1,214 @@
+#include "frame_bus.h"
+#include "latency.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int frame_bus_init(frame_bus_t * bus) {
+    for(int t = 0; t < FRAME_TYPE_COUNT; t++) {
+        bus->subscriber_count[t] = 0;
+    }
+
+    for(int q = 0; q < FRAME_BUS_QUEUES; q++) {
+        atomic_init(&bus->queues[q].head, 0);
+        atomic_init(&bus->queues[q].tail, 0);
+        atomic_init(&bus->queues[q].dropped, 0);
+    }
+    atomic_init(&bus->wake_pending, 0);
+    bus->running = 0;
+    bus->latency = NULL;
+
+    if (sem_init(&bus->wake, 0, 0) != 0) {
+        perror("could not create frame bus semaphore");
+        return -1;
+    }
+
+    for(int i = 0; i < FRAME_BUS_CLASSES; i++) {
+        if (snapshot_pool_init(&bus->pools[i], FRAME_BUS_POOL_SIZE) != 0) {
+            while(i-- > 0) {
+                snapshot_pool_destroy(&bus->pools[i]);
+            }
+            sem_destroy(&bus->wake);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int queue_pop(frame_queue_t * q, frame_queue_entry_t * e) {
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    if (head == tail) {
+        return 0;
+    }
+
+    *e = q->entries[head % FRAME_BUS_QUEUE_SIZE];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+    return 1;
+}
+
+void frame_bus_drain(frame_bus_t * bus) {
+    frame_queue_entry_t e;
+
+    for(int q = 0; q < FRAME_BUS_QUEUES; q++) {
+        while (queue_pop(&bus->queues[q], &e)) {
+            snapshot_release(e.frame);
+        }
+    }
+}
+
+void frame_bus_destroy(frame_bus_t * bus) {
+    frame_bus_stop(bus);
+
+    // whatever was posted after the thread stopped
+    frame_bus_drain(bus);
+    for(int q = 0; q < FRAME_BUS_QUEUES; q++) {
+        if (atomic_load(&bus->queues[q].dropped) > 0) {
+            fprintf(stderr, "frame bus queue %d dropped %u frames\n", q, atomic_load(&bus->queues[q].dropped));
+        }
+    }
+
+    sem_destroy(&bus->wake);
+
+    for(int i = 0; i < FRAME_BUS_CLASSES; i++) {
+        snapshot_pool_destroy(&bus->pools[i]);
+    }
+}
+
+int frame_bus_subscribe(frame_bus_t * bus, frame_type_t type, frame_bus_fn fn, void * user) {
+    if (bus->subscriber_count[type] == FRAME_BUS_MAX_SUBSCRIBERS) {
+        fprintf(stderr, "too many subscribers for frame type %d\n", type);
+        return -1;
+    }
+
+    frame_subscriber_t * s = &bus->subscribers[type][bus->subscriber_count[type]++];
+    s->fn = fn;
+    s->user = user;
+
+    return 0;
+}
+
+void frame_bus_set_latency(frame_bus_t * bus, latency_t * latency) {
+    bus->latency = latency;
+}
+
+snapshot_t * frame_bus_alloc(frame_bus_t * bus, size_t length) {
+    int c = 0;
+    while (c < FRAME_BUS_CLASSES && ((size_t)1 << (FRAME_BUS_MIN_SHIFT + c)) < length) {
+        c++;
+    }
+
+    if (c == FRAME_BUS_CLASSES) {
+        // bigger than anything we pool, this should not happen with the
+        // encoder buffer sizes we ask for
+        return snapshot_alloc(length);
+    }
+
+    return snapshot_pool_get(&bus->pools[c], (size_t)1 << (FRAME_BUS_MIN_SHIFT + c));
+}
+
+void frame_bus_publish(frame_bus_t * bus, frame_type_t type, snapshot_t * frame) {
+    // before any subscriber can have taken a reference
+    frame->published_us = now_us();
+    if (bus->latency != NULL) {
+        latency_frame_published(bus->latency, type, frame);
+    }
+
+    for(int i = 0; i < bus->subscriber_count[type]; i++) {
+        frame_subscriber_t * s = &bus->subscribers[type][i];
+        s->fn(s->user, frame);
+    }
+
+    snapshot_release(frame);
+}
+
+int frame_bus_post(frame_bus_t * bus, int queue, frame_type_t type, snapshot_t * frame) {
+    frame_queue_t * q = &bus->queues[queue];
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+    if (tail - head >= FRAME_BUS_QUEUE_SIZE) {
+        atomic_fetch_add(&q->dropped, 1);
+        snapshot_release(frame);
+        return -1;
+    }
+
+    frame->time_us = now_us();
+    q->entries[tail % FRAME_BUS_QUEUE_SIZE].type = type;
+    q->entries[tail % FRAME_BUS_QUEUE_SIZE].frame = frame;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+    // one wake up per batch the thread has not seen yet
+    if (!atomic_exchange(&bus->wake_pending, 1)) {
+        sem_post(&bus->wake);
+    }
+
+    return 0;
+}
+
+int frame_bus_backlog(frame_bus_t * bus, int queue) {
+    frame_queue_t * q = &bus->queues[queue];
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+    return tail - head;
+}
+
+static void * bus_thread(void * user) {
+    frame_bus_t * bus = (frame_bus_t*)user;
+    frame_queue_entry_t e;
+
+    while (bus->running) {
+        while (sem_wait(&bus->wake) != 0) {
+            // EINTR
+        }
+
+        // clear before draining so a post that races with us wakes us again
+        atomic_store(&bus->wake_pending, 0);
+
+        int more = 1;
+        while (more) {
+            more = 0;
+            for(int q = 0; q < FRAME_BUS_QUEUES; q++) {
+                if (queue_pop(&bus->queues[q], &e)) {
+                    frame_bus_publish(bus, e.type, e.frame);
+                    more = 1;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int frame_bus_start(frame_bus_t * bus) {
+    bus->running = 1;
+
+    int s = pthread_create(&bus->thread, NULL, bus_thread, (void*)bus);
+    if (s != 0) {
+        fprintf(stderr, "could not create frame bus thread: %d\n", s);
+        bus->running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+void frame_bus_stop(frame_bus_t * bus) {
+    if (!bus->running) {
+        return;
+    }
+
+    bus->running = 0;
+    sem_post(&bus->wake);
+    pthread_join(bus->thread, NULL);
+}
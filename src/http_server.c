@@ -1,28 +1,48 @@
 
 #include "http_server.h"
+#include "motion_codec.h"
+#include "latency.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <stdatomic.h>
-
-#include <interface/vcos/vcos.h>
-#include <interface/vcos/vcos_mutex.h>
-#include <interface/vcos/vcos_semaphore.h>
-#include <interface/mmal/mmal_logging.h>
+#include <time.h>
 
 const char invalid_request[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+const char unavailable_message[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
 const char ok_message[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n\r\nok";
-const char response_header_format[] = "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %d\r\n\r\n";
+const char response_header_format[] = "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: %s\r\n%s\r\n";
+
+const char not_modified_format[] = "HTTP/1.1 304 Not Modified\r\nConnection: %s\r\n%s\r\n";
+// a 204 must not have a Content-Length
+const char no_content_format[] = "HTTP/1.1 204 No Content\r\nConnection: %s\r\n%s\r\n";
 
 const char mime_image_jpeg[] = "image/jpeg";
 const char mime_text_plain[] = "text/plain";
 const char mime_octet_stream[] = "application/octet-stream";
 const char mime_motion_jpeg[] = "video/x-motion-jpeg";
+const char mime_ndjson[] = "application/x-ndjson";
+const char mime_json[] = "application/json";
+
+const char stream_header[] = "HTTP/1.1 200 OK\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=" HTTP_STREAM_BOUNDARY "\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: close\r\n\r\n";
+// every part but the first starts by closing the previous one
+const char stream_part_format[] = "%s--" HTTP_STREAM_BOUNDARY "\r\n"
+    "Content-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n";
 
 const char route_ping[] = "/ping";
 const char route_config[] = "/config";
@@ -30,23 +50,89 @@ const char route_frame[] = "/frame.jpg";
 const char route_frame_raw[] = "/frame.raw";
 const char route_motion[] = "/motion.bin";
 const char route_video[] = "/video.jpg";
-
-static int parser_message_complete(http_parser * parser) {
-    // http_processor_t * p = (http_processor_t*)parser->data;
-
-    return 0;
-}
+const char route_events[] = "/events";
+const char route_zones[] = "/zones";
+const char route_zone_scores[] = "/zones/scores";
+const char route_history[] = "/motion/history";
+const char route_history_grid[] = "/motion/history/grid";
+const char route_latency[] = "/latency";
+
+// epoll data for the listening socket and the eventfd, connections use
+// their generation and slot index
+#define EVENT_LISTEN UINT64_MAX
+#define EVENT_WAKE (UINT64_MAX - 1)
+
+// the latest history time in ms that still fits in microseconds, with the
+// 999 serve_history_grid adds
+#define HISTORY_MS_MAX (UINT64_MAX / 1000 - 1)
 
 struct __buffer {
     const char * data;
     size_t length;
 };
 
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int parser_message_complete(http_parser * parser) {
+    http_conn_t * c = (http_conn_t*)parser->data;
+
+    c->keep_alive = http_should_keep_alive(parser);
+
+    // stop here so pipelined requests behind this one stay unparsed until 
+    // this one has been answered
+    http_parser_pause(parser, 1);
+
+    return 0;
+}
+
 int processor_get_url(http_parser * parser, const char * at, size_t length) {
-    struct __buffer * buf = (struct __buffer *)parser->data;
+    http_conn_t * c = (http_conn_t*)parser->data;
+
+    // the url may arrive in pieces, but they are contiguous in the input buffer
+    if (c->url_length == 0) {
+        c->url_offset = at - c->in;
+    }
+    c->url_length += length;
+
+    return 0;
+}
+
+int processor_header_field(http_parser * parser, const char * at, size_t length) {
+    http_conn_t * c = (http_conn_t*)parser->data;
+
+    // a field right after a value starts a new header, otherwise this
+    // continues the previous piece
+    if (c->in_header_value || c->field_length == 0) {
+        c->field_offset = at - c->in;
+        c->field_length = 0;
+        c->in_header_value = 0;
+    }
+    c->field_length += length;
+
+    return 0;
+}
+
+int processor_header_value(http_parser * parser, const char * at, size_t length) {
+    http_conn_t * c = (http_conn_t*)parser->data;
+    static const char if_none_match[] = "If-None-Match";
+
+    if (!c->in_header_value) {
+        c->in_header_value = 1;
+        c->field_is_if_none_match = c->field_length == sizeof(if_none_match) - 1 &&
+            strncasecmp(c->in + c->field_offset, if_none_match, c->field_length) == 0;
 
-    buf->data = at;
-    buf->length = length;
+        if (c->field_is_if_none_match) {
+            c->if_none_match_offset = at - c->in;
+            c->if_none_match_length = 0;
+        }
+    }
+    if (c->field_is_if_none_match) {
+        c->if_none_match_length += length;
+    }
 
     return 0;
 }
@@ -55,283 +141,1181 @@ int is_route(const char * route, struct __buffer * buf) {
     return strlen(route) == buf->length && strncmp(route, buf->data, buf->length) == 0;
 }
 
-// maximum requeset size: 4096
-void * processor_thread(void * user) {
-    fprintf(stderr, "starting processor thread.\n");
-    http_processor_t * p = (http_processor_t*)user;
-    http_server_t * server = p->server;
+// allocate a response around an already formatted header, with room for
+// an inline body
+static http_response_t * response_alloc(const char * header, size_t header_length, size_t body_length, size_t inline_length) {
+    http_response_t * r = (http_response_t*)malloc(sizeof(http_response_t) + header_length + inline_length);
+    if (r == NULL) {
+        return NULL;
+    }
 
-    http_parser parser;
-    http_parser_settings parser_settings;
+    memcpy(r->data, header, header_length);
+    r->header_length = header_length;
+    r->snapshot = NULL;
+    r->body = r->data + header_length;
+    r->body_length = body_length;
+    r->offset = 0;
+    r->frame_type = -1;
+    r->next = NULL;
 
-    struct __buffer url_buf = {
-        .data = NULL,
-        .length = 0
-    };
+    return r;
+}
 
-    http_parser_init(&parser, HTTP_REQUEST);
-    parser.data = (void*)&url_buf;
-    http_parser_settings_init(&parser_settings);
-    // parser_settings.on_message_complete = parser_message_complete;
-    parser_settings.on_url = processor_get_url;
+// allocate a response with its header written and room for an inline body
+static http_response_t * response_create(http_conn_t * c, int status, const char * content_type, const char * extra_headers, size_t body_length, size_t inline_length) {
+    const char * status_name = http_status_str(status);
+    char header[512];
 
-    static const int bufsiz = 4096;
-    char buffer[bufsiz];
-    int ps;
+    int header_length = snprintf(header, sizeof(header), response_header_format 
+        ,status  // status
+        ,status_name              // status message
+        ,content_type                 // content-type
+        ,body_length     // content-length
+        ,c->keep_alive ? "keep-alive" : "close"
+        ,extra_headers ? extra_headers : ""
+    );
 
+    return response_alloc(header, header_length, body_length, inline_length);
+}
 
-    fprintf(stderr, "reading from socket\n");
+static void response_append(http_conn_t * c, http_response_t * r) {
+    *c->out_tail = r;
+    c->out_tail = &r->next;
+    c->out_count++;
+}
 
-    int bytes_read = recv(p->sock, buffer, bufsiz-1, MSG_NOSIGNAL);
+static void response_free(http_response_t * r) {
+    snapshot_release(r->snapshot);
+    free(r);
+}
 
-    fprintf(stderr, "read %d bytes\n", bytes_read);
-    if (bytes_read < 0) {
-        perror("error on socket recv");
-        goto cleanup;
-    } else if (bytes_read == 0) {
-        fprintf(stderr, "error or no bytes read from socket\n");
-        goto cleanup;
+// append a response to the connection output queue, the body is copied
+static int queue_http_response(http_conn_t * c, int status, const char * content_type, const char * data, size_t length) {
+    if (data == NULL) {
+        length = 0;
     }
-    
-    buffer[bytes_read] = '\0';
-    fprintf(stderr, "read: %s", buffer);
-
-    if ((ps = http_parser_execute(&parser, &parser_settings, buffer, bytes_read)) < bytes_read) {
-        fprintf(stderr, "error: parsed bytes %d of %d\n", ps, bytes_read);
-        const char * msg = "invalid http request";
-        send_http_response(p->sock,
-            HTTP_STATUS_BAD_REQUEST, mime_text_plain,
-            msg, strlen(msg));
-        // TODO: send 4XX error
-        goto cleanup;
+
+    http_response_t * r = response_create(c, status, content_type, NULL, length, length);
+    if (r == NULL) {
+        return -1;
+    }
+
+    if (length > 0) {
+        memcpy(r->data + r->header_length, data, length);
+    }
+    response_append(c, r);
+
+    return 0;
+}
+
+// the ETag suffix for the representation the connection asked for
+static const char * etag_suffix(http_conn_t * c) {
+    return c->motion_rle ? "-rle" : "";
+}
+
+// headers identifying a snapshot, its ETag is the boot id and sequence number
+// plus the representation
+static void snapshot_headers(http_conn_t * c, snapshot_t * s, char * extra, size_t size) {
+    int length = snprintf(extra, size, 
+        "X-Sequence: %llu\r\nETag: \"%08x-%llu%s\"\r\nCache-Control: no-cache\r\n", 
+        (unsigned long long)s->seq, c->worker->server->boot_id, (unsigned long long)s->seq, etag_suffix(c));
+
+    // when the frame entered the bus, on this host's monotonic clock, so
+    // a client on the same host can tell how long delivery took
+    if (s->time_us != 0) {
+        snprintf(extra + length, size - length, "X-Timestamp: %llu\r\n", (unsigned long long)s->time_us);
+    }
+}
+
+// does the request If-None-Match name the snapshot
+static int snapshot_not_modified(http_conn_t * c, snapshot_t * s) {
+    char etag[64];
+
+    if (c->if_none_match_length == 0) {
+        return 0;
+    }
+
+    const char * value = c->in + c->if_none_match_offset;
+    size_t length = c->if_none_match_length;
+
+    if (length == 1 && value[0] == '*') {
+        return 1;
+    }
+
+    int etag_length = snprintf(etag, sizeof(etag), "\"%08x-%llu%s\"", 
+        c->worker->server->boot_id, (unsigned long long)s->seq, etag_suffix(c));
+
+    // the header may list several tags, weak or not
+    return memmem(value, length, etag, etag_length) != NULL;
+}
+
+// answer 304 for a snapshot the client already has, taking over the
+// caller's reference
+static int queue_not_modified(http_conn_t * c, snapshot_t * s) {
+    char extra[192];
+    char header[256];
+
+    snapshot_headers(c, s, extra, sizeof(extra));
+    snapshot_release(s);
+
+    int header_length = snprintf(header, sizeof(header), not_modified_format,
+        c->keep_alive ? "keep-alive" : "close", extra);
+
+    http_response_t * r = response_alloc(header, header_length, 0, 0);
+    if (r == NULL) {
+        return -1;
+    }
+    response_append(c, r);
+
+    return 0;
+}
+
+// a standalone motion codec keyframe of s, which it releases
+static snapshot_t * encode_motion(snapshot_t * s) {
+    snapshot_t * e = snapshot_alloc(motion_codec_bound(s->length));
+
+    if (e != NULL) {
+        e->length = motion_codec_encode_key(s->data, s->length, (uint32_t)s->seq, e->data, e->capacity);
+        e->seq = s->seq;
+        e->pts = s->pts;
+        e->time_us = s->time_us;
+        e->sensor_us = s->sensor_us;
+        e->callback_us = s->callback_us;
+        e->published_us = s->published_us;
     }
+    snapshot_release(s);
+    return e;
+}
+
+// append a response whose body is a pinned snapshot, taking over the 
+// caller's reference.  nothing is copied and no lock is held while sending.
+// the snapshot sequence number goes out as X-Sequence and in the ETag
+static int queue_http_snapshot(http_conn_t * c, int status, const char * content_type, snapshot_t * s, int frame_type) {
+    char extra[192] = "";
+
+    if (s != NULL && c->motion_rle) {
+        s = encode_motion(s);
+    }
+
+    if (s != NULL) {
+        snapshot_headers(c, s, extra, sizeof(extra));
+    }
+
+    http_response_t * r = response_create(c, status, content_type, extra, s ? s->length : 0, 0);
+    if (r == NULL) {
+        snapshot_release(s);
+        return -1;
+    }
+
+    if (s != NULL) {
+        r->snapshot = s;
+        r->body = s->data;
+        r->frame_type = frame_type;
+    }
+    response_append(c, r);
+
+    return 0;
+}
 
-    fprintf(stderr, "parsed: %d\n", parser.method);
+static void idle_unlink(http_worker_t * w, http_conn_t * c) {
+    if (c->idle_prev == NULL && w->idle_head != c) {
+        // not on the list
+        return;
+    }
+    if (c->idle_prev) {
+        c->idle_prev->idle_next = c->idle_next;
+    } else {
+        w->idle_head = c->idle_next;
+    }
+    if (c->idle_next) {
+        c->idle_next->idle_prev = c->idle_prev;
+    } else {
+        w->idle_tail = c->idle_prev;
+    }
+    c->idle_prev = NULL;
+    c->idle_next = NULL;
+}
 
-    if (parser.method != HTTP_GET) {
-        // TODO: send 4XX error
+static void idle_append(http_worker_t * w, http_conn_t * c) {
+    c->idle_prev = w->idle_tail;
+    c->idle_next = NULL;
+    if (w->idle_tail) {
+        w->idle_tail->idle_next = c;
+    } else {
+        w->idle_head = c;
+    }
+    w->idle_tail = c;
+}
+
+// mark activity, moving the connection to the back of the idle list
+static void conn_touch(http_worker_t * w, http_conn_t * c, uint64_t now) {
+    c->last_active = now;
+    if (c->waiting) {
+        // long polls are timed by their own deadline
+        return;
+    }
+    if (w->idle_tail != c) {
+        idle_unlink(w, c);
+        idle_append(w, c);
+    }
+}
+
+// split the url into its path and query string
+static void split_url(http_conn_t * c, struct __buffer * path, struct __buffer * query) {
+    const char * url = c->in + c->url_offset;
+    const char * q = memchr(url, '?', c->url_length);
+
+    path->data = url;
+    path->length = q ? (size_t)(q - url) : c->url_length;
+    query->data = q ? q + 1 : NULL;
+    query->length = q ? c->url_length - path->length - 1 : 0;
+}
+
+// look up name in a query string.  returns 1 and points value at it if found
+static int query_param(struct __buffer * query, const char * name, struct __buffer * value) {
+    size_t name_length = strlen(name);
+    const char * p = query->data;
+    const char * end = query->data + query->length;
+
+    while (p != NULL && p < end) {
+        const char * amp = memchr(p, '&', end - p);
+        const char * next = amp ? amp : end;
+
+        if ((size_t)(next - p) > name_length && p[name_length] == '=' && 
+            strncmp(p, name, name_length) == 0) 
+        {
+            value->data = p + name_length + 1;
+            value->length = next - value->data;
+            return 1;
+        }
+        p = amp ? amp + 1 : NULL;
+    }
+    return 0;
+}
+
+static unsigned long long buffer_to_ull(struct __buffer * b) {
+    char tmp[32];
+    size_t n = b->length < sizeof(tmp) - 1 ? b->length : sizeof(tmp) - 1;
+
+    memcpy(tmp, b->data, n);
+    tmp[n] = '\0';
+    return strtoull(tmp, NULL, 10);
+}
+
+// the bus frame type published to slot, -1 for slots that hold anything else
+static int slot_frame_type(http_server_t * server, snapshot_slot_t * slot) {
+    if (slot == &server->frame) {
+        return FRAME_JPEG;
+    }
+    if (slot == &server->motion) {
+        return FRAME_MOTION;
+    }
+    return -1;
+}
+
+// queue the latest frame on a stream subscriber if it is ready for one.
+// returns 1 if a part was queued
+static int stream_push(http_conn_t * c, uint64_t now) {
+    http_server_t * server = c->worker->server;
+
+    // still sending the previous frame, we will come back when it is done
+    if (c->out_head != NULL) {
+        return 0;
+    }
+    if (c->stream_interval_ms > 0 && now - c->stream_last_sent < c->stream_interval_ms) {
+        return 0;
+    }
+
+    snapshot_t * s = snapshot_slot_pin(&server->frame);
+    if (s == NULL || s->seq <= c->stream_seq) {
+        snapshot_release(s);
+        return 0;
+    }
+
+    char header[256];
+    int header_length = snprintf(header, sizeof(header), stream_part_format,
+        c->stream_sent > 0 ? "\r\n" : "", s->length);
+
+    http_response_t * r = response_alloc(header, header_length, s->length, 0);
+    if (r == NULL) {
+        snapshot_release(s);
+        return 0;
+    }
+    r->snapshot = s;
+    r->body = s->data;
+    r->frame_type = FRAME_JPEG;
+    response_append(c, r);
+
+    if (c->stream_seq > 0) {
+        c->stream_skipped += s->seq - c->stream_seq - 1;
+    }
+    c->stream_seq = s->seq;
+    c->stream_last_sent = now;
+    c->stream_sent++;
+
+    return 1;
+}
+
+// turn the connection into a jpeg stream subscriber
+static void stream_start(http_conn_t * c, struct __buffer * query) {
+    http_worker_t * w = c->worker;
+    struct __buffer value;
+
+    http_response_t * r = response_alloc(stream_header, sizeof(stream_header) - 1, 0, 0);
+    if (r == NULL) {
+        c->closing = 1;
+        return;
+    }
+    response_append(c, r);
+
+    c->streaming = 1;
+    c->stream_seq = 0;
+    c->stream_last_sent = 0;
+    c->stream_interval_ms = 0;
+    c->stream_sent = 0;
+    c->stream_skipped = 0;
+
+    if (query_param(query, "fps", &value)) {
+        unsigned long long fps = buffer_to_ull(&value);
+        if (fps > 0) {
+            c->stream_interval_ms = 1000 / fps;
+        }
+    }
+
+    atomic_fetch_add(&w->stream_count, 1);
+    atomic_fetch_add(&w->server->stream_subscribers, 1);
+
+    if (atomic_load(&w->server->frame_stale)) {
+        // skip the old frame and wait for the encoder to start
+        c->stream_seq = atomic_load(&w->server->frame.sequence);
+        if (w->server->frame_demand != NULL) {
+            w->server->frame_demand(w->server->frame_demand_user);
+        }
+    }
+}
+
+static void stream_stop(http_conn_t * c) {
+    http_worker_t * w = c->worker;
+
+    fprintf(stderr, "jpeg stream closed: %llu frames sent, %llu skipped\n",
+        (unsigned long long)c->stream_sent, (unsigned long long)c->stream_skipped);
+
+    c->streaming = 0;
+    atomic_fetch_sub(&w->stream_count, 1);
+    atomic_fetch_sub(&w->server->stream_subscribers, 1);
+}
+
+static void wait_finish(http_conn_t * c) {
+    http_server_t * server = c->worker->server;
+
+    c->waiting = 0;
+    atomic_fetch_sub(&c->worker->waiter_count, 1);
+    if (c->wait_slot == &server->frame) {
+        atomic_fetch_sub(&server->frame_waiters, 1);
+    }
+}
+
+// answer a parked long poll if something newer has been published or it
+// has run out of time.  returns 1 once the poll has been answered
+static int wait_check(http_conn_t * c, uint64_t now) {
+    snapshot_t * s = snapshot_slot_pin(c->wait_slot);
+
+    if (s != NULL && s->seq > c->wait_after) {
+        queue_http_snapshot(c, HTTP_STATUS_OK, c->wait_type, s, slot_frame_type(c->worker->server, c->wait_slot));
+    } else if (s != NULL && c->wait_fallback && now >= c->wait_deadline) {
+        // the cached frame can be minutes old, keep it out of the latencies
+        queue_http_snapshot(c, HTTP_STATUS_OK, c->wait_type, s, -1);
+    } else if (now >= c->wait_deadline) {
+        // nothing new, tell the client where the sequence is so it can poll again
+        char extra[64];
+        char header[128];
+        snprintf(extra, sizeof(extra), "X-Sequence: %llu\r\n", 
+            (unsigned long long)atomic_load(&c->wait_slot->sequence));
+        snapshot_release(s);
+
+        int header_length = snprintf(header, sizeof(header), no_content_format,
+            c->keep_alive ? "keep-alive" : "close", extra);
+        http_response_t * r = response_alloc(header, header_length, 0, 0);
+        if (r != NULL) {
+            response_append(c, r);
+        }
+    } else {
+        snapshot_release(s);
+        return 0;
+    }
+
+    wait_finish(c);
+
+    // back under the idle timeout
+    conn_touch(c->worker, c, now);
+
+    return 1;
+}
+
+// park the connection until slot publishes something newer than after
+static void wait_start(http_conn_t * c, snapshot_slot_t * slot, const char * content_type, 
+    uint64_t after, uint64_t timeout, int fallback) 
+{
+    http_server_t * server = c->worker->server;
+
+    c->waiting = 1;
+    c->wait_slot = slot;
+    c->wait_type = content_type;
+    c->wait_after = after;
+    c->wait_deadline = now_ms() + timeout;
+    c->wait_fallback = fallback;
+    atomic_fetch_add(&c->worker->waiter_count, 1);
+    if (slot == &server->frame) {
+        atomic_fetch_add(&server->frame_waiters, 1);
+    }
+
+    // the wait has its own deadline
+    idle_unlink(c->worker, c);
+
+    wait_check(c, now_ms());
+}
+
+// answer with the current snapshot of slot, or with ?after=N park the 
+// connection until a snapshot newer than N is published
+static void serve_snapshot(http_conn_t * c, snapshot_slot_t * slot, const char * content_type, struct __buffer * query) {
+    http_server_t * server = c->worker->server;
+    struct __buffer value;
+    int frame = slot == &server->frame;
+
+    if (frame) {
+        atomic_store(&server->frame_requested, now_ms());
+
+        if (atomic_load(&server->frame_stale) && server->frame_demand != NULL) {
+            server->frame_demand(server->frame_demand_user);
+        }
+    }
+
+    if (!query_param(query, "after", &value)) {
+        if (frame && atomic_load(&server->frame_stale)) {
+            // the encoder is starting back up, hand out the next frame 
+            // rather than an old one
+            wait_start(c, slot, content_type, atomic_load(&slot->sequence), HTTP_FRAME_WAKE_MS, 1);
+            return;
+        }
+
+        snapshot_t * s = snapshot_slot_pin(slot);
+
+        if (s != NULL && snapshot_not_modified(c, s)) {
+            queue_not_modified(c, s);
+        } else {
+            queue_http_snapshot(c, HTTP_STATUS_OK, content_type, s, -1);
+        }
+        return;
+    }
+
+    uint64_t timeout = HTTP_LONGPOLL_DEFAULT_MS;
+    struct __buffer timeout_value;
+    if (query_param(query, "timeout", &timeout_value)) {
+        timeout = buffer_to_ull(&timeout_value);
+        if (timeout > HTTP_LONGPOLL_MAX_MS) {
+            timeout = HTTP_LONGPOLL_MAX_MS;
+        }
+    }
+
+    wait_start(c, slot, content_type, buffer_to_ull(&value), timeout, 0);
+}
+
+// change and list the motion zones
+static void serve_zones(http_conn_t * c, struct __buffer * query) {
+    http_server_t * server = c->worker->server;
+    char out[HTTP_ZONES_MAX];
+
+    if (server->zones == NULL) {
+        queue_http_response(c, HTTP_STATUS_NOT_FOUND, mime_text_plain, "not found\n", 10);
+        return;
+    }
+
+    int length = server->zones(server->zones_user, query->data, query->length, out, sizeof(out));
+    if (length < 0) {
+        queue_http_response(c, HTTP_STATUS_BAD_REQUEST, mime_text_plain, out, strlen(out));
+        return;
+    }
+    queue_http_response(c, HTTP_STATUS_OK, mime_json, out, length);
+}
+
+static uint64_t wall_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// motion records between from and to, ms since the epoch.  a response cut
+// short by limit says where to carry on in X-History-Next
+static void serve_history(http_conn_t * c, struct __buffer * query) {
+    http_server_t * server = c->worker->server;
+    struct __buffer value;
+    char extra[64] = "";
+
+    if (server->history == NULL) {
+        queue_http_response(c, HTTP_STATUS_NOT_FOUND, mime_text_plain, "not found\n", 10);
+        return;
+    }
+
+    uint64_t to = query_param(query, "to", &value) ? buffer_to_ull(&value) : wall_ms();
+    uint64_t from = query_param(query, "from", &value) ? buffer_to_ull(&value) : 
+        to > HTTP_HISTORY_DEFAULT_MS ? to - HTTP_HISTORY_DEFAULT_MS : 0;
+    int limit = HTTP_HISTORY_LIMIT_DEFAULT;
+    if (query_param(query, "limit", &value)) {
+        unsigned long long n = buffer_to_ull(&value);
+        limit = n == 0 ? -1 : n > HTTP_HISTORY_LIMIT_MAX ? HTTP_HISTORY_LIMIT_MAX : (int)n;
+    }
+    if (from > HISTORY_MS_MAX || to > HISTORY_MS_MAX || limit < 0) {
+        const char * msg = "bad from, to or limit\n";
+        queue_http_response(c, HTTP_STATUS_BAD_REQUEST, mime_text_plain, msg, strlen(msg));
+        return;
+    }
+
+    size_t size = (size_t)limit * MOTION_HISTORY_LINE_MAX;
+    char * out = malloc(size);
+    if (out == NULL) {
+        queue_http_response(c, HTTP_STATUS_SERVICE_UNAVAILABLE, mime_text_plain, NULL, 0);
+        return;
+    }
+
+    uint64_t next;
+    size_t length = motion_history_format(server->history, from * 1000, to * 1000, limit, out, size, &next);
+    if (next > 0) {
+        snprintf(extra, sizeof(extra), "X-History-Next: %llu\r\n", (unsigned long long)(next / 1000));
+    }
+
+    http_response_t * r = response_create(c, HTTP_STATUS_OK, mime_ndjson, extra, length, length);
+    if (r != NULL) {
+        memcpy(r->data + r->header_length, out, length);
+        response_append(c, r);
+    }
+    free(out);
+}
+
+// the motion codec keyframe kept closest before at, 404 if there is none
+static void serve_history_grid(http_conn_t * c, struct __buffer * query) {
+    http_server_t * server = c->worker->server;
+    struct __buffer value;
+    motion_record_t record;
+    char extra[96];
+
+    if (server->history == NULL) {
+        queue_http_response(c, HTTP_STATUS_NOT_FOUND, mime_text_plain, "not found\n", 10);
+        return;
+    }
+
+    uint64_t at = query_param(query, "at", &value) ? buffer_to_ull(&value) : wall_ms();
+    if (at > HISTORY_MS_MAX) {
+        const char * msg = "bad at\n";
+        queue_http_response(c, HTTP_STATUS_BAD_REQUEST, mime_text_plain, msg, strlen(msg));
+        return;
+    }
+    uint8_t * out = malloc(HTTP_HISTORY_GRID_MAX);
+    if (out == NULL) {
+        queue_http_response(c, HTTP_STATUS_SERVICE_UNAVAILABLE, mime_text_plain, NULL, 0);
+        return;
+    }
+
+    size_t length = motion_history_grid(server->history, at * 1000 + 999, out, HTTP_HISTORY_GRID_MAX, &record);
+    if (length == 0) {
+        queue_http_response(c, HTTP_STATUS_NOT_FOUND, mime_text_plain, "not found\n", 10);
+        free(out);
+        return;
+    }
+
+    snprintf(extra, sizeof(extra), "X-History-Time: %llu\r\nX-History-Pts: %lld\r\n",
+        (unsigned long long)(record.time_us / 1000), (long long)record.pts);
+    http_response_t * r = response_create(c, HTTP_STATUS_OK, mime_octet_stream, extra, length, length);
+    if (r != NULL) {
+        memcpy(r->data + r->header_length, out, length);
+        response_append(c, r);
+    }
+    free(out);
+}
+
+// the latency histograms, ?reset=1 starts them over once read
+static void serve_latency(http_conn_t * c, struct __buffer * query) {
+    http_server_t * server = c->worker->server;
+    struct __buffer value;
+    char out[LATENCY_FORMAT_MAX];
+
+    if (server->latency == NULL) {
+        queue_http_response(c, HTTP_STATUS_NOT_FOUND, mime_text_plain, "not found\n", 10);
+        return;
+    }
+
+    size_t length = latency_format(server->latency, out, sizeof(out));
+    if (query_param(query, "reset", &value) && buffer_to_ull(&value) != 0) {
+        latency_reset(server->latency);
+    }
+    queue_http_response(c, HTTP_STATUS_OK, mime_ndjson, out, length);
+}
+
+static void process_request(http_conn_t * c) {
+    http_server_t * server = c->worker->server;
+
+    c->motion_rle = 0;
+
+    struct __buffer url_buf, query;
+    split_url(c, &url_buf, &query);
+
+    if (c->parser.method != HTTP_GET) {
         const char * msg = "method not supported";
-        send_http_response(p->sock, 
+        queue_http_response(c, 
             HTTP_STATUS_METHOD_NOT_ALLOWED, 
             mime_text_plain,
             msg, strlen(msg));
-
-        goto cleanup;
+        return;
     }
     
     if (is_route(route_ping, &url_buf)) {
-        send_http_response(p->sock, HTTP_STATUS_OK, mime_text_plain, url_buf.data, url_buf.length);
+        queue_http_response(c, HTTP_STATUS_OK, mime_text_plain, url_buf.data, url_buf.length);
     } else if (is_route(route_config, &url_buf)) {
-        pthread_mutex_lock(&p->server->mutex);
-        send_http_response(p->sock, HTTP_STATUS_OK, mime_text_plain, p->server->config, p->server->config_size);
-        pthread_mutex_unlock(&p->server->mutex);
+        serve_snapshot(c, &server->config, mime_text_plain, &query);
     } else if (is_route(route_frame, &url_buf)) {
-        pthread_mutex_lock(&p->server->mutex);
-        send_http_response(p->sock, HTTP_STATUS_OK, mime_image_jpeg, p->server->frame, p->server->frame_size);
-        pthread_mutex_unlock(&p->server->mutex);
+        serve_snapshot(c, &server->frame, mime_image_jpeg, &query);
     } else if (is_route(route_motion, &url_buf)) {
-        pthread_mutex_lock(&p->server->mutex);
-        send_http_response(p->sock, HTTP_STATUS_OK, mime_octet_stream, p->server->motion, p->server->motion_size);
-        pthread_mutex_unlock(&p->server->mutex);
+        struct __buffer enc;
+        c->motion_rle = query_param(&query, "enc", &enc) && enc.length == 3 && strncmp(enc.data, "rle", 3) == 0;
+        serve_snapshot(c, &server->motion, mime_octet_stream, &query);
+    } else if (is_route(route_zones, &url_buf)) {
+        serve_zones(c, &query);
+    } else if (is_route(route_zone_scores, &url_buf)) {
+        serve_snapshot(c, &server->zone_scores, mime_json, &query);
+    } else if (is_route(route_events, &url_buf)) {
+        serve_snapshot(c, &server->events, mime_ndjson, &query);
+    } else if (is_route(route_history, &url_buf)) {
+        serve_history(c, &query);
+    } else if (is_route(route_history_grid, &url_buf)) {
+        serve_history_grid(c, &query);
+    } else if (is_route(route_latency, &url_buf)) {
+        serve_latency(c, &query);
+    } else if (is_route(route_video, &url_buf)) {
+        stream_start(c, &query);
     } else {
-        send_http_response(p->sock, HTTP_STATUS_NOT_FOUND, mime_text_plain, "not found\n", 10);
+        queue_http_response(c, HTTP_STATUS_NOT_FOUND, mime_text_plain, "not found\n", 10);
     }
+}
 
+static uint64_t conn_event_data(http_worker_t * w, http_conn_t * c) {
+    return ((uint64_t)c->generation << 32) | (uint64_t)(c - w->conns);
+}
 
-cleanup:
+static http_conn_t * conn_acquire(http_worker_t * w, int sock, struct sockaddr_in * addr) {
+    if (w->free_head < 0) {
+        return NULL;
+    }
 
-    // shutdown(p->sock, SHUT_RDWR);
-    close(p->sock);
-    p->closed = 1;
+    http_conn_t * c = &w->conns[w->free_head];
+    w->free_head = c->next_free;
+    w->conn_count++;
+
+    c->sock = sock;
+    c->generation++;
+    c->next_free = -1;
+    c->client_addr = *addr;
+    c->keep_alive = 0;
+    c->read_closed = 0;
+    c->closing = 0;
+    c->url_offset = 0;
+    c->url_length = 0;
+    c->field_length = 0;
+    c->in_header_value = 0;
+    c->field_is_if_none_match = 0;
+    c->if_none_match_length = 0;
+    c->in_length = 0;
+    c->parsed = 0;
+    c->out_head = NULL;
+    c->out_tail = &c->out_head;
+    c->out_count = 0;
+    c->streaming = 0;
+    c->waiting = 0;
+
+    http_parser_init(&c->parser, HTTP_REQUEST);
+    c->parser.data = (void*)c;
+
+    c->last_active = now_ms();
+    idle_append(w, c);
+
+    return c;
+}
 
-    // fprintf(stderr, "processor cleanup %x\n", server);
-    fprintf(stderr, "server %d\n", server->processor_count);
+// close the connection and put its slot back on the free list
+static void conn_release(http_worker_t * w, http_conn_t * c) {
+    if (c->streaming) {
+        stream_stop(c);
+    }
+    if (c->waiting) {
+        wait_finish(c);
+    }
 
-    sem_post(&server->processor_cleanup);
+    close(c->sock);
+    c->sock = -1;
 
-    return NULL;
+    while (c->out_head != NULL) {
+        http_response_t * r = c->out_head;
+        c->out_head = r->next;
+        response_free(r);
+    }
+    c->out_tail = &c->out_head;
+    c->out_count = 0;
+
+    idle_unlink(w, c);
+
+    c->next_free = w->free_head;
+    w->free_head = c - w->conns;
+    w->conn_count--;
 }
 
-int send_http_response(int sock, int status, const char * content_type, const char * data, size_t length) {
-    const char * status_name = http_status_str(status);
-    int ret = 0;
+// send queued responses in order, several per call when pipelining.
+// returns 1 when everything has gone out, 0 if the socket is full and -1 
+// on error
+static int conn_flush(http_conn_t * c) {
+    http_server_t * server = c->worker->server;
+    struct iovec iov[HTTP_MAX_IOV];
 
-    char buf[512];
+    while (c->out_head != NULL) {
+        int n = 0;
 
-    snprintf(buf, sizeof(buf), response_header_format 
-        ,status  // status
-        ,status_name              // status message
-        ,content_type                 // content-type
-        ,length     // content-length
-    );
+        for(http_response_t * r = c->out_head; r && n + 2 <= HTTP_MAX_IOV; r = r->next) {
+            size_t offset = r->offset;
+
+            if (offset < r->header_length) {
+                iov[n].iov_base = r->data + offset;
+                iov[n].iov_len = r->header_length - offset;
+                n++;
+                offset = r->header_length;
+            }
+            if (r->body_length > 0) {
+                iov[n].iov_base = (void*)(r->body + (offset - r->header_length));
+                iov[n].iov_len = r->body_length - (offset - r->header_length);
+                n++;
+            }
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+
+        ssize_t s = sendmsg(c->sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (s < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
 
-    int s = 0;
-    s = send(sock, buf, strlen(buf), 0);
-    if(s < 0) {
-        return s;
+        // retire every response that went out completely
+        size_t sent = (size_t)s;
+        uint64_t now = 0;
+        while (c->out_head != NULL && sent > 0) {
+            http_response_t * r = c->out_head;
+            size_t left = r->header_length + r->body_length - r->offset;
+
+            if (sent < left) {
+                r->offset += sent;
+                break;
+            }
+            sent -= left;
+
+            if (r->frame_type >= 0 && server->latency != NULL && r->snapshot->published_us != 0) {
+                if (now == 0) {
+                    now = latency_now();
+                }
+                latency_frame_sent(server->latency, r->frame_type, r->snapshot, now);
+            }
+
+            c->out_head = r->next;
+            if (c->out_head == NULL) {
+                c->out_tail = &c->out_head;
+            }
+            c->out_count--;
+            response_free(r);
+        }
+
+        // responses with nothing left to send, e.g. empty ones
+        while (c->out_head != NULL && 
+            c->out_head->offset == c->out_head->header_length + c->out_head->body_length) 
+        {
+            http_response_t * r = c->out_head;
+            c->out_head = r->next;
+            if (c->out_head == NULL) {
+                c->out_tail = &c->out_head;
+            }
+            c->out_count--;
+            response_free(r);
+        }
     }
-    ret += s;
+    return 1;
+}
 
-    if (data != NULL) {
-        s = send(sock, data, length, 0);
-        if(s < 0) {
-            return s;
+// read into the free space of the input buffer.  returns the number of 
+// bytes read, 0 if nothing was waiting and -1 once the peer has gone
+static int conn_read(http_conn_t * c) {
+    for(;;) {
+        ssize_t r = recv(c->sock, c->in + c->in_length, sizeof(c->in) - c->in_length, MSG_DONTWAIT);
+        if (r > 0) {
+            c->in_length += r;
+            return r;
+        }
+        if (r < 0 && errno == EINTR) {
+            continue;
         }
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        return -1;
+    }
+}
+
+// feed buffered input to the parser.  returns 1 when a full request is
+// ready, 0 if more input is needed and -1 on a malformed request
+static int conn_parse(http_conn_t * c, http_parser_settings * settings) {
+    if (c->parsed == c->in_length) {
+        return 0;
+    }
+
+    c->parsed += http_parser_execute(&c->parser, settings, 
+        c->in + c->parsed, c->in_length - c->parsed);
+
+    if (HTTP_PARSER_ERRNO(&c->parser) == HPE_PAUSED) {
+        http_parser_pause(&c->parser, 0);
+        return 1;
     }
 
-    return ret + s;
+    return HTTP_PARSER_ERRNO(&c->parser) == HPE_OK ? 0 : -1;
 }
 
-void * cleanup_thread(void * user) {
-    http_server_t * server = (http_server_t*)user;
+// drop the request just answered from the input buffer
+static void conn_next_request(http_conn_t * c) {
+    memmove(c->in, c->in + c->parsed, c->in_length - c->parsed);
+    c->in_length -= c->parsed;
+    c->parsed = 0;
+    c->url_offset = 0;
+    c->url_length = 0;
+    c->field_length = 0;
+    c->in_header_value = 0;
+    c->field_is_if_none_match = 0;
+    c->if_none_match_length = 0;
+}
+
+// read, answer and write as far as the socket allows.  returns -1 once the
+// connection is finished and should be released
+static int conn_service(http_conn_t * c, http_parser_settings * settings, uint64_t now) {
+    for(;;) {
+        int progress = 0;
 
-    int done = 0;
+        if (!c->read_closed && !c->closing && c->in_length < sizeof(c->in)) {
+            int r = conn_read(c);
+            if (r < 0) {
+                c->read_closed = 1;
+            }
+            progress |= r > 0;
 
-    while(!done) {
-        fprintf(stderr, "cleanup thread waiting\n");
-        sem_wait(&server->processor_cleanup);
+            if (c->streaming) {
+                // stream subscribers only read to notice the peer going away
+                c->in_length = 0;
+                c->parsed = 0;
+            }
+        }
 
-        pthread_mutex_lock(&server->mutex);
+        // answer every complete request, in order, up to the pipeline limit
+        while (!c->closing && !c->streaming && !c->waiting && c->out_count < HTTP_MAX_PIPELINE) {
+            int p = conn_parse(c, settings);
+            if (p == 0) {
+                break;
+            }
+            progress = 1;
+
+            if (p < 0) {
+                const char * msg = "invalid http request";
+                c->keep_alive = 0;
+                queue_http_response(c, HTTP_STATUS_BAD_REQUEST, mime_text_plain, msg, strlen(msg));
+                c->closing = 1;
+                break;
+            }
 
-        fprintf(stderr, "before cleanup: %d\n", server->processor_count);
+            process_request(c);
+            conn_next_request(c);
 
-        for(http_processor_t ** l = &server->processors; *l;) {
-            fprintf(stderr, "in cleanup loop\n");
-            http_processor_t * p = *l;
-            
-            if (p->closed || server->completed) {
-                fprintf(stderr, "removing socket: %d\n", p->sock);
-                if (!p->closed) {
-                    close(p->sock);
-                }
-                // unlink this node
-                *l = p->next;
-                p->next = NULL;
-
-                free(p);
-                p->server->processor_count--;
-            } else {
-                l = &p->next;
+            if (!c->keep_alive && !c->streaming && !c->waiting) {
+                c->closing = 1;
             }
         }
-        fprintf(stderr, "after cleanup: %d\n", server->processor_count);
 
-        done = server->completed;
+        if (!c->closing && !c->streaming && !c->waiting && c->in_length == sizeof(c->in) && c->parsed == c->in_length) {
+            // the buffer is full and still holds no complete request
+            const char * msg = "request too large";
+            c->keep_alive = 0;
+            queue_http_response(c, HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE, mime_text_plain, msg, strlen(msg));
+            c->closing = 1;
+        }
 
-        pthread_mutex_unlock(&server->mutex);
+        int f = conn_flush(c);
+        if (f < 0) {
+            return -1;
+        }
+        if (f == 0) {
+            // wait for EPOLLOUT
+            return 0;
+        }
+        if (c->waiting) {
+            if (!wait_check(c, now)) {
+                return c->read_closed ? -1 : 0;
+            }
+            if (!c->keep_alive) {
+                c->closing = 1;
+            }
+            continue;
+        }
+        if (c->closing) {
+            return -1;
+        }
+        if (c->streaming && !c->read_closed && stream_push(c, now)) {
+            continue;
+        }
+        if (!progress) {
+            return c->read_closed ? -1 : 0;
+        }
     }
-    return NULL;
 }
 
-void * listen_thread(void * user) {
-    http_server_t * server = (http_server_t*)user;
+// something was published or a long poll ran out, offer the latest 
+// snapshots to every stream subscriber and long poll on this worker.
+// returns how long until the next long poll deadline, -1 if there is none
+static int worker_notify(http_worker_t * w, http_parser_settings * settings, uint64_t now) {
+    int timeout = -1;
+
+    if (atomic_load(&w->stream_count) == 0 && atomic_load(&w->waiter_count) == 0) {
+        return -1;
+    }
+
+    for(int i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+        http_conn_t * c = &w->conns[i];
+        int ready = 0;
+
+        if (c->sock < 0 || c->out_head != NULL) {
+            continue;
+        }
+
+        if (c->streaming) {
+            ready = stream_push(c, now);
+        } else if (c->waiting) {
+            ready = wait_check(c, now);
+            if (!ready) {
+                int left = (int)(c->wait_deadline - now);
+                if (timeout < 0 || left < timeout) {
+                    timeout = left;
+                }
+            }
+        }
+
+        if (ready) {
+            conn_touch(w, c, now);
+            if (conn_service(c, settings, now) < 0) {
+                conn_release(w, c);
+            }
+        }
+    }
+
+    return timeout;
+}
+
+static void worker_accept(http_worker_t * w) {
     struct sockaddr_in cli_addr;
-    memset(&cli_addr, 0, sizeof(cli_addr));
-    unsigned int clilen = sizeof(cli_addr);
-    int new_socket;
+    socklen_t clilen;
 
-    while(listen(server->sock, server->wait_queue) == 0) {
-        fprintf(stderr, "accepting socket.\n");
+    for(;;) {
+        clilen = sizeof(cli_addr);
+        int sock = accept4(w->sock, (struct sockaddr*)&cli_addr, &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
-        memset(&cli_addr, 0, sizeof(cli_addr));
-        new_socket = accept(server->sock, (struct sockaddr*)&cli_addr, &clilen);
-        if (new_socket < 0) {
-            perror("could not create new socket");
-            break;
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("could not accept connection");
+            }
+            return;
+        }
+
+        http_conn_t * c = conn_acquire(w, sock, &cli_addr);
+        if (c == NULL) {
+            // table is full, best effort refusal
+            send(sock, unavailable_message, sizeof(unavailable_message) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(sock);
+            continue;
         }
 
-        // spawn a processor thread
-        pthread_mutex_lock(&server->mutex);
-        http_processor_t * proc = (http_processor_t*)malloc(sizeof(http_processor_t));
-        proc->server = server;
-        proc->sock = new_socket;
-        proc->client_addr = cli_addr;
-        proc->closed = 0;
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u64 = conn_event_data(w, c);
+
+        if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, sock, &ev) != 0) {
+            perror("could not add connection to epoll");
+            conn_release(w, c);
+        }
+    }
+}
 
-        proc->next = server->processors;
-        server->processors = proc;
+// close connections idle for longer than the timeout and return how long 
+// until the next one expires, -1 if there are none
+static int worker_expire(http_worker_t * w, uint64_t now) {
+    while (w->idle_head != NULL) {
+        http_conn_t * c = w->idle_head;
+        uint64_t deadline = c->last_active + HTTP_IDLE_TIMEOUT_MS;
 
-        server->processor_count++;
-        pthread_mutex_unlock(&server->mutex);
+        if (deadline > now) {
+            return (int)(deadline - now);
+        }
+        conn_release(w, c);
+    }
+    return -1;
+}
 
-        fprintf(stderr, "client connected: %s:%d\n", inet_ntoa(cli_addr.sin_addr), cli_addr.sin_port);
+static void * worker_thread(void * user) {
+    http_worker_t * w = (http_worker_t*)user;
+    http_server_t * server = w->server;
+    struct epoll_event events[HTTP_MAX_EVENTS];
+    int timeout = -1;
 
-        if(pthread_create(&proc->thread, NULL, processor_thread, proc) != 0) {
-            perror("could not create processor thread");
+    http_parser_settings parser_settings;
+    http_parser_settings_init(&parser_settings);
+    parser_settings.on_message_complete = parser_message_complete;
+    parser_settings.on_url = processor_get_url;
+    parser_settings.on_header_field = processor_header_field;
+    parser_settings.on_header_value = processor_header_value;
+
+    while(!server->completed) {
+        int n = epoll_wait(w->epollfd, events, HTTP_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("http server epoll_wait");
             break;
         }
 
-        pthread_detach(proc->thread);
-    }
+        uint64_t now = now_ms();
 
-    pthread_mutex_lock(&server->mutex);
-    server->completed = 1;
+        for(int i = 0; i < n; i++) {
+            uint64_t data = events[i].data.u64;
+
+            if (data == EVENT_LISTEN) {
+                worker_accept(w);
+                continue;
+            } 
+            if (data == EVENT_WAKE) {
+                uint64_t count;
+                atomic_store(&w->wake_pending, 0);
+                if (read(w->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    perror("could not read http worker wakeup");
+                }
+                worker_notify(w, &parser_settings, now);
+                continue;
+            }
+
+            http_conn_t * c = &w->conns[data & 0xffffffff];
+            if (c->sock < 0 || c->generation != (uint32_t)(data >> 32)) {
+                continue;
+            }
+
+            conn_touch(w, c, now);
 
-    for (http_processor_t * proc = server->processors; proc;) {
-        // shutdown(proc->sock, SHUT_RDWR);
-        close(proc->sock);
+            int status = conn_service(c, &parser_settings, now);
+
+            if (status == 0 && (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                status = -1;
+            }
+
+            if (status < 0) {
+                conn_release(w, c);
+            }
+        }
 
-        http_processor_t * t = proc;
-        proc = proc->next;
-        server->processor_count--;
+        timeout = worker_expire(w, now);
 
-        free(t);
+        if (atomic_load(&w->waiter_count) > 0) {
+            // answer long polls that have run out and wake up for the next one
+            int wait_timeout = worker_notify(w, &parser_settings, now_ms());
+            if (wait_timeout >= 0 && (timeout < 0 || wait_timeout < timeout)) {
+                timeout = wait_timeout;
+            }
+        }
     }
-    server->processors = NULL;
-    pthread_mutex_unlock(&server->mutex);
 
-    sem_post(&server->processor_cleanup);
+    // now clean up the connections
+    for(int i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+        if (w->conns[i].sock >= 0) {
+            conn_release(w, &w->conns[i]);
+        }
+    }
 
     return NULL;
 }
 
-int http_server_destroy(http_server_t * server) {
-    if (shutdown(server->sock, SHUT_RDWR) != 0) {
-        perror("could not shut down socket");
+static void worker_cleanup(http_worker_t * w) {
+    if (w->sock >= 0) {
+        close(w->sock);
+        w->sock = -1;
     }
-    close(server->sock);
-
-    pthread_join(server->listen_thread, NULL);
-    pthread_join(server->cleanup_thread, NULL);
-    
-    pthread_mutex_destroy(&server->mutex);
-    sem_destroy(&server->processor_cleanup);
-
-    if (server->config != NULL) {
-        free(server->config);
-        server->config = NULL;
-        server->config_size = 0;
+    if (w->epollfd >= 0) {
+        close(w->epollfd);
+        w->epollfd = -1;
     }
-    if (server->frame != NULL) {
-        free(server->frame);
-        server->frame = NULL;
-        server->frame_size = 0;
+    if (w->wakefd >= 0) {
+        close(w->wakefd);
+        w->wakefd = -1;
     }
-    if (server->motion != NULL) {
-        free(server->motion);
-        server->motion = NULL;
-        server->motion_size = 0;
+    if (w->conns != NULL) {
+        free(w->conns);
+        w->conns = NULL;
     }
-
-    return 0;
 }
 
-int http_server_create(http_server_t * server, int portno) {
+// each worker has its own listening socket on the same port, the kernel
+// spreads incoming connections across them
+static int worker_create(http_server_t * server, http_worker_t * w, int portno) {
     struct sockaddr_in serv_addr;
+    struct epoll_event ev;
     int opt = 1;
-    int sock = -1;
-    int mutex_created = 0;
-    int semaphore_created = 0;
-    int listen_thread_started = 0;
-    int cleanup_thread_started = 0;
-
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
+
+    w->server = server;
+    w->sock = -1;
+    w->epollfd = -1;
+    w->wakefd = -1;
+    w->conn_count = 0;
+
+    w->conns = (http_conn_t*)malloc(HTTP_MAX_CONNECTIONS * sizeof(http_conn_t));
+    if (w->conns == NULL) {
+        perror("could not allocate connection table");
+        goto error;
+    }
+
+    // thread every slot onto the free list
+    for(int i = 0; i < HTTP_MAX_CONNECTIONS; i++) {
+        w->conns[i].sock = -1;
+        w->conns[i].generation = 0;
+        w->conns[i].out_head = NULL;
+        w->conns[i].idle_prev = NULL;
+        w->conns[i].idle_next = NULL;
+        w->conns[i].worker = w;
+        w->conns[i].next_free = (i + 1 < HTTP_MAX_CONNECTIONS) ? i + 1 : -1;
+    }
+    w->free_head = 0;
+    w->idle_head = NULL;
+    w->idle_tail = NULL;
+    atomic_init(&w->stream_count, 0);
+    atomic_init(&w->waiter_count, 0);
+    atomic_init(&w->wake_pending, 0);
+
+    w->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (w->sock < 0) {
         perror("could not create socket.");
         goto error;
     }
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT,
-        &opt, sizeof(opt)) != 0) 
+    if (setsockopt(w->sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) != 0 ||
+        setsockopt(w->sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) != 0) 
     {
         perror("could not set socket options");
         goto error;
@@ -342,115 +1326,235 @@ int http_server_create(http_server_t * server, int portno) {
     serv_addr.sin_addr.s_addr = INADDR_ANY;
     serv_addr.sin_port = htons(portno);
 
-    if (bind(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+    if (bind(w->sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
         perror("could not bind socket");
         goto error;
     }
 
-    server->sock = sock;
-    server->wait_queue = 3;
-    server->processors = NULL;
-    server->completed = 0;
-    server->processor_count = 0;
-    server->config = NULL;
-    server->config_size = 0;
-    server->frame = NULL;
-    server->frame_size = 0;
-    server->motion = NULL;
-    server->motion_size = 0;
-
-    if(pthread_mutex_init(&server->mutex, NULL) != 0) {
-        perror("could not create http server mutex");
+    if (listen(w->sock, server->wait_queue) != 0) {
+        perror("could not listen on socket");
+        goto error;
+    }
+
+    if ((w->epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("could not create epoll instance");
         goto error;
     }
-    mutex_created = 1;
-    if(sem_init(&server->processor_cleanup, 0, 0) != 0) {
-        perror("could not create http server semaphore");
+
+    if ((w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("could not create http worker eventfd");
         goto error;
     }
 
-    semaphore_created = 1;
-    if (pthread_create(&server->listen_thread, NULL, listen_thread, (void*)server) != 0) {
-        perror("could not start listener thread");
+    ev.events = EPOLLIN;
+    ev.data.u64 = EVENT_LISTEN;
+    if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, w->sock, &ev) != 0) {
+        perror("could not add listening socket to epoll");
         goto error;
     }
-    listen_thread_started = 1;
-    if (pthread_create(&server->cleanup_thread, NULL, cleanup_thread, (void*)server) != 0) {
-        perror("could not start cleanup thread");
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = EVENT_WAKE;
+    if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, w->wakefd, &ev) != 0) {
+        perror("could not add eventfd to epoll");
         goto error;
     }
-    cleanup_thread_started = 1;
 
+    if (pthread_create(&w->thread, NULL, worker_thread, (void*)w) != 0) {
+        perror("could not start http worker thread");
+        goto error;
+    }
 
     return 0;
 error:
-    if (sock > 0) {
-        close(sock);
-    }
+    worker_cleanup(w);
+    return -1;
+}
+
+static void stop_workers(http_server_t * server) {
+    uint64_t one = 1;
+
     server->completed = 1;
-    if (listen_thread_started) {
-        pthread_join(server->listen_thread, NULL);
+
+    for(int i = 0; i < server->worker_count; i++) {
+        if (write(server->workers[i].wakefd, &one, sizeof(one)) < 0) {
+            perror("could not wake http worker");
+        }
     }
-    if (cleanup_thread_started) {
-        sem_post(&server->processor_cleanup);
-        pthread_join(server->cleanup_thread, NULL);
+    for(int i = 0; i < server->worker_count; i++) {
+        pthread_join(server->workers[i].thread, NULL);
+        worker_cleanup(&server->workers[i]);
     }
-    if (semaphore_created) {
-        sem_close(&server->processor_cleanup);
-        sem_destroy(&server->processor_cleanup);
+    server->worker_count = 0;
+}
+
+int http_server_destroy(http_server_t * server) {
+    stop_workers(server);
+    
+    snapshot_slot_destroy(&server->config);
+    snapshot_slot_destroy(&server->frame);
+    snapshot_slot_destroy(&server->motion);
+    snapshot_slot_destroy(&server->events);
+    snapshot_slot_destroy(&server->zone_scores);
+
+    return 0;
+}
+
+int http_server_create(http_server_t * server, int portno) {
+    server->wait_queue = 64;
+    server->worker_count = 0;
+    server->completed = 0;
+    atomic_init(&server->stream_subscribers, 0);
+    atomic_init(&server->frame_waiters, 0);
+    atomic_init(&server->frame_requested, 0);
+    atomic_init(&server->frame_stale, 1);
+    server->frame_demand = NULL;
+    server->frame_demand_user = NULL;
+    server->zones = NULL;
+    server->zones_user = NULL;
+    server->history = NULL;
+    server->latency = NULL;
+    server->boot_id = (uint32_t)time(NULL);
+
+    snapshot_slot_init(&server->config);
+    snapshot_slot_init(&server->frame);
+    snapshot_slot_init(&server->motion);
+    snapshot_slot_init(&server->events);
+    snapshot_slot_init(&server->zone_scores);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) {
+        cores = 1;
     }
-    if (mutex_created) {
-        pthread_mutex_destroy(&server->mutex);
+    if (cores > HTTP_MAX_WORKERS) {
+        cores = HTTP_MAX_WORKERS;
+    }
+
+    for(int i = 0; i < cores; i++) {
+        if (worker_create(server, &server->workers[i], portno) != 0) {
+            goto error;
+        }
+        server->worker_count++;
     }
 
+    return 0;
+error:
+    stop_workers(server);
+    snapshot_slot_destroy(&server->config);
+    snapshot_slot_destroy(&server->frame);
+    snapshot_slot_destroy(&server->motion);
+    snapshot_slot_destroy(&server->events);
+    snapshot_slot_destroy(&server->zone_scores);
+
     return -1;
 }
 
+// copy the buffer into a new snapshot and swap it in.  readers still 
+// sending the previous one keep it alive until they are done
+static int publish_copy(snapshot_slot_t * slot, uint8_t * data, size_t length) {
+    snapshot_t * s = snapshot_create(data, length);
+    if (s == NULL) {
+        return -1;
+    }
+    snapshot_slot_publish(slot, s);
+    return 0;
+}
+
 int http_server_config(http_server_t * server, uint8_t * data, size_t length) {
-    pthread_mutex_lock(&server->mutex);
+    return publish_copy(&server->config, data, length);
+}
+
+
+// wake the workers that have someone waiting on a publish, stream 
+// subscribers only care about frames
+static void notify_workers(http_server_t * server, int frame) {
+    uint64_t one = 1;
 
-    if (server->config != NULL) {
-        free(server->config);
+    for(int i = 0; i < server->worker_count; i++) {
+        http_worker_t * w = &server->workers[i];
+        int interested = atomic_load(&w->waiter_count) > 0 || 
+            (frame && atomic_load(&w->stream_count) > 0);
+
+        if (interested && !atomic_exchange(&w->wake_pending, 1)) {
+            if (write(w->wakefd, &one, sizeof(one)) < 0) {
+                perror("could not wake http worker");
+            }
+        }
     }
+}
 
-    server->config = (uint8_t*)malloc(length);
-    memcpy(server->config, data, length);
-    server->config_size = length;
+int http_server_frame_jpeg(http_server_t * server, uint8_t * data, size_t length) {
+    int ret = publish_copy(&server->frame, data, length);
+    atomic_store(&server->frame_stale, 0);
 
-    pthread_mutex_unlock(&server->mutex);
-    return 0;
+    notify_workers(server, 1);
+    return ret;
 }
 
+int http_server_frame_snapshot(http_server_t * server, snapshot_t * frame) {
+    snapshot_slot_publish(&server->frame, frame);
+    atomic_store(&server->frame_stale, 0);
 
-int http_server_frame_jpeg(http_server_t * server, uint8_t * data, size_t length) {
-    pthread_mutex_lock(&server->mutex);
+    notify_workers(server, 1);
+    return 0;
+}
 
-    if (server->frame != NULL) {
-        free(server->frame);
-    }
 
-    server->frame = (uint8_t*)malloc(length);
-    memcpy(server->frame, data, length);
-    server->frame_size = length;
+int http_server_motion_snapshot(http_server_t * server, snapshot_t * motion) {
+    snapshot_slot_publish(&server->motion, motion);
 
-    pthread_mutex_unlock(&server->mutex);
+    notify_workers(server, 0);
+    return 0;
+}
+
+int http_server_events_snapshot(http_server_t * server, snapshot_t * events) {
+    snapshot_slot_publish(&server->events, events);
 
-    // TODO: trigger a condition variable or semaphore
+    notify_workers(server, 0);
     return 0;
 }
 
+int http_server_zone_scores_snapshot(http_server_t * server, snapshot_t * scores) {
+    snapshot_slot_publish(&server->zone_scores, scores);
+
+    notify_workers(server, 0);
+    return 0;
+}
 
 int http_server_motion(http_server_t * server, uint8_t * data, size_t length) {
-    pthread_mutex_lock(&server->mutex);
+    int ret = publish_copy(&server->motion, data, length);
 
-    if (server->motion != NULL) {
-        free(server->motion);
+    notify_workers(server, 0);
+    return ret;
+}
+
+int http_server_frame_wanted(http_server_t * server, uint64_t linger_ms) {
+    if (atomic_load(&server->stream_subscribers) > 0 || atomic_load(&server->frame_waiters) > 0) {
+        return 1;
     }
+    return now_ms() - atomic_load(&server->frame_requested) < linger_ms;
+}
 
-    server->motion = (uint8_t*)malloc(length);
-    memcpy(server->motion, data, length);
-    server->motion_size = length;
+void http_server_frame_paused(http_server_t * server) {
+    atomic_store(&server->frame_stale, 1);
+}
 
-    pthread_mutex_unlock(&server->mutex);
-    return 0;
-}
\ No newline at end of file
+void http_server_on_frame_demand(http_server_t * server, void (*demand)(void * user), void * user) {
+    server->frame_demand_user = user;
+    server->frame_demand = demand;
+}
+
+void http_server_on_zones(http_server_t * server, 
+    int (*handler)(void * user, const char * query, size_t query_length, char * out, size_t size), void * user)
+{
+    server->zones_user = user;
+    server->zones = handler;
+}
+
+void http_server_set_motion_history(http_server_t * server, motion_history_t * history) {
+    server->history = history;
+}
+
+void http_server_set_latency(http_server_t * server, latency_t * latency) {
+    server->latency = latency;
+}
@@ -0,0 +1,181 @@
+#include "latency.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define HALF_COUNT (1 << (LATENCY_SUB_BITS - 1))
+#define VALUE_MAX ((1ULL << LATENCY_MAX_BITS) - 1)
+
+static const char * type_names[FRAME_TYPE_COUNT] = { "video", "motion", "jpeg" };
+static const char * stage_names[LATENCY_STAGES] = { "encode", "copy", "queue", "send", "total" };
+
+static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char * percentile_names[] = { "p50", "p90", "p99", "p999" };
+
+// values below 2^LATENCY_SUB_BITS get a bucket each, above that every
+// power of two is split into HALF_COUNT buckets
+static int bucket_index(uint64_t value) {
+    if (value > VALUE_MAX) {
+        value = VALUE_MAX;
+    }
+    if (value < (1 << LATENCY_SUB_BITS)) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (LATENCY_SUB_BITS - 1);
+    return (shift << (LATENCY_SUB_BITS - 1)) + (int)(value >> shift);
+}
+
+// the highest value that lands in bucket i
+static uint64_t bucket_value(int i) {
+    if (i < (1 << LATENCY_SUB_BITS)) {
+        return i;
+    }
+    int shift = i / HALF_COUNT - 1;
+    uint64_t sub = i - shift * HALF_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+static latency_histogram_t * histogram(latency_t * latency, frame_type_t type, latency_stage_t stage) {
+    return &latency->histograms[type * LATENCY_STAGES + stage];
+}
+
+uint64_t latency_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int latency_init(latency_t * latency) {
+    latency->histograms = (latency_histogram_t*)calloc(FRAME_TYPE_COUNT * LATENCY_STAGES, sizeof(latency_histogram_t));
+    if (latency->histograms == NULL) {
+        fprintf(stderr, "could not allocate latency histograms\n");
+        return -1;
+    }
+    atomic_init(&latency->stc_offset, 0);
+    atomic_init(&latency->stc_known, 0);
+    latency_reset(latency);
+
+    return 0;
+}
+
+void latency_destroy(latency_t * latency) {
+    free(latency->histograms);
+    latency->histograms = NULL;
+}
+
+void latency_set_stc(latency_t * latency, int64_t stc, uint64_t now) {
+    atomic_store_explicit(&latency->stc_offset, (long long)now - stc, memory_order_relaxed);
+    atomic_store_explicit(&latency->stc_known, 1, memory_order_release);
+}
+
+uint64_t latency_sensor_time(latency_t * latency, int64_t pts) {
+    // unknown pts come through as a large negative number
+    if (pts <= 0 || !atomic_load_explicit(&latency->stc_known, memory_order_acquire)) {
+        return 0;
+    }
+    long long t = pts + atomic_load_explicit(&latency->stc_offset, memory_order_relaxed);
+    return t > 0 ? (uint64_t)t : 0;
+}
+
+void latency_record(latency_t * latency, frame_type_t type, latency_stage_t stage, uint64_t from, uint64_t to) {
+    if (from == 0) {
+        return;
+    }
+
+    // the stc offset is only as good as the last reading, a stage that
+    // comes out negative took no time as far as we can tell
+    uint64_t value = to > from ? to - from : 0;
+    latency_histogram_t * h = histogram(latency, type, stage);
+
+    atomic_fetch_add_explicit(&h->counts[bucket_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+
+    unsigned long long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, value,
+        memory_order_relaxed, memory_order_relaxed))
+    {
+        // max was reloaded, try again while we are still bigger
+    }
+}
+
+void latency_frame_published(latency_t * latency, frame_type_t type, snapshot_t * frame) {
+    latency_record(latency, type, LATENCY_ENCODE, frame->sensor_us, frame->callback_us);
+    latency_record(latency, type, LATENCY_COPY, frame->callback_us, frame->time_us);
+    latency_record(latency, type, LATENCY_QUEUE, frame->time_us, frame->published_us);
+}
+
+void latency_frame_sent(latency_t * latency, frame_type_t type, snapshot_t * frame, uint64_t now) {
+    latency_record(latency, type, LATENCY_SEND, frame->published_us, now);
+    latency_record(latency, type, LATENCY_TOTAL, frame->sensor_us, now);
+}
+
+static size_t format_histogram(latency_histogram_t * h, frame_type_t type, latency_stage_t stage,
+    char * out, size_t size)
+{
+    unsigned long long total = atomic_load_explicit(&h->total, memory_order_relaxed);
+    unsigned long long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+    if (total == 0) {
+        return 0;
+    }
+
+    int length = snprintf(out, size, "{\"frame\":\"%s\",\"stage\":\"%s\",\"count\":%llu,\"mean\":%llu",
+        type_names[type], stage_names[stage], total,
+        atomic_load_explicit(&h->sum, memory_order_relaxed) / total);
+
+    // walk the buckets once for every percentile in order
+    unsigned long long seen = 0;
+    int i = 0;
+    for(size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++) {
+        unsigned long long rank = (unsigned long long)(percentiles[p] * total + 0.999999);
+        if (rank == 0) {
+            rank = 1;
+        }
+        while (i < LATENCY_COUNTS - 1 && seen + atomic_load_explicit(&h->counts[i], memory_order_relaxed) < rank) {
+            seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+            i++;
+        }
+
+        uint64_t value = bucket_value(i);
+        if (value > max) {
+            value = max;
+        }
+        if (length >= 0 && (size_t)length < size) {
+            length += snprintf(out + length, size - length, ",\"%s\":%llu", percentile_names[p], (unsigned long long)value);
+        }
+    }
+
+    if (length >= 0 && (size_t)length < size) {
+        length += snprintf(out + length, size - length, ",\"max\":%llu}\n", max);
+    }
+    if (length < 0 || (size_t)length >= size) {
+        return 0;
+    }
+    return length;
+}
+
+size_t latency_format(latency_t * latency, char * out, size_t size) {
+    size_t length = 0;
+
+    for(int t = 0; t < FRAME_TYPE_COUNT; t++) {
+        for(int s = 0; s < LATENCY_STAGES; s++) {
+            length += format_histogram(histogram(latency, t, s), t, s, out + length, size - length);
+        }
+    }
+    return length;
+}
+
+void latency_reset(latency_t * latency) {
+    for(int i = 0; i < FRAME_TYPE_COUNT * LATENCY_STAGES; i++) {
+        latency_histogram_t * h = &latency->histograms[i];
+        for(int c = 0; c < LATENCY_COUNTS; c++) {
+            atomic_store_explicit(&h->counts[c], 0, memory_order_relaxed);
+        }
+        atomic_store_explicit(&h->total, 0, memory_order_relaxed);
+        atomic_store_explicit(&h->sum, 0, memory_order_relaxed);
+        atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,354 @@
+#include "motion.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MOTION_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define MOTION_SSE2 1
+#endif
+
+static void decode_scalar(const uint8_t * src, int8_t * x, int8_t * y, uint16_t * sad, uint16_t * magnitude, int n) {
+    for(int i = 0; i < n; i++, src += 4) {
+        int8_t vx = (int8_t)src[0];
+        int8_t vy = (int8_t)src[1];
+
+        x[i] = vx;
+        y[i] = vy;
+        sad[i] = (uint16_t)(src[2] | (src[3] << 8));
+        magnitude[i] = (uint16_t)(vx * vx + vy * vy);
+    }
+}
+
+static void activity_scalar(const uint16_t * magnitude, int n, uint16_t threshold, uint32_t * active, uint64_t * sum) {
+    uint32_t a = 0;
+    uint64_t s = 0;
+
+    for(int i = 0; i < n; i++) {
+        a += magnitude[i] >= threshold;
+        s += magnitude[i];
+    }
+
+    *active = a;
+    *sum = s;
+}
+
+// keeps sigma finite and non zero for a macroblock that never moved
+#define BACKGROUND_VARIANCE_FLOOR 1.0f
+
+static void background_scalar(uint16_t * value, float * mean, float * variance, int n, 
+    const motion_background_params_t * params) 
+{
+    for(int i = 0; i < n; i++) {
+        float x = value[i];
+        float d = x - mean[i];
+        float excess = d - params->k * sqrtf(variance[i] + BACKGROUND_VARIANCE_FLOOR);
+        float a = excess > 0 ? params->alpha_foreground : params->alpha;
+
+        mean[i] += a * d;
+        variance[i] = (1 - a) * (variance[i] + a * d * d);
+        value[i] = excess <= 0 ? 0 : excess >= 65535 ? 65535 : (uint16_t)excess;
+    }
+}
+
+const motion_kernels_t motion_kernels_scalar = {
+    "scalar", decode_scalar, activity_scalar, background_scalar
+};
+
+#if MOTION_NEON
+
+static void decode_neon(const uint8_t * src, int8_t * x, int8_t * y, uint16_t * sad, uint16_t * magnitude, int n) {
+    int i = 0;
+
+    for(; i + 8 <= n; i += 8, src += 32) {
+        // splits 8 vectors into x, y, sad low and sad high bytes
+        uint8x8x4_t v = vld4_u8(src);
+
+        int8x8_t vx = vreinterpret_s8_u8(v.val[0]);
+        int8x8_t vy = vreinterpret_s8_u8(v.val[1]);
+        int16x8_t x16 = vmovl_s8(vx);
+        int16x8_t y16 = vmovl_s8(vy);
+
+        vst1_s8(x + i, vx);
+        vst1_s8(y + i, vy);
+        vst1q_u16(sad + i, vorrq_u16(vmovl_u8(v.val[2]), vshlq_n_u16(vmovl_u8(v.val[3]), 8)));
+        vst1q_u16(magnitude + i, vreinterpretq_u16_s16(vmlaq_s16(vmulq_s16(x16, x16), y16, y16)));
+    }
+
+    decode_scalar(src, x + i, y + i, sad + i, magnitude + i, n - i);
+}
+
+static void activity_neon(const uint16_t * magnitude, int n, uint16_t threshold, uint32_t * active, uint64_t * sum) {
+    uint16x8_t t = vdupq_n_u16(threshold);
+    uint32x4_t a = vdupq_n_u32(0);
+    uint32x4_t s = vdupq_n_u32(0);
+    int i = 0;
+
+    for(; i + 8 <= n; i += 8) {
+        uint16x8_t m = vld1q_u16(magnitude + i);
+        a = vpadalq_u16(a, vshrq_n_u16(vcgeq_u16(m, t), 15));
+        s = vpadalq_u16(s, m);
+    }
+
+    uint32_t tail_active;
+    uint64_t tail_sum;
+    activity_scalar(magnitude + i, n - i, threshold, &tail_active, &tail_sum);
+
+    *active = vgetq_lane_u32(a, 0) + vgetq_lane_u32(a, 1) + vgetq_lane_u32(a, 2) + vgetq_lane_u32(a, 3) + tail_active;
+    *sum = (uint64_t)vgetq_lane_u32(s, 0) + vgetq_lane_u32(s, 1) + vgetq_lane_u32(s, 2) + vgetq_lane_u32(s, 3) + tail_sum;
+}
+
+// 4 values of the background update
+static inline float32x4_t background_neon4(float32x4_t x, float * mean, float * variance, 
+    const motion_background_params_t * params) 
+{
+    float32x4_t m = vld1q_f32(mean);
+    float32x4_t v = vld1q_f32(variance);
+    float32x4_t d = vsubq_f32(x, m);
+
+    // armv7 has no vector square root, sigma is v * 1/sqrt(v) with one 
+    // newton step on the estimate
+    float32x4_t vf = vaddq_f32(v, vdupq_n_f32(BACKGROUND_VARIANCE_FLOOR));
+    float32x4_t r = vrsqrteq_f32(vf);
+    r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(vf, r), r));
+    float32x4_t excess = vmlsq_n_f32(d, vmulq_f32(vf, r), params->k);
+
+    uint32x4_t fg = vcgtq_f32(excess, vdupq_n_f32(0));
+    float32x4_t a = vbslq_f32(fg, vdupq_n_f32(params->alpha_foreground), vdupq_n_f32(params->alpha));
+
+    vst1q_f32(mean, vmlaq_f32(m, a, d));
+    vst1q_f32(variance, vmulq_f32(vsubq_f32(vdupq_n_f32(1), a), vmlaq_f32(v, vmulq_f32(a, d), d)));
+
+    return vmaxq_f32(excess, vdupq_n_f32(0));
+}
+
+static void background_neon(uint16_t * value, float * mean, float * variance, int n, 
+    const motion_background_params_t * params) 
+{
+    int i = 0;
+
+    for(; i + 8 <= n; i += 8) {
+        uint16x8_t x = vld1q_u16(value + i);
+        float32x4_t lo = background_neon4(vcvtq_f32_u32(vmovl_u16(vget_low_u16(x))), mean + i, variance + i, params);
+        float32x4_t hi = background_neon4(vcvtq_f32_u32(vmovl_u16(vget_high_u16(x))), mean + i + 4, variance + i + 4, params);
+
+        // truncating, saturating back to 16 bits
+        vst1q_u16(value + i, vcombine_u16(vqmovn_u32(vcvtq_u32_f32(lo)), vqmovn_u32(vcvtq_u32_f32(hi))));
+    }
+
+    background_scalar(value + i, mean + i, variance + i, n - i, params);
+}
+
+static const motion_kernels_t motion_kernels_neon = {
+    "neon", decode_neon, activity_neon, background_neon
+};
+const motion_kernels_t * motion_kernels_best = &motion_kernels_neon;
+
+#elif MOTION_SSE2
+
+static void decode_sse2(const uint8_t * src, int8_t * x, int8_t * y, uint16_t * sad, uint16_t * magnitude, int n) {
+    const __m128i bias32 = _mm_set1_epi32(0x8000);
+    const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+    int i = 0;
+
+    for(; i + 8 <= n; i += 8, src += 32) {
+        // 4 vectors per register, one per 32 bit lane
+        __m128i a = _mm_loadu_si128((const __m128i*)src);
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+
+        // sad is the high half.  there is no unsigned 32 to 16 bit pack
+        // in SSE2, so shift into signed range and back
+        __m128i s = _mm_packs_epi32(_mm_sub_epi32(_mm_srli_epi32(a, 16), bias32),
+                                    _mm_sub_epi32(_mm_srli_epi32(b, 16), bias32));
+        _mm_storeu_si128((__m128i*)(sad + i), _mm_add_epi16(s, bias16));
+
+        // sign extend x and y to 16 bits
+        __m128i x16 = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 24), 24),
+                                      _mm_srai_epi32(_mm_slli_epi32(b, 24), 24));
+        __m128i y16 = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 24),
+                                      _mm_srai_epi32(_mm_slli_epi32(b, 16), 24));
+
+        // 128 * 128 * 2 wraps to 0x8000, which is right read as unsigned
+        __m128i m = _mm_add_epi16(_mm_mullo_epi16(x16, x16), _mm_mullo_epi16(y16, y16));
+        _mm_storeu_si128((__m128i*)(magnitude + i), m);
+
+        _mm_storel_epi64((__m128i*)(x + i), _mm_packs_epi16(x16, x16));
+        _mm_storel_epi64((__m128i*)(y + i), _mm_packs_epi16(y16, y16));
+    }
+
+    decode_scalar(src, x + i, y + i, sad + i, magnitude + i, n - i);
+}
+
+static void activity_sse2(const uint16_t * magnitude, int n, uint16_t threshold, uint32_t * active, uint64_t * sum) {
+    const __m128i t = _mm_set1_epi16((short)threshold);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i s = _mm_setzero_si128();
+    uint32_t a = 0;
+    int i = 0;
+
+    for(; i + 8 <= n; i += 8) {
+        __m128i m = _mm_loadu_si128((const __m128i*)(magnitude + i));
+
+        // threshold - m saturates to 0 exactly when m >= threshold
+        __m128i ge = _mm_cmpeq_epi16(_mm_subs_epu16(t, m), zero);
+        a += __builtin_popcount(_mm_movemask_epi8(ge)) / 2;
+
+        s = _mm_add_epi32(s, _mm_unpacklo_epi16(m, zero));
+        s = _mm_add_epi32(s, _mm_unpackhi_epi16(m, zero));
+    }
+
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, s);
+
+    uint32_t tail_active;
+    uint64_t tail_sum;
+    activity_scalar(magnitude + i, n - i, threshold, &tail_active, &tail_sum);
+
+    *active = a + tail_active;
+    *sum = (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3] + tail_sum;
+}
+
+// 4 values of the background update
+static inline __m128i background_sse2x4(__m128 x, float * mean, float * variance, 
+    const motion_background_params_t * params) 
+{
+    __m128 m = _mm_loadu_ps(mean);
+    __m128 v = _mm_loadu_ps(variance);
+    __m128 d = _mm_sub_ps(x, m);
+
+    __m128 sigma = _mm_sqrt_ps(_mm_add_ps(v, _mm_set1_ps(BACKGROUND_VARIANCE_FLOOR)));
+    __m128 excess = _mm_sub_ps(d, _mm_mul_ps(_mm_set1_ps(params->k), sigma));
+
+    __m128 fg = _mm_cmpgt_ps(excess, _mm_setzero_ps());
+    __m128 a = _mm_or_ps(_mm_and_ps(fg, _mm_set1_ps(params->alpha_foreground)), 
+                         _mm_andnot_ps(fg, _mm_set1_ps(params->alpha)));
+
+    _mm_storeu_ps(mean, _mm_add_ps(m, _mm_mul_ps(a, d)));
+    _mm_storeu_ps(variance, _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(1), a), 
+        _mm_add_ps(v, _mm_mul_ps(_mm_mul_ps(a, d), d))));
+
+    // clamped first so the truncating conversion cannot overflow
+    excess = _mm_min_ps(_mm_max_ps(excess, _mm_setzero_ps()), _mm_set1_ps(65535));
+    return _mm_cvttps_epi32(excess);
+}
+
+static void background_sse2(uint16_t * value, float * mean, float * variance, int n, 
+    const motion_background_params_t * params) 
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias32 = _mm_set1_epi32(0x8000);
+    const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+    int i = 0;
+
+    for(; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(value + i));
+        __m128i lo = background_sse2x4(_mm_cvtepi32_ps(_mm_unpacklo_epi16(x, zero)), mean + i, variance + i, params);
+        __m128i hi = background_sse2x4(_mm_cvtepi32_ps(_mm_unpackhi_epi16(x, zero)), mean + i + 4, variance + i + 4, params);
+
+        // unsigned pack through the signed one, as in decode
+        __m128i packed = _mm_packs_epi32(_mm_sub_epi32(lo, bias32), _mm_sub_epi32(hi, bias32));
+        _mm_storeu_si128((__m128i*)(value + i), _mm_add_epi16(packed, bias16));
+    }
+
+    background_scalar(value + i, mean + i, variance + i, n - i, params);
+}
+
+static const motion_kernels_t motion_kernels_sse2 = {
+    "sse2", decode_sse2, activity_sse2, background_sse2
+};
+const motion_kernels_t * motion_kernels_best = &motion_kernels_sse2;
+
+#else
+
+const motion_kernels_t * motion_kernels_best = &motion_kernels_scalar;
+
+#endif
+
+static void * aligned_array(size_t count, size_t size) {
+    void * p = NULL;
+    // padded so the kernels may run whole vectors past the end
+    size_t padded = (count + 15) & ~(size_t)15;
+
+    if (posix_memalign(&p, 16, padded * size) != 0) {
+        return NULL;
+    }
+    memset(p, 0, padded * size);
+    return p;
+}
+
+int motion_field_init(motion_field_t * field, int frame_width, int frame_height) {
+    field->width = (frame_width + 15) / 16;
+    field->height = (frame_height + 15) / 16;
+    field->count = field->width * field->height;
+    field->length = (size_t)(field->width + 1) * field->height * sizeof(motion_vector_t);
+    field->kernels = motion_kernels_best;
+
+    field->x = (int8_t*)aligned_array(field->count, sizeof(int8_t));
+    field->y = (int8_t*)aligned_array(field->count, sizeof(int8_t));
+    field->sad = (uint16_t*)aligned_array(field->count, sizeof(uint16_t));
+    field->magnitude = (uint16_t*)aligned_array(field->count, sizeof(uint16_t));
+
+    if (field->x == NULL || field->y == NULL || field->sad == NULL || field->magnitude == NULL) {
+        fprintf(stderr, "could not allocate a %dx%d motion field\n", field->width, field->height);
+        motion_field_destroy(field);
+        return -1;
+    }
+
+    return 0;
+}
+
+void motion_field_destroy(motion_field_t * field) {
+    free(field->x);
+    free(field->y);
+    free(field->sad);
+    free(field->magnitude);
+    field->x = field->y = NULL;
+    field->sad = field->magnitude = NULL;
+}
+
+int motion_field_decode(motion_field_t * field, const uint8_t * data, size_t length) {
+    if (length != field->length) {
+        return -1;
+    }
+
+    // a row at a time to leave out the extra column
+    size_t stride = (size_t)(field->width + 1) * sizeof(motion_vector_t);
+    for(int row = 0; row < field->height; row++) {
+        int at = row * field->width;
+        field->kernels->decode(data + row * stride, 
+            field->x + at, field->y + at, field->sad + at, field->magnitude + at, field->width);
+    }
+
+    return 0;
+}
+
+void motion_field_analyze(const motion_field_t * field, uint16_t threshold, motion_stats_t * stats) {
+    field->kernels->activity(field->magnitude, field->count, threshold, &stats->active, &stats->magnitude_sum);
+    stats->activity = field->count > 0 ? (float)stats->active / field->count : 0;
+
+    // scattered increments do not vectorize, four partial histograms at 
+    // least keep neighbouring macroblocks from waiting on the same counter
+    uint32_t h[4][MOTION_SAD_BUCKETS];
+    memset(h, 0, sizeof(h));
+
+    int i = 0;
+    for(; i + 4 <= field->count; i += 4) {
+        for(int k = 0; k < 4; k++) {
+            unsigned int b = field->sad[i + k] >> MOTION_SAD_SHIFT;
+            h[k][b < MOTION_SAD_BUCKETS ? b : MOTION_SAD_BUCKETS - 1]++;
+        }
+    }
+    for(; i < field->count; i++) {
+        unsigned int b = field->sad[i] >> MOTION_SAD_SHIFT;
+        h[0][b < MOTION_SAD_BUCKETS ? b : MOTION_SAD_BUCKETS - 1]++;
+    }
+
+    for(int b = 0; b < MOTION_SAD_BUCKETS; b++) {
+        stats->sad_histogram[b] = h[0][b] + h[1][b] + h[2][b] + h[3][b];
+    }
+}
@@ -0,0 +1,153 @@
+#include "motion_background.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// floats per cache line
+#define LINE_FLOATS 16
+
+int motion_background_init(motion_background_t * bg, const motion_field_t * field) {
+    void * block = NULL;
+
+    bg->width = field->width;
+    bg->height = field->height;
+    bg->count = field->count;
+    bg->stride = (field->count + LINE_FLOATS - 1) & ~(LINE_FLOATS - 1);
+    bg->fields = 0;
+    bg->params.alpha = MOTION_BACKGROUND_ALPHA;
+    bg->params.alpha_foreground = MOTION_BACKGROUND_FOREGROUND_ALPHA;
+    bg->params.k = MOTION_BACKGROUND_K;
+
+    if (posix_memalign(&block, LINE_FLOATS * sizeof(float), 4 * bg->stride * sizeof(float)) != 0) {
+        fprintf(stderr, "could not allocate motion background\n");
+        bg->block = NULL;
+        return -1;
+    }
+    memset(block, 0, 4 * bg->stride * sizeof(float));
+
+    bg->block = (float*)block;
+    bg->magnitude_mean = bg->block;
+    bg->magnitude_variance = bg->block + bg->stride;
+    bg->sad_mean = bg->block + 2 * bg->stride;
+    bg->sad_variance = bg->block + 3 * bg->stride;
+
+    return 0;
+}
+
+void motion_background_destroy(motion_background_t * bg) {
+    free(bg->block);
+    bg->block = NULL;
+}
+
+void motion_background_apply(motion_background_t * bg, motion_field_t * field) {
+    if (field->count != bg->count) {
+        return;
+    }
+
+    motion_background_params_t params = bg->params;
+    float cold = 1.0f / (bg->fields + 1);
+    if (params.alpha < cold) {
+        params.alpha = cold;
+    }
+    if (params.alpha_foreground < cold) {
+        params.alpha_foreground = cold;
+    }
+
+    field->kernels->background(field->magnitude, bg->magnitude_mean, bg->magnitude_variance, bg->count, &params);
+    field->kernels->background(field->sad, bg->sad_mean, bg->sad_variance, bg->count, &params);
+
+    if (bg->fields < UINT32_MAX) {
+        bg->fields++;
+    }
+
+    // too few fields for the variance to mean anything yet
+    if (bg->fields < MOTION_BACKGROUND_WARMUP) {
+        memset(field->magnitude, 0, bg->count * sizeof(uint16_t));
+        memset(field->sad, 0, bg->count * sizeof(uint16_t));
+    }
+}
+
+int motion_background_load(motion_background_t * bg, const char * path) {
+    motion_background_header_t header;
+    FILE * f = fopen(path, "rb");
+
+    if (f == NULL) {
+        return -1;
+    }
+
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, MOTION_BACKGROUND_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != MOTION_BACKGROUND_VERSION ||
+        header.width != (uint32_t)bg->width || header.height != (uint32_t)bg->height) 
+    {
+        goto error;
+    }
+
+    float * arrays[] = { bg->magnitude_mean, bg->magnitude_variance, bg->sad_mean, bg->sad_variance };
+    for(int i = 0; i < 4; i++) {
+        if (fread(arrays[i], sizeof(float), bg->count, f) != (size_t)bg->count) {
+            goto error;
+        }
+    }
+
+    bg->fields = header.fields;
+    fclose(f);
+    return 0;
+
+error:
+    // do not keep half a model
+    memset(bg->block, 0, 4 * bg->stride * sizeof(float));
+    fclose(f);
+    return -1;
+}
+
+int motion_background_save(const motion_background_t * bg, const char * path) {
+    char tmp[256];
+    motion_background_header_t header;
+
+    memcpy(header.magic, MOTION_BACKGROUND_MAGIC, sizeof(header.magic));
+    header.version = MOTION_BACKGROUND_VERSION;
+    header.width = bg->width;
+    header.height = bg->height;
+    header.fields = bg->fields;
+
+    // written beside the old one, synced and renamed over it, so a crash
+    // or a power cut leaves one or the other
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE * f = fopen(tmp, "wb");
+    if (f == NULL) {
+        perror("could not save motion background");
+        return -1;
+    }
+
+    const float * arrays[] = { bg->magnitude_mean, bg->magnitude_variance, bg->sad_mean, bg->sad_variance };
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for(int i = 0; i < 4 && ok; i++) {
+        ok = fwrite(arrays[i], sizeof(float), bg->count, f) == (size_t)bg->count;
+    }
+
+    ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0 || !ok) {
+        perror("could not save motion background");
+        remove(tmp);
+        return -1;
+    }
+
+    if (rename(tmp, path) != 0) {
+        perror("could not save motion background");
+        remove(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+void motion_background_copy(motion_background_t * to, const motion_background_t * from) {
+    if (to->block == NULL || to->count != from->count) {
+        return;
+    }
+    memcpy(to->block, from->block, 4 * from->stride * sizeof(float));
+    to->fields = from->fields;
+}
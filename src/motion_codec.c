@@ -0,0 +1,346 @@
+#include "motion_codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// bytes per macroblock in a raw frame
+#define RAW_STRIDE 4
+
+typedef struct writer_tag {
+    uint8_t * p;
+    uint8_t * end;
+} writer_t;
+
+typedef struct reader_tag {
+    const uint8_t * p;
+    const uint8_t * end;
+} reader_t;
+
+static void put_u32(uint8_t * p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get_u32(const uint8_t * p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// writers stop at the end and leave p past it, checked once at the end
+static void put_varint(writer_t * w, uint32_t v) {
+    while(v >= 0x80) {
+        if (w->p < w->end) *w->p = (v & 0x7f) | 0x80;
+        w->p++;
+        v >>= 7;
+    }
+    if (w->p < w->end) *w->p = v;
+    w->p++;
+}
+
+static void put_u16(writer_t * w, uint16_t v) {
+    if (w->p + 2 <= w->end) {
+        w->p[0] = v;
+        w->p[1] = v >> 8;
+    }
+    w->p += 2;
+}
+
+static int get_varint(reader_t * r, uint32_t * v) {
+    uint32_t result = 0;
+
+    for(int shift = 0; shift < 32; shift += 7) {
+        if (r->p >= r->end) {
+            return -1;
+        }
+        uint8_t b = *r->p++;
+        result |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static uint32_t zigzag(int32_t v) {
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t unzigzag(uint32_t v) {
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static uint16_t raw_vector(const uint8_t * raw, int i) {
+    return raw[i * RAW_STRIDE] | (raw[i * RAW_STRIDE + 1] << 8);
+}
+
+static uint16_t raw_sad(const uint8_t * raw, int i) {
+    return raw[i * RAW_STRIDE + 2] | (raw[i * RAW_STRIDE + 3] << 8);
+}
+
+static void write_header(uint8_t * out, int type, uint32_t seq, size_t length, size_t payload) {
+    out[0] = MOTION_CODEC_MAGIC0;
+    out[1] = MOTION_CODEC_MAGIC1;
+    out[2] = type;
+    out[3] = MOTION_CODEC_VERSION;
+    put_u32(out + 4, seq);
+    put_u32(out + 8, length);
+    put_u32(out + 12, payload);
+}
+
+// the vector plane against reference, or against zero when it is NULL.
+// reference is updated to what was coded
+static void encode_vectors(writer_t * w, const uint8_t * raw, int count, uint16_t * reference) {
+    for(int i = 0; i < count;) {
+        int skip = 0, literals = 0;
+
+        while(i + skip < count && raw_vector(raw, i + skip) == (reference ? reference[i + skip] : 0)) {
+            skip++;
+        }
+        i += skip;
+        while(i + literals < count && raw_vector(raw, i + literals) != (reference ? reference[i + literals] : 0)) {
+            literals++;
+        }
+
+        put_varint(w, skip);
+        put_varint(w, literals);
+        for(int end = i + literals; i < end; i++) {
+            uint16_t v = raw_vector(raw, i);
+            put_u16(w, v);
+            if (reference) {
+                reference[i] = v;
+            }
+        }
+    }
+}
+
+// every sad as a literal, each against the one before it
+static void encode_sad_key(writer_t * w, const uint8_t * raw, int count, uint16_t * reference) {
+    uint16_t previous = 0;
+
+    put_varint(w, 0);
+    put_varint(w, count);
+    for(int i = 0; i < count; i++) {
+        uint16_t s = raw_sad(raw, i);
+        put_varint(w, zigzag((int32_t)s - previous));
+        previous = s;
+        if (reference) {
+            reference[i] = s;
+        }
+    }
+}
+
+// sads that moved further than tolerance from the reference
+static void encode_sad_delta(writer_t * w, const uint8_t * raw, int count, uint16_t * reference, uint16_t tolerance) {
+    #define SAD_CHANGED(k) (abs((int)raw_sad(raw, k) - reference[k]) > tolerance)
+
+    for(int i = 0; i < count;) {
+        int skip = 0, literals = 0;
+
+        while(i + skip < count && !SAD_CHANGED(i + skip)) {
+            skip++;
+        }
+        i += skip;
+        while(i + literals < count && SAD_CHANGED(i + literals)) {
+            literals++;
+        }
+
+        put_varint(w, skip);
+        put_varint(w, literals);
+        for(int end = i + literals; i < end; i++) {
+            uint16_t s = raw_sad(raw, i);
+            put_varint(w, zigzag((int32_t)s - reference[i]));
+            reference[i] = s;
+        }
+    }
+
+    #undef SAD_CHANGED
+}
+
+int motion_codec_init(motion_codec_t * codec, size_t length, unsigned int key_interval, uint16_t sad_tolerance) {
+    codec->length = length;
+    codec->count = length / RAW_STRIDE;
+    codec->have_reference = 0;
+    codec->seq = 0;
+    codec->key_interval = key_interval;
+    codec->since_key = 0;
+    codec->sad_tolerance = sad_tolerance;
+
+    codec->vectors = calloc(codec->count, sizeof(uint16_t));
+    codec->sad = calloc(codec->count, sizeof(uint16_t));
+    if (codec->vectors == NULL || codec->sad == NULL) {
+        fprintf(stderr, "could not allocate motion codec\n");
+        motion_codec_destroy(codec);
+        return -1;
+    }
+
+    return 0;
+}
+
+void motion_codec_destroy(motion_codec_t * codec) {
+    free(codec->vectors);
+    free(codec->sad);
+    codec->vectors = NULL;
+    codec->sad = NULL;
+}
+
+size_t motion_codec_bound(size_t length) {
+    size_t count = length / RAW_STRIDE;
+
+    // two literals per macroblock at their largest, and a skip and literal
+    // count pair per macroblock for a plane that alternates
+    return MOTION_CODEC_HEADER + count * (2 + 3) + 2 * (count + 1) * 2 * 5;
+}
+
+size_t motion_codec_encode(motion_codec_t * codec, const uint8_t * raw, size_t length, int key, 
+    uint8_t * out, size_t size) 
+{
+    if (length != codec->length || size < MOTION_CODEC_HEADER) {
+        return 0;
+    }
+
+    key = key || !codec->have_reference || codec->since_key + 1 >= codec->key_interval;
+    writer_t w = { out + MOTION_CODEC_HEADER, out + size };
+
+    if (key) {
+        encode_vectors(&w, raw, codec->count, NULL);
+        encode_sad_key(&w, raw, codec->count, codec->sad);
+        for(int i = 0; i < codec->count; i++) {
+            codec->vectors[i] = raw_vector(raw, i);
+        }
+        codec->since_key = 0;
+    } else {
+        encode_vectors(&w, raw, codec->count, codec->vectors);
+        encode_sad_delta(&w, raw, codec->count, codec->sad, codec->sad_tolerance);
+        codec->since_key++;
+    }
+
+    codec->seq++;
+
+    if (w.p > w.end) {
+        // the references moved on without a frame to show for it
+        codec->have_reference = 0;
+        return 0;
+    }
+    codec->have_reference = 1;
+
+    size_t payload = w.p - out - MOTION_CODEC_HEADER;
+    write_header(out, key ? MOTION_CODEC_KEY : MOTION_CODEC_DELTA, codec->seq, length, payload);
+    return MOTION_CODEC_HEADER + payload;
+}
+
+size_t motion_codec_encode_key(const uint8_t * raw, size_t length, uint32_t seq, uint8_t * out, size_t size) {
+    int count = length / RAW_STRIDE;
+    writer_t w = { out + MOTION_CODEC_HEADER, out + size };
+
+    if (size < MOTION_CODEC_HEADER) {
+        return 0;
+    }
+
+    encode_vectors(&w, raw, count, NULL);
+    encode_sad_key(&w, raw, count, NULL);
+    if (w.p > w.end) {
+        return 0;
+    }
+
+    size_t payload = w.p - out - MOTION_CODEC_HEADER;
+    write_header(out, MOTION_CODEC_KEY, seq, length, payload);
+    return MOTION_CODEC_HEADER + payload;
+}
+
+long motion_codec_frame_length(const uint8_t * in, size_t available) {
+    if (available < MOTION_CODEC_HEADER) {
+        return 0;
+    }
+    if (in[0] != MOTION_CODEC_MAGIC0 || in[1] != MOTION_CODEC_MAGIC1 || in[3] != MOTION_CODEC_VERSION ||
+        (in[2] != MOTION_CODEC_KEY && in[2] != MOTION_CODEC_DELTA)) 
+    {
+        return -1;
+    }
+    return MOTION_CODEC_HEADER + (long)get_u32(in + 12);
+}
+
+// one plane of skip and literal runs into plane, which holds the reference
+static int decode_plane(reader_t * r, int count, uint16_t * plane, int sad, int key) {
+    uint16_t previous = 0;
+
+    for(int i = 0; i < count;) {
+        uint32_t skip, literals;
+
+        if (get_varint(r, &skip) != 0 || get_varint(r, &literals) != 0 ||
+            skip > (uint32_t)(count - i) || literals > (uint32_t)(count - i) - skip) 
+        {
+            return -1;
+        }
+
+        // skipped vectors of a keyframe are zero, everything else skipped
+        // keeps its reference
+        if (key && !sad) {
+            memset(plane + i, 0, skip * sizeof(uint16_t));
+        }
+        i += skip;
+
+        for(uint32_t k = 0; k < literals; k++, i++) {
+            if (!sad) {
+                if (r->end - r->p < 2) {
+                    return -1;
+                }
+                plane[i] = r->p[0] | (r->p[1] << 8);
+                r->p += 2;
+                continue;
+            }
+
+            uint32_t v;
+            if (get_varint(r, &v) != 0) {
+                return -1;
+            }
+            int32_t s = (key ? previous : plane[i]) + unzigzag(v);
+            if (s < 0 || s > 0xffff) {
+                return -1;
+            }
+            plane[i] = previous = s;
+        }
+    }
+
+    return 0;
+}
+
+int motion_codec_decode(motion_codec_t * codec, const uint8_t * in, size_t length, uint8_t * raw, size_t size) {
+    long frame = motion_codec_frame_length(in, length);
+
+    if (frame <= 0 || (size_t)frame != length || get_u32(in + 8) != codec->length || size < codec->length) {
+        return MOTION_CODEC_ERROR;
+    }
+
+    int key = in[2] == MOTION_CODEC_KEY;
+    uint32_t seq = get_u32(in + 4);
+
+    if (!key && (!codec->have_reference || seq != codec->seq + 1)) {
+        codec->have_reference = 0;
+        return MOTION_CODEC_NEED_KEY;
+    }
+
+    reader_t r = { in + MOTION_CODEC_HEADER, in + length };
+    if (decode_plane(&r, codec->count, codec->vectors, 0, key) != 0 ||
+        decode_plane(&r, codec->count, codec->sad, 1, key) != 0 ||
+        r.p != r.end) 
+    {
+        // the references are half updated
+        codec->have_reference = 0;
+        return MOTION_CODEC_ERROR;
+    }
+
+    codec->have_reference = 1;
+    codec->seq = seq;
+
+    for(int i = 0; i < codec->count; i++) {
+        raw[i * RAW_STRIDE] = codec->vectors[i];
+        raw[i * RAW_STRIDE + 1] = codec->vectors[i] >> 8;
+        raw[i * RAW_STRIDE + 2] = codec->sad[i];
+        raw[i * RAW_STRIDE + 3] = codec->sad[i] >> 8;
+    }
+
+    return (int)codec->length;
+}
@@ -0,0 +1,294 @@
+#include "motion_events.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int motion_detector_init(motion_detector_t * d, const motion_field_t * field) {
+    memset(d, 0, sizeof(*d));
+    d->width = field->width;
+    d->height = field->height;
+    d->next_id = 1;
+    d->next_seq = 1;
+
+    d->parent = malloc(field->count * sizeof(int));
+    d->region_of = malloc(field->count * sizeof(int));
+    if (d->parent == NULL || d->region_of == NULL) {
+        fprintf(stderr, "could not allocate motion detector\n");
+        motion_detector_destroy(d);
+        return -1;
+    }
+
+    return 0;
+}
+
+void motion_detector_destroy(motion_detector_t * d) {
+    free(d->parent);
+    free(d->region_of);
+    d->parent = NULL;
+    d->region_of = NULL;
+}
+
+static int find(int * parent, int i) {
+    // path halving, every other node on the way up skips a level
+    while(parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+static void unite(int * parent, int a, int b) {
+    a = find(parent, a);
+    b = find(parent, b);
+
+    // the lower index wins so roots stay first in raster order
+    if (a < b) {
+        parent[b] = a;
+    } else if (b < a) {
+        parent[a] = b;
+    }
+}
+
+static void label(motion_detector_t * d, const motion_field_t * field, uint16_t threshold) {
+    int * parent = d->parent;
+    int w = d->width;
+
+    // first pass, join every active macroblock to its left and upper 
+    // neighbours
+    for(int y = 0, i = 0; y < d->height; y++) {
+        for(int x = 0; x < w; x++, i++) {
+            if (field->magnitude[i] < threshold) {
+                parent[i] = -1;
+                continue;
+            }
+
+            parent[i] = i;
+            if (x > 0 && parent[i - 1] >= 0) {
+                unite(parent, i, i - 1);
+            }
+            if (y > 0 && parent[i - w] >= 0) {
+                unite(parent, i, i - w);
+            }
+        }
+    }
+
+    // second pass, a root comes before the rest of its component so its
+    // region exists by the time the others look it up
+    d->region_count = 0;
+    for(int y = 0, i = 0; y < d->height; y++) {
+        for(int x = 0; x < w; x++, i++) {
+            if (parent[i] < 0) {
+                continue;
+            }
+
+            int root = find(parent, i);
+            if (root == i) {
+                if (d->region_count == MOTION_MAX_REGIONS) {
+                    d->region_of[i] = -1;
+                    continue;
+                }
+                motion_region_t * r = &d->regions[d->region_count];
+                r->box.x0 = x;
+                r->box.y0 = y;
+                r->box.x1 = x + 1;
+                r->box.y1 = y + 1;
+                r->area = 0;
+                d->region_of[i] = d->region_count++;
+            }
+
+            int index = d->region_of[root];
+            if (index < 0) {
+                continue;
+            }
+
+            motion_region_t * r = &d->regions[index];
+            if (x < r->box.x0) r->box.x0 = x;
+            if (x >= r->box.x1) r->box.x1 = x + 1;
+            // rows only grow downwards in raster order
+            r->box.y1 = y + 1;
+            r->area++;
+        }
+    }
+}
+
+static int overlaps(const motion_box_t * a, const motion_box_t * b, int margin) {
+    return a->x0 - margin < b->x1 + margin && b->x0 - margin < a->x1 + margin &&
+        a->y0 - margin < b->y1 + margin && b->y0 - margin < a->y1 + margin;
+}
+
+static void box_extend(motion_box_t * a, const motion_box_t * b) {
+    if (b->x0 < a->x0) a->x0 = b->x0;
+    if (b->y0 < a->y0) a->y0 = b->y0;
+    if (b->x1 > a->x1) a->x1 = b->x1;
+    if (b->y1 > a->y1) a->y1 = b->y1;
+}
+
+static int box_area(const motion_box_t * b) {
+    return (b->x1 - b->x0) * (b->y1 - b->y0);
+}
+
+static motion_event_t * emit(motion_detector_t * d, motion_event_t * events, int * count, 
+    motion_event_type_t type, motion_track_t * t, int64_t pts) 
+{
+    motion_event_t * e = &events[(*count)++];
+
+    e->type = type;
+    e->seq = d->next_seq++;
+    e->id = t->id;
+    e->pts = pts;
+    if (type == MOTION_EVENT_START) {
+        e->box = t->box;
+        e->area = t->peak_area;
+        e->duration = 0;
+    } else {
+        e->box = t->extent;
+        e->area = t->peak_area;
+        e->duration = pts - t->start_pts;
+    }
+
+    d->history[d->history_next] = *e;
+    d->history_next = (d->history_next + 1) % MOTION_EVENT_HISTORY;
+    if (d->history_count < MOTION_EVENT_HISTORY) {
+        d->history_count++;
+    }
+
+    return e;
+}
+
+int motion_detector_update(motion_detector_t * d, const motion_field_t * field, uint16_t threshold, 
+    int64_t pts, motion_event_t * events) 
+{
+    int count = 0;
+
+    if (field->width != d->width || field->height != d->height) {
+        return 0;
+    }
+
+    label(d, field, threshold);
+
+    for(int i = 0; i < MOTION_MAX_TRACKS; i++) {
+        d->tracks[i].matched = 0;
+    }
+
+    for(int r = 0; r < d->region_count; r++) {
+        motion_region_t * region = &d->regions[r];
+        if (region->area < MOTION_MIN_REGION) {
+            continue;
+        }
+
+        // continue the track this region overlaps most, several regions
+        // may feed one track when something splits up
+        motion_track_t * best = NULL;
+        int best_overlap = -1;
+        motion_track_t * free_track = NULL;
+
+        for(int i = 0; i < MOTION_MAX_TRACKS; i++) {
+            motion_track_t * t = &d->tracks[i];
+            if (!t->used) {
+                if (free_track == NULL) {
+                    free_track = t;
+                }
+                continue;
+            }
+            if (!overlaps(&t->box, &region->box, MOTION_TRACK_MARGIN)) {
+                continue;
+            }
+
+            motion_box_t common = {
+                region->box.x0 > t->box.x0 ? region->box.x0 : t->box.x0,
+                region->box.y0 > t->box.y0 ? region->box.y0 : t->box.y0,
+                region->box.x1 < t->box.x1 ? region->box.x1 : t->box.x1,
+                region->box.y1 < t->box.y1 ? region->box.y1 : t->box.y1
+            };
+            int overlap = common.x1 > common.x0 && common.y1 > common.y0 ? box_area(&common) : 0;
+            if (overlap > best_overlap) {
+                best = t;
+                best_overlap = overlap;
+            }
+        }
+
+        if (best != NULL) {
+            if (best->matched) {
+                box_extend(&best->box, &region->box);
+            } else {
+                best->box = region->box;
+                best->matched = 1;
+            }
+        } else if (free_track != NULL) {
+            // nothing overlaps, the region starts a new track
+            memset(free_track, 0, sizeof(*free_track));
+            free_track->used = 1;
+            free_track->matched = 1;
+            free_track->id = d->next_id++;
+            free_track->box = region->box;
+            free_track->extent = region->box;
+            free_track->start_pts = pts;
+            best = free_track;
+        } else {
+            // out of tracks, the region goes unreported
+            continue;
+        }
+
+        if (region->area > best->peak_area) {
+            best->peak_area = region->area;
+        }
+    }
+
+    for(int i = 0; i < MOTION_MAX_TRACKS; i++) {
+        motion_track_t * t = &d->tracks[i];
+        if (!t->used) {
+            continue;
+        }
+
+        if (t->matched) {
+            t->hits++;
+            t->misses = 0;
+            box_extend(&t->extent, &t->box);
+
+            if (!t->started && t->hits >= MOTION_START_FIELDS) {
+                t->started = 1;
+                t->start_pts = pts;
+                emit(d, events, &count, MOTION_EVENT_START, t, pts);
+            }
+        } else if (!t->started) {
+            // never got going, forget it quietly
+            t->used = 0;
+        } else if (++t->misses >= MOTION_STOP_FIELDS) {
+            emit(d, events, &count, MOTION_EVENT_STOP, t, pts);
+            t->used = 0;
+        }
+    }
+
+    return count;
+}
+
+int motion_event_format(const motion_event_t * e, char * buf, size_t size) {
+    int n = snprintf(buf, size, 
+        "{\"seq\":%llu,\"event\":\"%s\",\"id\":%u,\"pts\":%lld,"
+        "\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d,\"area\":%d,\"duration\":%lld}\n",
+        (unsigned long long)e->seq,
+        e->type == MOTION_EVENT_START ? "start" : "stop",
+        e->id,
+        (long long)e->pts,
+        e->box.x0, e->box.y0, e->box.x1 - e->box.x0, e->box.y1 - e->box.y0,
+        e->area,
+        (long long)e->duration);
+
+    if (n < 0) {
+        return 0;
+    }
+    return (size_t)n < size ? n : (int)size - 1;
+}
+
+size_t motion_detector_history(const motion_detector_t * d, char * buf, size_t size) {
+    size_t length = 0;
+    int first = (d->history_next - d->history_count + MOTION_EVENT_HISTORY) % MOTION_EVENT_HISTORY;
+
+    for(int i = 0; i < d->history_count && length + 1 < size; i++) {
+        const motion_event_t * e = &d->history[(first + i) % MOTION_EVENT_HISTORY];
+        length += motion_event_format(e, buf + length, size - length);
+    }
+
+    return length;
+}
@@ -0,0 +1,305 @@
+#include "motion_history.h"
+#include "motion_codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+_Static_assert(sizeof(motion_record_t) == 128, "motion records are two cache lines");
+_Static_assert(sizeof(motion_history_header_t) <= MOTION_HISTORY_HEADER_SIZE, "motion history header too big");
+
+static uint64_t wall_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t file_size(uint64_t capacity, uint64_t grid_capacity) {
+    return MOTION_HISTORY_HEADER_SIZE + capacity * sizeof(motion_record_t) + grid_capacity;
+}
+
+int motion_history_open(motion_history_t * history, const char * path, uint64_t capacity, 
+    uint64_t grid_capacity, unsigned int grid_interval) 
+{
+    struct stat st;
+
+    history->size = file_size(capacity, grid_capacity);
+    history->map = MAP_FAILED;
+    history->header = NULL;
+    history->scratch = NULL;
+    history->grid_interval = grid_interval;
+    history->since_grid = 0;
+
+    if ((history->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        perror("could not open motion history");
+        goto error;
+    }
+    if (fstat(history->fd, &st) != 0) {
+        perror("could not stat motion history");
+        goto error;
+    }
+
+    // a file of another layout starts over, the old records mean nothing
+    // in the new one
+    int fresh = (size_t)st.st_size != history->size;
+    if (fresh && ftruncate(history->fd, history->size) != 0) {
+        perror("could not size motion history");
+        goto error;
+    }
+
+    history->map = mmap(NULL, history->size, PROT_READ | PROT_WRITE, MAP_SHARED, history->fd, 0);
+    if (history->map == MAP_FAILED) {
+        perror("could not map motion history");
+        goto error;
+    }
+
+    history->header = (motion_history_header_t*)history->map;
+    history->records = (motion_record_t*)(history->map + MOTION_HISTORY_HEADER_SIZE);
+    history->grids = history->map + MOTION_HISTORY_HEADER_SIZE + capacity * sizeof(motion_record_t);
+
+    motion_history_header_t * h = history->header;
+    if (fresh || memcmp(h->magic, MOTION_HISTORY_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != MOTION_HISTORY_VERSION || h->record_size != sizeof(motion_record_t) ||
+        h->capacity != capacity || h->grid_capacity != grid_capacity) 
+    {
+        memset(history->map, 0, MOTION_HISTORY_HEADER_SIZE + capacity * sizeof(motion_record_t));
+        memcpy(h->magic, MOTION_HISTORY_MAGIC, sizeof(h->magic));
+        h->version = MOTION_HISTORY_VERSION;
+        h->record_size = sizeof(motion_record_t);
+        h->capacity = capacity;
+        h->grid_capacity = grid_capacity;
+        atomic_init(&h->head, 0);
+        atomic_init(&h->grid_head, 0);
+    }
+
+    uint64_t head = atomic_load(&h->head);
+    history->last_time_us = head > 0 ? history->records[(head - 1) % capacity].time_us : 0;
+
+    return 0;
+
+error:
+    if (history->fd >= 0) {
+        close(history->fd);
+    }
+    history->fd = -1;
+    return -1;
+}
+
+void motion_history_close(motion_history_t * history) {
+    if (history->header == NULL) {
+        return;
+    }
+    munmap(history->map, history->size);
+    close(history->fd);
+    history->header = NULL;
+    free(history->scratch);
+    history->scratch = NULL;
+}
+
+// copy length bytes into the grid ring and return where they start.  the 
+// head moves first so readers can tell which old grids this overwrites
+static uint64_t grid_write(motion_history_t * history, const uint8_t * data, size_t length) {
+    motion_history_header_t * h = history->header;
+    uint64_t start = atomic_load_explicit(&h->grid_head, memory_order_relaxed);
+
+    // grids never wrap, a tail too short for this one is skipped
+    uint64_t at = start % h->grid_capacity;
+    if (at + length > h->grid_capacity) {
+        start += h->grid_capacity - at;
+        at = 0;
+    }
+
+    atomic_store_explicit(&h->grid_head, start + length, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(history->grids + at, data, length);
+
+    return start;
+}
+
+void motion_history_append(motion_history_t * history, int64_t pts, const motion_stats_t * stats, 
+    const uint8_t * raw, size_t length) 
+{
+    motion_history_header_t * h = history->header;
+
+    if (h == NULL) {
+        return;
+    }
+
+    uint64_t grid_offset = 0;
+    uint32_t grid_length = 0;
+
+    if (raw != NULL && h->grid_capacity > 0 && history->grid_interval > 0 && 
+        history->since_grid++ % history->grid_interval == 0) 
+    {
+        size_t bound = motion_codec_bound(length);
+        if (bound > history->scratch_size) {
+            free(history->scratch);
+            history->scratch = malloc(bound);
+            history->scratch_size = history->scratch ? bound : 0;
+        }
+
+        size_t n = history->scratch ? motion_codec_encode_key(raw, length, 0, history->scratch, history->scratch_size) : 0;
+        if (n > 0 && n <= h->grid_capacity) {
+            grid_offset = grid_write(history, history->scratch, n);
+            grid_length = n;
+        }
+    }
+
+    uint64_t index = atomic_load_explicit(&h->head, memory_order_relaxed);
+    motion_record_t * r = &history->records[index % h->capacity];
+    // odd while writing.  a crash mid write leaves an odd sequence in the
+    // file, or it in rather than adding so the slot comes out even again
+    unsigned int sequence = atomic_load_explicit(&r->sequence, memory_order_relaxed) | 1;
+
+    atomic_store_explicit(&r->sequence, sequence, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    r->active = stats->active;
+    r->index = index;
+    uint64_t now = wall_us();
+    if (now > history->last_time_us) {
+        history->last_time_us = now;
+    }
+    r->time_us = history->last_time_us;
+    r->pts = pts;
+    r->magnitude_sum = stats->magnitude_sum;
+    r->grid_offset = grid_offset;
+    r->grid_length = grid_length;
+    r->activity = stats->activity;
+    for(int i = 0; i < MOTION_SAD_BUCKETS; i++) {
+        r->sad_histogram[i] = stats->sad_histogram[i] > UINT16_MAX ? UINT16_MAX : stats->sad_histogram[i];
+    }
+
+    atomic_store_explicit(&r->sequence, sequence + 1, memory_order_release);
+    atomic_store_explicit(&h->head, index + 1, memory_order_release);
+}
+
+// copy record index out, -1 if it has been overwritten or is being written
+static int record_read(motion_history_t * history, uint64_t index, motion_record_t * out) {
+    motion_record_t * r = &history->records[index % history->header->capacity];
+
+    for(int attempt = 0; attempt < 4; attempt++) {
+        unsigned int before = atomic_load_explicit(&r->sequence, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+
+        memcpy((uint8_t*)out + sizeof(out->sequence), (uint8_t*)r + sizeof(r->sequence), 
+            sizeof(*r) - sizeof(r->sequence));
+        atomic_thread_fence(memory_order_acquire);
+
+        if (atomic_load_explicit(&r->sequence, memory_order_relaxed) == before) {
+            return out->index == index ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+// records still in the ring, [first, head)
+static void record_range(motion_history_t * history, uint64_t * first, uint64_t * head) {
+    uint64_t capacity = history->header->capacity;
+
+    *head = atomic_load_explicit(&history->header->head, memory_order_acquire);
+    // leave the slot the writer will take next alone
+    *first = *head > capacity - 1 ? *head - (capacity - 1) : 0;
+}
+
+// first record with time >= t, append keeps times from going back.  a 
+// record lost to the writer along the way counts as older
+static uint64_t record_search(motion_history_t * history, uint64_t t) {
+    uint64_t lo, hi;
+    motion_record_t r;
+
+    record_range(history, &lo, &hi);
+    while(lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (record_read(history, mid, &r) != 0 || r.time_us < t) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+size_t motion_history_format(motion_history_t * history, uint64_t from_us, uint64_t to_us, 
+    int limit, char * out, size_t size, uint64_t * next) 
+{
+    size_t length = 0;
+    uint64_t first, head;
+    motion_record_t r;
+    int count = 0;
+
+    *next = 0;
+    if (history->header == NULL) {
+        return 0;
+    }
+
+    record_range(history, &first, &head);
+    for(uint64_t i = record_search(history, from_us); i < head; i++) {
+        if (record_read(history, i, &r) != 0) {
+            continue;
+        }
+        if (r.time_us >= to_us) {
+            break;
+        }
+        if (count == limit || size - length < MOTION_HISTORY_LINE_MAX) {
+            *next = r.time_us;
+            break;
+        }
+
+        length += snprintf(out + length, size - length,
+            "{\"t\":%llu,\"pts\":%lld,\"active\":%u,\"activity\":%.4f,\"magnitude\":%llu,\"grid\":%d,"
+            "\"sad\":[%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u]}\n",
+            (unsigned long long)(r.time_us / 1000), (long long)r.pts, r.active, r.activity, 
+            (unsigned long long)r.magnitude_sum, r.grid_length > 0,
+            r.sad_histogram[0], r.sad_histogram[1], r.sad_histogram[2], r.sad_histogram[3],
+            r.sad_histogram[4], r.sad_histogram[5], r.sad_histogram[6], r.sad_histogram[7],
+            r.sad_histogram[8], r.sad_histogram[9], r.sad_histogram[10], r.sad_histogram[11],
+            r.sad_histogram[12], r.sad_histogram[13], r.sad_histogram[14], r.sad_histogram[15]);
+        count++;
+    }
+
+    return length;
+}
+
+size_t motion_history_grid(motion_history_t * history, uint64_t at_us, uint8_t * out, size_t size, 
+    motion_record_t * record) 
+{
+    motion_history_header_t * h = history->header;
+    uint64_t first, head;
+
+    if (h == NULL) {
+        return 0;
+    }
+
+    record_range(history, &first, &head);
+    uint64_t i = record_search(history, at_us + 1);
+
+    // walk back to the closest field that kept its grid
+    for(unsigned int k = 0; i > first && k <= history->grid_interval; k++) {
+        if (record_read(history, --i, record) != 0 || record->grid_length == 0) {
+            continue;
+        }
+        if (record->grid_length > size) {
+            return 0;
+        }
+
+        memcpy(out, history->grids + record->grid_offset % h->grid_capacity, record->grid_length);
+        atomic_thread_fence(memory_order_acquire);
+
+        // the writer may have taken the space while we copied
+        uint64_t grid_head = atomic_load_explicit(&h->grid_head, memory_order_relaxed);
+        if (grid_head - record->grid_offset > h->grid_capacity) {
+            return 0;
+        }
+        return record->grid_length;
+    }
+
+    return 0;
+}
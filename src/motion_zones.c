@@ -0,0 +1,283 @@
+#include "motion_zones.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int motion_integral_init(motion_integral_t * ii, const motion_field_t * field) {
+    ii->width = field->width;
+    ii->height = field->height;
+    ii->stride = field->width + 1;
+
+    size_t size = (size_t)ii->stride * (ii->height + 1) * sizeof(uint32_t);
+    ii->active = calloc(1, size);
+    ii->magnitude = calloc(1, size);
+    ii->sad = calloc(1, size);
+
+    if (ii->active == NULL || ii->magnitude == NULL || ii->sad == NULL) {
+        fprintf(stderr, "could not allocate motion integral tables\n");
+        motion_integral_destroy(ii);
+        return -1;
+    }
+
+    return 0;
+}
+
+void motion_integral_destroy(motion_integral_t * ii) {
+    free(ii->active);
+    free(ii->magnitude);
+    free(ii->sad);
+    ii->active = ii->magnitude = ii->sad = NULL;
+}
+
+void motion_integral_build(motion_integral_t * ii, const motion_field_t * field, uint16_t threshold) {
+    int stride = ii->stride;
+
+    // the first row and column stay zero from init
+    for(int y = 0; y < ii->height; y++) {
+        const uint16_t * magnitude = field->magnitude + y * field->width;
+        const uint16_t * sad = field->sad + y * field->width;
+        uint32_t * active_row = ii->active + (y + 1) * stride + 1;
+        uint32_t * magnitude_row = ii->magnitude + (y + 1) * stride + 1;
+        uint32_t * sad_row = ii->sad + (y + 1) * stride + 1;
+        uint32_t a = 0, m = 0, s = 0;
+
+        // running sums along the row plus the finished row above
+        for(int x = 0; x < ii->width; x++) {
+            a += magnitude[x] >= threshold;
+            m += magnitude[x];
+            s += sad[x];
+            active_row[x] = a + active_row[x - stride];
+            magnitude_row[x] = m + magnitude_row[x - stride];
+            sad_row[x] = s + sad_row[x - stride];
+        }
+    }
+}
+
+int motion_zones_init(motion_zones_t * zones, const motion_field_t * field) {
+    zones->count = 0;
+    zones->width = field->width;
+    zones->height = field->height;
+
+    if (pthread_mutex_init(&zones->mutex, NULL) != 0) {
+        perror("could not create zone mutex");
+        return -1;
+    }
+    return 0;
+}
+
+void motion_zones_destroy(motion_zones_t * zones) {
+    pthread_mutex_destroy(&zones->mutex);
+}
+
+static int valid_name(const char * name) {
+    size_t length = strlen(name);
+
+    if (length == 0 || length >= MOTION_ZONE_NAME_MAX) {
+        return 0;
+    }
+    // names go into json unescaped
+    for(size_t i = 0; i < length; i++) {
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int find_zone(motion_zones_t * zones, const char * name) {
+    for(int i = 0; i < zones->count; i++) {
+        if (strcmp(zones->zones[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int motion_zones_add(motion_zones_t * zones, const char * name, int x, int y, int w, int h) {
+    if (!valid_name(name) || x < 0 || y < 0 || w <= 0 || h <= 0 || 
+        x + w > zones->width || y + h > zones->height) 
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&zones->mutex);
+
+    int i = find_zone(zones, name);
+    if (i < 0) {
+        if (zones->count == MOTION_MAX_ZONES) {
+            pthread_mutex_unlock(&zones->mutex);
+            return -1;
+        }
+        i = zones->count++;
+    }
+
+    motion_zone_t * z = &zones->zones[i];
+    strcpy(z->name, name);
+    z->x = x;
+    z->y = y;
+    z->w = w;
+    z->h = h;
+
+    pthread_mutex_unlock(&zones->mutex);
+    return 0;
+}
+
+int motion_zones_remove(motion_zones_t * zones, const char * name) {
+    pthread_mutex_lock(&zones->mutex);
+
+    int i = find_zone(zones, name);
+    if (i >= 0) {
+        zones->zones[i] = zones->zones[--zones->count];
+    }
+
+    pthread_mutex_unlock(&zones->mutex);
+    return i >= 0 ? 0 : -1;
+}
+
+int motion_zones_count(motion_zones_t * zones) {
+    pthread_mutex_lock(&zones->mutex);
+    int count = zones->count;
+    pthread_mutex_unlock(&zones->mutex);
+    return count;
+}
+
+// copy of the current zones, so nothing is formatted under the mutex
+static int zones_copy(motion_zones_t * zones, motion_zone_t * out) {
+    pthread_mutex_lock(&zones->mutex);
+    int count = zones->count;
+    memcpy(out, zones->zones, count * sizeof(motion_zone_t));
+    pthread_mutex_unlock(&zones->mutex);
+    return count;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// url decode n bytes of src into value, -1 for a broken escape or when it
+// does not fit
+static int url_decode(const char * src, size_t n, char * value, size_t size) {
+    size_t out = 0;
+
+    for(size_t i = 0; i < n; i++) {
+        char c = src[i];
+        if (c == '%') {
+            int hi = i + 2 < n ? hex_digit(src[i + 1]) : -1;
+            int lo = hi >= 0 ? hex_digit(src[i + 2]) : -1;
+            if (lo < 0) {
+                return -1;
+            }
+            c = (char)(hi << 4 | lo);
+            i += 2;
+        } else if (c == '+') {
+            c = ' ';
+        }
+        if (out + 1 >= size) {
+            return -1;
+        }
+        value[out++] = c;
+    }
+    value[out] = '\0';
+    return 0;
+}
+
+// value of name=... in a query string, url decoded into value
+static int query_value(const char * query, size_t length, const char * name, char * value, size_t size) {
+    size_t name_length = strlen(name);
+    const char * end = query + length;
+    const char * p = query;
+
+    while(p < end) {
+        const char * amp = memchr(p, '&', end - p);
+        const char * next = amp ? amp : end;
+
+        if ((size_t)(next - p) > name_length && p[name_length] == '=' && strncmp(p, name, name_length) == 0) {
+            size_t n = next - p - name_length - 1;
+            return url_decode(p + name_length + 1, n, value, size) == 0 ? 1 : -1;
+        }
+        p = next + 1;
+    }
+    return 0;
+}
+
+int motion_zones_command(motion_zones_t * zones, const char * query, size_t query_length, char * out, size_t size) {
+    char value[MOTION_ZONE_LINE_MAX];
+    int found;
+
+    if ((found = query_value(query, query_length, "add", value, sizeof(value))) != 0) {
+        char name[MOTION_ZONE_NAME_MAX + 1];
+        int x, y, w, h;
+        char extra;
+
+        if (found < 0 || sscanf(value, "%32[^,],%d,%d,%d,%d%c", name, &x, &y, &w, &h, &extra) != 5 ||
+            motion_zones_add(zones, name, x, y, w, h) != 0) 
+        {
+            snprintf(out, size, "add=name,x,y,w,h in macroblocks inside %dx%d, "
+                "names of letters, digits, _ and -, at most %d zones\n", 
+                zones->width, zones->height, MOTION_MAX_ZONES);
+            return -1;
+        }
+    }
+
+    if ((found = query_value(query, query_length, "remove", value, sizeof(value))) != 0) {
+        if (found < 0 || motion_zones_remove(zones, value) != 0) {
+            snprintf(out, size, "no such zone\n");
+            return -1;
+        }
+    }
+
+    motion_zone_t copy[MOTION_MAX_ZONES];
+    int count = zones_copy(zones, copy);
+    size_t length = snprintf(out, size, "{\"width\":%d,\"height\":%d,\"zones\":[", zones->width, zones->height);
+
+    for(int i = 0; i < count && length < size; i++) {
+        motion_zone_t * z = &copy[i];
+        length += snprintf(out + length, size - length, "%s{\"name\":\"%s\",\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d}",
+            i > 0 ? "," : "", z->name, z->x, z->y, z->w, z->h);
+    }
+    if (length < size) {
+        length += snprintf(out + length, size - length, "]}\n");
+    }
+
+    return length < size ? (int)length : (int)size - 1;
+}
+
+size_t motion_zones_score(motion_zones_t * zones, const motion_integral_t * ii, int64_t pts, char * out, size_t size) {
+    motion_zone_t copy[MOTION_MAX_ZONES];
+    int count = zones_copy(zones, copy);
+
+    if (count == 0) {
+        return 0;
+    }
+
+    size_t length = snprintf(out, size, "{\"pts\":%lld,\"zones\":{", (long long)pts);
+
+    for(int i = 0; i < count && length < size; i++) {
+        motion_zone_t * z = &copy[i];
+        float area = (float)(z->w * z->h);
+
+        uint32_t active = motion_integral_sum(ii, ii->active, z->x, z->y, z->w, z->h);
+        uint32_t magnitude = motion_integral_sum(ii, ii->magnitude, z->x, z->y, z->w, z->h);
+        uint32_t sad = motion_integral_sum(ii, ii->sad, z->x, z->y, z->w, z->h);
+
+        length += snprintf(out + length, size - length, 
+            "%s\"%s\":{\"active\":%.3f,\"magnitude\":%.1f,\"sad\":%.1f}",
+            i > 0 ? "," : "", z->name, active / area, magnitude / area, sad / area);
+    }
+    if (length < size) {
+        length += snprintf(out + length, size - length, "}}\n");
+    }
+
+    return length < size ? length : size - 1;
+}
@@ -0,0 +1,297 @@
+#include "pipeline.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void stream_subscriber(void * user, snapshot_t * frame) {
+    server_write_frame((server_t*)user, frame);
+}
+
+static void http_motion_subscriber(void * user, snapshot_t * frame) {
+    http_server_motion_snapshot((http_server_t*)user, snapshot_retain(frame));
+}
+
+static void http_frame_subscriber(void * user, snapshot_t * frame) {
+    http_server_frame_snapshot((http_server_t*)user, snapshot_retain(frame));
+}
+
+// report events the latest field started or stopped
+static void publish_motion_events(pipeline_t * p, int64_t pts) {
+    motion_event_t events[MOTION_MAX_EVENTS];
+    int count = motion_detector_update(&p->motion_detector, &p->motion_field,
+        p->motion_threshold, pts, events);
+    if (count == 0) {
+        return;
+    }
+
+    char line[MOTION_EVENT_LINE_MAX];
+    for(int i = 0; i < count; i++) {
+        int length = motion_event_format(&events[i], line, sizeof(line));
+        server_write(&p->event_server, (uint8_t*)line, length);
+    }
+
+    snapshot_t * history = snapshot_alloc(MOTION_EVENT_HISTORY * MOTION_EVENT_LINE_MAX);
+    if (history != NULL) {
+        history->length = motion_detector_history(&p->motion_detector,
+            (char*)history->data, history->capacity);
+        http_server_events_snapshot(&p->http_server, history);
+    }
+}
+
+// score the configured zones against the latest field, the tables are 
+// only built while there are zones
+static void publish_zone_scores(pipeline_t * p, int64_t pts) {
+    if (motion_zones_count(&p->motion_zones) == 0) {
+        return;
+    }
+    motion_integral_build(&p->motion_integral, &p->motion_field, p->motion_threshold);
+
+    snapshot_t * scores = frame_bus_alloc(&p->bus, MOTION_MAX_ZONES * MOTION_ZONE_LINE_MAX);
+    if (scores == NULL) {
+        return;
+    }
+
+    scores->length = motion_zones_score(&p->motion_zones, &p->motion_integral, pts,
+        (char*)scores->data, scores->capacity);
+    if (scores->length == 0) {
+        snapshot_release(scores);
+        return;
+    }
+    scores->pts = pts;
+    http_server_zone_scores_snapshot(&p->http_server, scores);
+}
+
+// runs on the bus thread, which is the only user of the field and stats
+static void motion_analysis_subscriber(void * user, snapshot_t * frame) {
+    pipeline_t * p = (pipeline_t*)user;
+
+    if (motion_field_decode(&p->motion_field, frame->data, frame->length) != 0) {
+        return;
+    }
+    motion_field_analyze(&p->motion_field, p->motion_threshold, &p->motion_stats);
+    motion_history_append(&p->motion_history, frame->pts, &p->motion_stats, frame->data, frame->length);
+
+    // zones and events only see what stands out from the learned noise
+    motion_background_apply(&p->motion_background, &p->motion_field);
+    if (p->motion_background.fields % PIPELINE_BACKGROUND_SAVE_FIELDS == 0 &&
+        pthread_mutex_trylock(&p->motion_background_mutex) == 0)
+    {
+        // a save still running keeps the older copy, the next one catches up
+        motion_background_copy(&p->motion_background_pending, &p->motion_background);
+        atomic_store(&p->motion_background_dirty, 1);
+        pthread_mutex_unlock(&p->motion_background_mutex);
+    }
+
+    publish_zone_scores(p, frame->pts);
+    publish_motion_events(p, frame->pts);
+}
+
+// the compressed variant of the motion stream, only encoded while some
+// client takes it
+static void motion_rle_subscriber(void * user, snapshot_t * frame) {
+    pipeline_t * p = (pipeline_t*)user;
+    int variant = p->motion_rle_variant;
+    int key = server_variant_joined(&p->motion_server, variant);
+
+    if (server_variant_clients(&p->motion_server, variant) == 0) {
+        // start over with a keyframe when someone comes back
+        p->motion_codec.have_reference = 0;
+        return;
+    }
+
+    snapshot_t * encoded = frame_bus_alloc(&p->bus, motion_codec_bound(frame->length));
+    if (encoded == NULL) {
+        return;
+    }
+
+    encoded->length = motion_codec_encode(&p->motion_codec, frame->data, frame->length, key,
+        encoded->data, encoded->capacity);
+    if (encoded->length > 0) {
+        encoded->pts = frame->pts;
+        encoded->sensor_us = frame->sensor_us;
+        encoded->callback_us = frame->callback_us;
+        encoded->time_us = frame->time_us;
+        encoded->published_us = frame->published_us;
+        server_write_variant(&p->motion_server, variant, encoded, encoded->data[2] == MOTION_CODEC_KEY);
+    }
+    snapshot_release(encoded);
+}
+
+static int http_zones_handler(void * user, const char * query, size_t query_length, char * out, size_t size) {
+    return motion_zones_command((motion_zones_t*)user, query, query_length, out, size);
+}
+
+int pipeline_init(pipeline_t * p) {
+    memset(&p->motion_field, 0, sizeof(p->motion_field));
+    memset(&p->motion_stats, 0, sizeof(p->motion_stats));
+    memset(&p->motion_detector, 0, sizeof(p->motion_detector));
+    memset(&p->motion_integral, 0, sizeof(p->motion_integral));
+    memset(&p->motion_zones, 0, sizeof(p->motion_zones));
+    memset(&p->motion_background, 0, sizeof(p->motion_background));
+    memset(&p->motion_background_pending, 0, sizeof(p->motion_background_pending));
+    pthread_mutex_init(&p->motion_background_mutex, NULL);
+    atomic_init(&p->motion_background_dirty, 0);
+    memset(&p->motion_codec, 0, sizeof(p->motion_codec));
+    memset(&p->motion_history, 0, sizeof(p->motion_history));
+    p->motion_threshold = MOTION_DEFAULT_THRESHOLD;
+    p->motion_background_path = PIPELINE_BACKGROUND_PATH;
+    p->motion_history_path = PIPELINE_HISTORY_PATH;
+
+    if (latency_init(&p->latency) != 0) {
+        return -1;
+    }
+
+    if (frame_assembler_init(&p->image_assembler, PIPELINE_JPEG_FRAME_CAPACITY, PIPELINE_JPEG_FRAME_POOL) != 0) {
+        fprintf(stderr, "could not create jpeg frame assembler\n");
+        return -1;
+    }
+
+    if (frame_bus_init(&p->bus) != 0) {
+        fprintf(stderr, "could not create frame bus\n");
+        return -1;
+    }
+
+    if (server_create(&p->video_server, PIPELINE_VIDEO_PORT) != 0) {
+        fprintf(stderr, "could not create server\n");
+        return -1;
+    }
+    server_enable_gop_cache(&p->video_server);
+
+    if (server_create(&p->motion_server, PIPELINE_MOTION_PORT) != 0) {
+        fprintf(stderr, "could not create motion vector server\n");
+        return -1;
+    }
+
+    // clients that send "enc=rle" get the motion codec stream instead
+    p->motion_rle_variant = server_add_variant(&p->motion_server, "rle");
+
+    if (server_create(&p->event_server, PIPELINE_EVENT_PORT) != 0) {
+        fprintf(stderr, "could not create motion event server\n");
+        return -1;
+    }
+
+    if (http_server_create(&p->http_server, PIPELINE_HTTP_PORT) != 0) {
+        fprintf(stderr, "could not create http server\n");
+        return -1;
+    }
+
+    frame_bus_set_latency(&p->bus, &p->latency);
+    server_set_latency(&p->video_server, &p->latency, FRAME_VIDEO);
+    server_set_latency(&p->motion_server, &p->latency, FRAME_MOTION);
+    http_server_set_latency(&p->http_server, &p->latency);
+
+    frame_bus_subscribe(&p->bus, FRAME_VIDEO, stream_subscriber, &p->video_server);
+    frame_bus_subscribe(&p->bus, FRAME_MOTION, stream_subscriber, &p->motion_server);
+    frame_bus_subscribe(&p->bus, FRAME_MOTION, motion_rle_subscriber, p);
+    frame_bus_subscribe(&p->bus, FRAME_MOTION, http_motion_subscriber, &p->http_server);
+    frame_bus_subscribe(&p->bus, FRAME_MOTION, motion_analysis_subscriber, p);
+    frame_bus_subscribe(&p->bus, FRAME_JPEG, http_frame_subscriber, &p->http_server);
+
+    // the producers only copy and post, this thread feeds the servers
+    if (frame_bus_start(&p->bus) != 0) {
+        return -1;
+    }
+
+    char config[4096];
+    int config_length = snprintf(config, sizeof(config),
+            "video: \":%d\"\n"
+            "motion: \":%d\"\n"
+            "events: \":%d\"\n"
+            "api: \":%d\"\n",
+            PIPELINE_VIDEO_PORT,
+            PIPELINE_MOTION_PORT,
+            PIPELINE_EVENT_PORT,
+            PIPELINE_HTTP_PORT);
+
+    http_server_config(&p->http_server, (uint8_t*)config, config_length);
+
+    return 0;
+}
+
+int pipeline_set_resolution(pipeline_t * p, int width, int height) {
+    if (motion_field_init(&p->motion_field, width, height) != 0) {
+        return -1;
+    }
+    fprintf(stderr, "motion kernels: %s\n", p->motion_field.kernels->name);
+    if (motion_detector_init(&p->motion_detector, &p->motion_field) != 0) {
+        return -1;
+    }
+    if (motion_integral_init(&p->motion_integral, &p->motion_field) != 0 ||
+        motion_zones_init(&p->motion_zones, &p->motion_field) != 0)
+    {
+        return -1;
+    }
+    http_server_on_zones(&p->http_server, http_zones_handler, &p->motion_zones);
+
+    if (motion_codec_init(&p->motion_codec, p->motion_field.length,
+            MOTION_CODEC_KEY_INTERVAL, MOTION_CODEC_SAD_TOLERANCE) != 0)
+    {
+        return -1;
+    }
+
+    if (motion_background_init(&p->motion_background, &p->motion_field) != 0 ||
+        motion_background_init(&p->motion_background_pending, &p->motion_field) != 0)
+    {
+        return -1;
+    }
+    if (motion_background_load(&p->motion_background, p->motion_background_path) == 0) {
+        fprintf(stderr, "motion background: %u fields from %s\n",
+            p->motion_background.fields, p->motion_background_path);
+    }
+
+    // the camera runs without history if the file cannot be had
+    if (motion_history_open(&p->motion_history, p->motion_history_path, PIPELINE_HISTORY_RECORDS,
+            PIPELINE_HISTORY_GRID_BYTES, PIPELINE_HISTORY_GRID_INTERVAL) == 0)
+    {
+        http_server_set_motion_history(&p->http_server, &p->motion_history);
+    }
+
+    return 0;
+}
+
+void pipeline_persist(pipeline_t * p) {
+    if (!atomic_load(&p->motion_background_dirty)) {
+        return;
+    }
+
+    pthread_mutex_lock(&p->motion_background_mutex);
+    atomic_store(&p->motion_background_dirty, 0);
+    motion_background_save(&p->motion_background_pending, p->motion_background_path);
+    pthread_mutex_unlock(&p->motion_background_mutex);
+}
+
+void pipeline_stop(pipeline_t * p) {
+    // nothing reaches the servers once the bus thread is gone
+    frame_bus_stop(&p->bus);
+
+    if (p->motion_background.fields > 0) {
+        motion_background_save(&p->motion_background, p->motion_background_path);
+    }
+
+    server_close(&p->video_server);
+    server_close(&p->motion_server);
+    server_close(&p->event_server);
+    http_server_destroy(&p->http_server);
+
+    // jpeg frames can be encoder buffers on loan, they go back while
+    // whoever made them is still there
+    frame_bus_drain(&p->bus);
+}
+
+void pipeline_destroy(pipeline_t * p) {
+    frame_bus_destroy(&p->bus);
+    // after the http server and the bus, which held on to the last frames
+    frame_assembler_destroy(&p->image_assembler);
+    motion_field_destroy(&p->motion_field);
+    motion_detector_destroy(&p->motion_detector);
+    motion_integral_destroy(&p->motion_integral);
+    motion_zones_destroy(&p->motion_zones);
+    motion_background_destroy(&p->motion_background);
+    motion_background_destroy(&p->motion_background_pending);
+    pthread_mutex_destroy(&p->motion_background_mutex);
+    motion_codec_destroy(&p->motion_codec);
+    // after the http server, whose workers read it
+    motion_history_close(&p->motion_history);
+    latency_destroy(&p->latency);
+}
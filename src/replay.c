@@ -0,0 +1,227 @@
+#include "replay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until_us(uint64_t t) {
+    struct timespec ts;
+    ts.tv_sec = t / 1000000;
+    ts.tv_nsec = (t % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+        // EINTR
+    }
+}
+
+// pts shifted for the current pass, an unknown pts stays unknown
+static int64_t replay_pts(replay_t * replay, int64_t pts) {
+    return pts < 0 ? pts : pts + replay->pts_offset;
+}
+
+// a fragment of a jpeg frame, assembled like the camera's image callback
+// does.  the frame is only wanted while someone is looking
+static void replay_image(replay_t * replay, capture_record_t * r, const uint8_t * data) {
+    pipeline_t * p = replay->pipeline;
+    frame_assembler_t * assembler = &p->image_assembler;
+    int end = r->marks & CAPTURE_FRAME_END;
+
+    if (r->marks & CAPTURE_FAILED) {
+        frame_assembler_reset(assembler);
+        replay->jpeg_skipping = 0;
+        return;
+    }
+
+    // decide at the start of each frame
+    if (frame_assembler_length(assembler) == 0 && !replay->jpeg_skipping) {
+        int wanted = http_server_frame_wanted(&p->http_server, REPLAY_JPEG_LINGER_MS);
+        if (!wanted && replay->jpeg_active) {
+            http_server_frame_paused(&p->http_server);
+        }
+        replay->jpeg_active = wanted;
+        replay->jpeg_skipping = !wanted;
+    }
+
+    if (replay->jpeg_skipping) {
+        replay->jpeg_skipping = !end;
+        return;
+    }
+
+    if (frame_assembler_append(assembler, data, r->length) != 0) {
+        frame_assembler_reset(assembler);
+        return;
+    }
+    if (end) {
+        snapshot_t * frame = frame_assembler_finish(assembler);
+        if (frame != NULL) {
+            frame->pts = replay_pts(replay, r->pts);
+            frame->flags = r->flags;
+            frame->callback_us = latency_now();
+            frame_bus_post(&p->bus, PIPELINE_IMAGE_QUEUE, FRAME_JPEG, frame);
+        }
+    }
+}
+
+// a whole encoder buffer, copied once into a bus frame like the camera's
+// encoder callback does
+static void replay_encoded(replay_t * replay, capture_record_t * r, const uint8_t * data) {
+    pipeline_t * p = replay->pipeline;
+    uint64_t received = latency_now();
+    snapshot_t * frame = frame_bus_alloc(&p->bus, r->length);
+
+    if (frame == NULL) {
+        return;
+    }
+
+    memcpy(frame->data, data, r->length);
+    frame->length = r->length;
+    frame->pts = replay_pts(replay, r->pts);
+    frame->flags = r->flags;
+    frame->callback_us = received;
+    frame_bus_post(&p->bus, PIPELINE_ENCODER_QUEUE, (frame_type_t)r->type, frame);
+}
+
+static void * replay_thread(void * user) {
+    replay_t * replay = (replay_t*)user;
+    frame_bus_t * bus = &replay->pipeline->bus;
+    capture_record_t r;
+    uint8_t * data = NULL;
+    size_t capacity = 0;
+    int64_t first_pts = -1;
+    int64_t last_pts = 0;
+    uint64_t last_time = 0;
+    uint64_t start = now_us();
+    uint32_t framerate = replay->capture.header.framerate ? replay->capture.header.framerate : 25;
+
+    while (!atomic_load(&replay->completed)) {
+        int status = capture_read(&replay->capture, &r, &data, &capacity);
+        if (status < 0) {
+            break;
+        }
+        if (status == 0) {
+            replay->passes++;
+            if (!replay->loop || capture_rewind(&replay->capture) != 0) {
+                break;
+            }
+
+            // the next pass starts a frame after this one ended
+            replay->pts_offset += last_pts - first_pts + 1000000 / framerate;
+            replay->time_offset_us += last_time + 1000000 / framerate;
+            continue;
+        }
+        if (r.pts >= 0) {
+            if (first_pts < 0) {
+                first_pts = r.pts;
+            }
+            last_pts = r.pts;
+        }
+        last_time = r.time_us;
+
+        if (replay->realtime) {
+            uint64_t due = start + replay->time_offset_us + r.time_us;
+            uint64_t now = now_us();
+            if (now < due) {
+                sleep_until_us(due);
+            } else if (now - due > replay->late_max_us) {
+                replay->late_max_us = now - due;
+            }
+        } else {
+            int queue = r.type == FRAME_JPEG ? PIPELINE_IMAGE_QUEUE : PIPELINE_ENCODER_QUEUE;
+            while (frame_bus_backlog(bus, queue) >= REPLAY_BACKLOG_MAX && !atomic_load(&replay->completed)) {
+                sched_yield();
+            }
+        }
+
+        if (r.type == FRAME_JPEG) {
+            replay_image(replay, &r, data);
+        } else {
+            replay_encoded(replay, &r, data);
+        }
+        replay->records[r.type]++;
+        replay->bytes += r.length;
+    }
+
+    // played out, let the bus catch up so the time covers every frame
+    while (!atomic_load(&replay->completed) && (frame_bus_backlog(bus, PIPELINE_ENCODER_QUEUE) > 0 || 
+        frame_bus_backlog(bus, PIPELINE_IMAGE_QUEUE) > 0)) 
+    {
+        sched_yield();
+    }
+    if (!atomic_load(&replay->completed)) {
+        replay->elapsed_us = now_us() - start;
+    }
+
+    free(data);
+    atomic_store(&replay->finished, 1);
+    return NULL;
+}
+
+int replay_open(replay_t * replay, pipeline_t * pipeline, const char * path, int realtime, int loop) {
+    memset(replay->records, 0, sizeof(replay->records));
+    replay->pipeline = pipeline;
+    replay->realtime = realtime;
+    replay->loop = loop;
+    replay->jpeg_active = 0;
+    replay->jpeg_skipping = 0;
+    replay->pts_offset = 0;
+    replay->time_offset_us = 0;
+    replay->bytes = 0;
+    replay->passes = 0;
+    replay->late_max_us = 0;
+    replay->elapsed_us = 0;
+    atomic_init(&replay->completed, 0);
+    atomic_init(&replay->finished, 0);
+    replay->running = 0;
+
+    if (capture_open(&replay->capture, path) != 0) {
+        return -1;
+    }
+
+    fprintf(stderr, "capture %s: %ux%u at %u fps\n", path, replay->capture.header.width, 
+        replay->capture.header.height, replay->capture.header.framerate);
+    return 0;
+}
+
+int replay_start(replay_t * replay) {
+    int s = pthread_create(&replay->thread, NULL, replay_thread, (void*)replay);
+    if (s != 0) {
+        fprintf(stderr, "could not create replay thread: %d\n", s);
+        return -1;
+    }
+    replay->running = 1;
+    return 0;
+}
+
+int replay_finished(replay_t * replay) {
+    return atomic_load(&replay->finished);
+}
+
+void replay_close(replay_t * replay) {
+    if (replay->running) {
+        atomic_store(&replay->completed, 1);
+        pthread_join(replay->thread, NULL);
+        replay->running = 0;
+    }
+
+    fprintf(stderr, "replayed %llu video, %llu motion and %llu jpeg records, %llu bytes in %u passes\n",
+        (unsigned long long)replay->records[FRAME_VIDEO], (unsigned long long)replay->records[FRAME_MOTION],
+        (unsigned long long)replay->records[FRAME_JPEG], (unsigned long long)replay->bytes, replay->passes);
+    if (replay->elapsed_us > 0) {
+        fprintf(stderr, "played out in %llu ms, %.0f motion fields/s\n", 
+            (unsigned long long)(replay->elapsed_us / 1000), 
+            replay->records[FRAME_MOTION] * 1e6 / replay->elapsed_us);
+    }
+    if (replay->realtime) {
+        fprintf(stderr, "replay fell behind the recording by %llu us at worst\n", 
+            (unsigned long long)replay->late_max_us);
+    }
+
+    capture_close(&replay->capture);
+}
@@ -1,178 +1,864 @@
 #include "server.h"
+#include "latency.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <linux/errqueue.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <signal.h>
+#include <time.h>
 
-#include "interface/mmal/mmal_logging.h"
+// older c libraries do not know about zerocopy yet, the kernel decides 
+// whether it works at setsockopt time
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
 
-static void * client_thread(void * user) {
-    // fprintf(stderr, "client thread starting\n");
-    socket_list_t * s = (socket_list_t*)user;
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t now_ms() {
+    return now_us() / 1000;
+}
 
-    while(!s->completed) {
-        vcos_semaphore_wait(&s->server->write_ready);
+// mark a client for the reaper, remembering when so we can tell how long
+// it took to retire
+static void client_complete(socket_list_t * s) {
+    if (!s->completed) {
+        s->completed = 1;
+        s->completed_at = now_us();
+    }
+}
 
-        buffer_t * buf = &s->server->buffer;
+#define NAL_IDR 5
+#define NAL_SPS 7
+#define NAL_PPS 8
 
-        if (s->server->completed) {
-            s->completed = 1;
-        } else  {
-            // char data[32];
-            // sprintf(data, "fd: %d\n", s->socket);
-            // int w = write(s->socket, data, strlen(data));
-            // if (w < 0 || (size_t)w < strlen(data)) {
-            //     s->completed = 1;
-            // }
+// returns a mask of the nal unit types that start in data, carrying start
+// codes that straddle two writes over in the server
+static uint32_t nal_scan(server_t * server, const uint8_t * data, size_t length) {
+    uint32_t types = 0;
+    const uint8_t * p = data;
+    const uint8_t * end = data + length;
 
-            int w = send(s->socket, buf->data, buf->length, MSG_NOSIGNAL | MSG_MORE);
-            // int w = write(s->socket, buf->data, buf->length);
-            if(w < 0 || (size_t)w < buf->length) {
-                // error, close socket
-                s->completed = 1;
-            } 
+    if (length == 0) {
+        return 0;
+    }
+
+    if (server->nal_pending) {
+        types |= 1u << (data[0] & 0x1f);
+        server->nal_pending = 0;
+        p++;
+    }
+
+    // look for the 01 of every 00 00 01 start code
+    while (p < end && (p = (const uint8_t*)memchr(p, 1, end - p)) != NULL) {
+        size_t at = p - data;
+        uint8_t b1 = at >= 1 ? data[at - 1] : server->nal_last[1];
+        uint8_t b2 = at >= 2 ? data[at - 2] : (at == 1 ? server->nal_last[1] : server->nal_last[0]);
+
+        if (b1 == 0 && b2 == 0) {
+            if (p + 1 < end) {
+                types |= 1u << (p[1] & 0x1f);
+            } else {
+                server->nal_pending = 1;
+            }
         }
+        p++;
+    }
 
-        vcos_semaphore_post(&s->server->write_complete);
+    if (length >= 2) {
+        server->nal_last[0] = data[length - 2];
+        server->nal_last[1] = data[length - 1];
+    } else {
+        server->nal_last[0] = server->nal_last[1];
+        server->nal_last[1] = data[0];
     }
 
-    return NULL;
+    return types;
 }
 
-static void * server_write_thread(void * user) {
-    // server_t * server = (server_t*)user;
+static void gop_clear(server_t * server) {
+    for(int i = 0; i < server->gop_count; i++) {
+        snapshot_release(server->gop[i]);
+    }
+    server->gop_count = 0;
+    server->gop_bytes = 0;
+}
 
-    return NULL;
+static void config_clear(server_t * server) {
+    for(int i = 0; i < server->config_count; i++) {
+        snapshot_release(server->config[i]);
+    }
+    server->config_count = 0;
 }
 
-int server_write(server_t * server, uint8_t * data, size_t length) {
-    vcos_mutex_lock(&server->mutex);
-    server->buffer.data = data;
-    server->buffer.length = length;
+// file a chunk in the gop cache.  sps starts a new parameter set, an idr
+// starts a new gop and anything else continues the current one.  called 
+// with server->mutex held
+static void gop_update(server_t * server, snapshot_t * c, uint32_t types) {
+    if (types & ((1u << NAL_SPS) | (1u << NAL_PPS))) {
+        if (types & (1u << NAL_SPS)) {
+            config_clear(server);
+        }
+        if (server->config_count < SERVER_CONFIG_CHUNKS) {
+            snapshot_retain(c);
+            server->config[server->config_count++] = c;
+        }
+        if (!(types & (1u << NAL_IDR))) {
+            server->gop_last_types = types;
+            return;
+        }
+    }
 
-    // fprintf(stderr, "%s:%d: posting %d semaphores... ", __FILE__, __LINE__, server->socket_count);
-    // post socket_count times
-    for(int i = 0; i < server->socket_count; i++) 
-        vcos_semaphore_post(&server->write_ready);
+    // an idr picture can span several chunks, only the first one of 
+    // them starts the gop
+    uint32_t last = server->gop_last_types;
+    server->gop_last_types = types;
 
-    // fprintf(stderr, " posted. waiting on %d semaphores...", server->socket_count);
+    if ((types & (1u << NAL_IDR)) && 
+        (!(last & (1u << NAL_IDR)) || (last & ((1u << NAL_SPS) | (1u << NAL_PPS))))) 
+    {
+        gop_clear(server);
+    } else if (server->gop_count == 0) {
+        // no idr yet, or the last gop overflowed
+        return;
+    }
 
-    // wait for socket_count times on the complete
-    for(int i = 0; i < server->socket_count; i++)
-        vcos_semaphore_wait(&server->write_complete);
+    if (server->gop_count == SERVER_GOP_CHUNKS || server->gop_bytes + c->length > SERVER_GOP_BYTES) {
+        fprintf(stderr, "gop cache full after %d chunks, waiting for the next idr\n", server->gop_count);
+        gop_clear(server);
+        return;
+    }
 
-    // fprintf(stderr, " complete.\n");
+    snapshot_retain(c);
+    server->gop[server->gop_count++] = c;
+    server->gop_bytes += c->length;
+}
 
-    // clean up any completed socket
-    // doing this here avoids any race conditions if another write 
-    // is called because this is all under a lock
-    // and we know the sockets are completed due to the wait
-    
-    for(socket_list_t ** l = &server->sockets; *l;) { 
-        socket_list_t * p = *l;
+// take a reference to everything a new client needs before the live
+// stream: the parameter sets and the current gop.  called with 
+// server->mutex held
+static void client_prime(server_t * server, socket_list_t * s) {
+    s->prime = NULL;
+    s->prime_count = 0;
+    s->prime_pos = 0;
 
-        if (p->completed) {
-            fprintf(stderr, "socket completed, removing from list\n");
-            if(close(p->socket))
-                perror("close status");
+    if (!server->gop_cache || server->gop_count == 0 || server->config_count == 0 ||
+        (server->encoder_control != NULL && server->gop_bytes > SERVER_PRIME_BYTES)) 
+    {
+        // the client picks the stream up at the next idr
+        s->resync = server->gop_cache;
+        return;
+    }
 
-            fprintf(stderr, "joining thread...\n");
-            pthread_join(p->thread, NULL);
-            fprintf(stderr, "thread joined.\n");
+    int count = server->config_count + server->gop_count;
+    s->prime = (snapshot_t**)malloc(count * sizeof(snapshot_t*));
+    if (s->prime == NULL) {
+        s->resync = 1;
+        return;
+    }
 
-            // cut this one out of the list, which also advances l
-            *l = p->next;
-            // join the running thread
-            free(p);
-            server->socket_count--;
-        } else {
-            // advance the iterator
-            l = &p->next;
+    for(int i = 0; i < server->config_count; i++) {
+        snapshot_retain(server->config[i]);
+        s->prime[s->prime_count++] = server->config[i];
+    }
+    for(int i = 0; i < server->gop_count; i++) {
+        snapshot_retain(server->gop[i]);
+        s->prime[s->prime_count++] = server->gop[i];
+    }
+}
+
+// queue a chunk on a client without blocking.  returns 0 if the chunk was 
+// queued and -1 if it was dropped because the client ring is full.
+// only called from server_write with server->mutex held
+static int client_enqueue(socket_list_t * s, snapshot_t * c) {
+    unsigned int tail = atomic_load_explicit(&s->ring_tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&s->ring_head, memory_order_acquire);
+
+    if (tail - head >= SERVER_RING_SIZE) {
+        if (!s->overflowing) {
+            s->overflowing = 1;
+            atomic_fetch_add(&s->overflows, 1);
         }
+        atomic_fetch_add(&s->dropped, 1);
+        return -1;
     }
 
-    server->buffer.data = NULL;
-    server->buffer.length = 0;
-    vcos_mutex_unlock(&server->mutex);
+    s->overflowing = 0;
+    snapshot_retain(c);
+    s->ring[tail % SERVER_RING_SIZE] = c;
+    atomic_store_explicit(&s->ring_tail, tail + 1, memory_order_release);
+
     return 0;
 }
 
+// release anything still waiting in the ring
+static void client_drain(socket_list_t * s) {
+    for(; s->prime_pos < s->prime_count; s->prime_pos++) {
+        snapshot_release(s->prime[s->prime_pos]);
+    }
+    free(s->prime);
+    s->prime = NULL;
+    s->prime_count = 0;
+    s->prime_pos = 0;
+
+    // the socket is closed by now so nothing will complete, the kernel 
+    // keeps its own hold on the pages it still has queued
+    for(; s->zc_head != s->zc_tail; s->zc_head++) {
+        snapshot_release(s->zc_pending[s->zc_head % SERVER_ZEROCOPY_PENDING].chunk);
+    }
 
-static void * listen_thread(void * user) {
-    fprintf(stderr, "listen thread start.\n");
-    server_t * server = (server_t*)user;
+    unsigned int tail = atomic_load(&s->ring_tail);
 
+    for(unsigned int head = atomic_load(&s->ring_head); head != tail; head++) {
+        snapshot_release(s->ring[head % SERVER_RING_SIZE]);
+    }
+    atomic_store(&s->ring_head, tail);
+}
+
+// close the socket and free the client, it must already be out of the list
+static void client_destroy(socket_list_t * s) {
+    if(close(s->socket))
+        perror("close status");
+
+    fprintf(stderr, "client removed: %u chunks dropped in %u overflows\n", 
+        atomic_load(&s->dropped), atomic_load(&s->overflows));
+    if (s->zerocopy) {
+        fprintf(stderr, "client zerocopy: %u sends, %u copied by the kernel\n", 
+            s->zc_sends, s->zc_copied);
+    }
+
+    if (s->variant > 0) {
+        atomic_fetch_sub(&s->server->variant_clients[s->variant], 1);
+    }
+
+    client_drain(s);
+    free(s);
+}
+
+// send as much of the primed chunks and the ring as the socket will take.
+// sets completed on error and blocked when the kernel buffer is full
+static void client_flush(socket_list_t * s) {
+    struct iovec iov[SERVER_MAX_IOV];
+
+    while(!s->completed && !s->blocked) {
+        unsigned int head = atomic_load_explicit(&s->ring_head, memory_order_relaxed);
+        unsigned int tail = atomic_load_explicit(&s->ring_tail, memory_order_acquire);
+
+        int n = 0;
+        for(int i = s->prime_pos; i < s->prime_count && n < SERVER_MAX_IOV; i++, n++) {
+            snapshot_t * c = s->prime[i];
+            iov[n].iov_base = c->data;
+            iov[n].iov_len = c->length;
+        }
+        int primed = n;
+        for(unsigned int i = head; i != tail && n < SERVER_MAX_IOV; i++, n++) {
+            snapshot_t * c = s->ring[i % SERVER_RING_SIZE];
+            iov[n].iov_base = c->data;
+            iov[n].iov_len = c->length;
+        }
+
+        if (n == 0) {
+            if (s->prime != NULL) {
+                free(s->prime);
+                s->prime = NULL;
+                s->prime_count = s->prime_pos = 0;
+            }
+            return;
+        }
+
+        iov[0].iov_base = (uint8_t*)iov[0].iov_base + s->offset;
+        iov[0].iov_len -= s->offset;
+
+        int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+        if (s->zc_active && s->zc_tail - s->zc_head + n <= SERVER_ZEROCOPY_PENDING) {
+            size_t total = 0;
+            for(int i = 0; i < n; i++) {
+                total += iov[i].iov_len;
+            }
+            if (total >= SERVER_ZEROCOPY_MIN) {
+                flags |= MSG_ZEROCOPY;
+            }
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+
+        ssize_t w = sendmsg(s->socket, &msg, flags);
+        if (w < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+            // out of socket option memory for pending completions, copy
+            // this one and go back to zerocopy once they have drained
+            flags &= ~MSG_ZEROCOPY;
+            w = sendmsg(s->socket, &msg, flags);
+        }
+        if (w < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                s->blocked = 1;
+            } else if (errno != EINTR) {
+                // error, close socket
+                client_complete(s);
+            }
+            return;
+        }
+
+        if (flags & MSG_ZEROCOPY) {
+            // the kernel reads these pages until the send completes, pin
+            // every chunk it took bytes from
+            size_t covered = 0;
+            for(int i = 0; i < n && covered < (size_t)w; i++) {
+                snapshot_t * c = i < primed ? s->prime[s->prime_pos + i] :
+                    s->ring[(head + i - primed) % SERVER_RING_SIZE];
+
+                snapshot_retain(c);
+                s->zc_pending[s->zc_tail % SERVER_ZEROCOPY_PENDING].seq = s->zc_next;
+                s->zc_pending[s->zc_tail % SERVER_ZEROCOPY_PENDING].chunk = c;
+                s->zc_tail++;
+                covered += iov[i].iov_len;
+            }
+            s->zc_next++;
+            s->zc_sends++;
+        }
+
+        // retire whatever was fully written.  primed chunks are old news,
+        // only live frames count towards the latencies
+        size_t written = (size_t)w;
+        uint64_t now = 0;
+        int i = 0;
+        for(; i < n && written >= iov[i].iov_len; i++) {
+            written -= iov[i].iov_len;
+            if (i < primed) {
+                snapshot_release(s->prime[s->prime_pos++]);
+            } else {
+                snapshot_t * c = s->ring[head % SERVER_RING_SIZE];
+                if (s->server->latency != NULL && c->published_us != 0) {
+                    if (now == 0) {
+                        now = now_us();
+                    }
+                    latency_frame_sent(s->server->latency, s->server->latency_type, c, now);
+                }
+                snapshot_release(c);
+                head++;
+            }
+            s->offset = 0;
+        }
+        s->offset += written;
+        atomic_store_explicit(&s->ring_head, head, memory_order_release);
+    }
+}
+
+// release the chunks of every zerocopy send the kernel has finished with.
+// returns -1 if the error queue held a real socket error
+static int client_completions(socket_list_t * s) {
+    for(;;) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(s->socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        for(struct cmsghdr * cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) 
+            {
+                continue;
+            }
+            struct sock_extended_err * ee = (struct sock_extended_err*)CMSG_DATA(cm);
+
+            if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                if (ee->ee_errno != 0) {
+                    return -1;
+                }
+                continue;
+            }
+
+            // completions cover the inclusive range ee_info..ee_data
+            uint32_t hi = ee->ee_data;
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                s->zc_copied += hi - ee->ee_info + 1;
+            }
+
+            while (s->zc_head != s->zc_tail && 
+                (int32_t)(s->zc_pending[s->zc_head % SERVER_ZEROCOPY_PENDING].seq - hi) <= 0) 
+            {
+                snapshot_release(s->zc_pending[s->zc_head % SERVER_ZEROCOPY_PENDING].chunk);
+                s->zc_head++;
+            }
+        }
+    }
+}
+
+static int write_frame(server_t * server, int variant, snapshot_t * c, int key) {
+    uint32_t types = 0;
+    uint64_t now = 0;
+
+    // the loop only holds the mutex to link and unlink clients, this is 
+    // how long that ever kept the frame path waiting
+    uint64_t wait_start = now_us();
+    pthread_mutex_lock(&server->mutex);
+    uint64_t wait = now_us() - wait_start;
+    if (wait > server->write_wait_max_us) {
+        server->write_wait_max_us = wait;
+    }
+
+    if (server->gop_cache && variant == 0) {
+        types = nal_scan(server, c->data, c->length);
+        gop_update(server, c, types);
+    } else if (server->sockets == NULL) {
+        pthread_mutex_unlock(&server->mutex);
+        return 0;
+    }
+
+    if (server->variant_count > 1) {
+        now = now_ms();
+    }
+
+    // every client ring shares the same frame
+    for(socket_list_t * p = server->sockets; p; p = p->next) {
+        if (p->variant < 0) {
+            if (now - p->joined_at < SERVER_NEGOTIATE_MS) {
+                continue;
+            }
+            // never asked, it gets the plain stream
+            p->variant = 0;
+        }
+        if (p->variant != variant) {
+            continue;
+        }
+
+        if (p->resync) {
+            // after a drop nothing decodes until the next idr, which 
+            // comes with its parameter sets, or the next keyframe of a 
+            // variant
+            int start = variant == 0 ? (types & ((1u << NAL_SPS) | (1u << NAL_IDR))) != 0 : key;
+            if (!start) {
+                atomic_fetch_add(&p->dropped, 1);
+                continue;
+            }
+            p->resync = 0;
+        }
+        if (client_enqueue(p, c) != 0 && (server->gop_cache || variant > 0)) {
+            p->resync = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&server->mutex);
+
+    // wake the loop, but only once per batch of writes it has not seen yet
+    if (!atomic_exchange(&server->wake_pending, 1)) {
+        uint64_t one = 1;
+        if (write(server->wakefd, &one, sizeof(one)) < 0) {
+            perror("could not wake server loop");
+        }
+    }
+
+    return 0;
+}
+
+int server_write_frame(server_t * server, snapshot_t * c) {
+    return write_frame(server, 0, c, 0);
+}
+
+int server_write_variant(server_t * server, int variant, snapshot_t * c, int key) {
+    return write_frame(server, variant, c, key);
+}
+
+int server_write(server_t * server, uint8_t * data, size_t length) {
+    snapshot_t * c = snapshot_create(data, length);
+    if (c == NULL) {
+        fprintf(stderr, "could not allocate %zu byte chunk\n", length);
+        return -1;
+    }
+
+    int ret = server_write_frame(server, c);
+    snapshot_release(c);
+
+    return ret;
+}
+
+// accept every pending connection and add it to the loop
+static void server_accept(server_t * server) {
     struct sockaddr_in cli_addr;
-    unsigned int clilen = sizeof(cli_addr);
+    socklen_t clilen;
 
-    while(listen(server->socketfd, server->wait_queue) >= 0) {
-        int new_socket = accept(server->socketfd, (struct sockaddr*)&cli_addr, &clilen);
+    for(;;) {
+        clilen = sizeof(cli_addr);
+        int new_socket = accept4(server->socketfd, (struct sockaddr*)&cli_addr, &clilen,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
 
         if (new_socket < 0) {
-            // TODO: we can probably continue from here, but just trying this out
-            vcos_log_error("invalid socket accept");
-            break;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                perror("invalid socket accept");
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
         }
 
-        // fprintf(stderr, "socket accepted, starting client thread\n");
-
-        vcos_mutex_lock(&server->mutex);
         socket_list_t * n = (socket_list_t*)malloc(sizeof(socket_list_t));
+        if (n == NULL) {
+            fprintf(stderr, "could not allocate client\n");
+            close(new_socket);
+            continue;
+        }
+
         n->socket = new_socket;
-        n->next = server->sockets;
         n->server = server;
         n->completed = 0;
+        n->completed_at = 0;
+        n->offset = 0;
+        n->blocked = 0;
+        n->overflowing = 0;
+        n->resync = 0;
+        n->prime = NULL;
+        n->prime_count = 0;
+        n->prime_pos = 0;
+        n->zerocopy = 0;
+        n->zc_active = 0;
+        n->zc_next = 0;
+        n->zc_head = 0;
+        n->zc_tail = 0;
+        n->zc_sends = 0;
+        n->zc_copied = 0;
+        atomic_init(&n->ring_head, 0);
+        n->variant = server->variant_count > 1 ? -1 : 0;
+        n->joined_at = now_ms();
+        n->request_length = 0;
+
+        if (server->zerocopy) {
+            int one = 1;
+            if (setsockopt(new_socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+                n->zerocopy = n->zc_active = 1;
+            } else {
+                perror("SO_ZEROCOPY not available, copying");
+            }
+        }
+        atomic_init(&n->ring_tail, 0);
+        atomic_init(&n->dropped, 0);
+        atomic_init(&n->overflows, 0);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = n;
+
+        if (epoll_ctl(server->epollfd, EPOLL_CTL_ADD, new_socket, &ev) != 0) {
+            perror("could not add client to epoll");
+            close(new_socket);
+            free(n);
+            continue;
+        }
+
+        // prime and link in one go so the ring picks up exactly where 
+        // the cached gop ends
+        pthread_mutex_lock(&server->mutex);
+        client_prime(server, n);
+        n->next = server->sockets;
         server->sockets = n;
         server->socket_count++;
-        vcos_mutex_unlock(&server->mutex);
+        pthread_mutex_unlock(&server->mutex);
 
-        // fprintf(stderr, "starting client thread.\n");
+        // the flush frees prime once it has all gone out
+        int primed = n->prime != NULL;
 
+        // the socket is writable already, so edge triggered EPOLLOUT may 
+        // have fired before there was anything to send
+        client_flush(n);
 
-        if(pthread_create(&n->thread, NULL, client_thread, n) != 0) {
-            // what to do?  crash horribly?
-            vcos_log_error("could not spin up client thread, exiting");
-            break;
+        if (!primed && server->encoder_control != NULL) {
+            server->keyframe_pending = 1;
         }
     }
+}
 
-    perror("\nListener thread");
+// drop every chunk queued for the client except one it is halfway through.
+// called by the loop with server->mutex held, which keeps the writer out 
+// of the ring
+static void client_discard(socket_list_t * s) {
+    unsigned int head = atomic_load(&s->ring_head);
+    unsigned int tail = atomic_load(&s->ring_tail);
+    unsigned int keep = head != tail && s->offset > 0 ? head + 1 : head;
 
-    // now clean up the sockets
+    for(unsigned int i = keep; i != tail; i++) {
+        snapshot_release(s->ring[i % SERVER_RING_SIZE]);
+    }
+    atomic_store(&s->ring_tail, keep);
+}
 
-    fprintf(stderr, "locking mutex... ");
-    vcos_mutex_lock(&server->mutex);
-    fprintf(stderr, "mutex locked\n");
+// handle an "enc=<name>" line
+static void client_choose(socket_list_t * s, const char * request) {
+    server_t * server = s->server;
+    int variant = -1;
 
-    server->completed = 1;
+    if (strncmp(request, "enc=", 4) != 0) {
+        return;
+    }
+    for(int i = 0; i < server->variant_count; i++) {
+        if (strcmp(request + 4, server->variant_names[i]) == 0) {
+            variant = i;
+        }
+    }
+    if (variant < 0) {
+        fprintf(stderr, "client asked for unknown encoding %s\n", request + 4);
+        variant = 0;
+    }
+
+    pthread_mutex_lock(&server->mutex);
+    if (s->variant != variant) {
+        if (s->variant > 0) {
+            atomic_fetch_sub(&server->variant_clients[s->variant], 1);
+        }
+        if (variant > 0) {
+            atomic_fetch_add(&server->variant_clients[variant], 1);
+            atomic_store(&server->variant_joined[variant], 1);
+            s->resync = 1;
+        }
+        // a late choice, what was queued belongs to the old variant
+        if (s->variant >= 0) {
+            client_discard(s);
+        }
+        s->variant = variant;
+    }
+    pthread_mutex_unlock(&server->mutex);
+}
 
-    // tell everybody that we are ready to move on
-    // post socket_count times
-    for(int i = 0; i < server->socket_count; i++) 
-        vcos_semaphore_post(&server->write_ready);
+// collect the first line the client sends, anything after it is discarded
+static void client_request(socket_list_t * s, const char * data, size_t length) {
+    for(size_t i = 0; i < length && s->request_length >= 0; i++) {
+        if (data[i] == '\n') {
+            if (s->request_length > 0 && s->request[s->request_length - 1] == '\r') {
+                s->request_length--;
+            }
+            s->request[s->request_length] = '\0';
+            s->request_length = -1;
+            client_choose(s, s->request);
+        } else if (s->request_length == SERVER_REQUEST_MAX - 1) {
+            s->request_length = -1;
+        } else {
+            s->request[s->request_length++] = data[i];
+        }
+    }
+}
 
-    // wait for socket_count times on the complete
-    for(int i = 0; i < server->socket_count; i++)
-        vcos_semaphore_wait(&server->write_complete);
+static void client_read(socket_list_t * s) {
+    char data[256];
+
+    for(;;) {
+        ssize_t r = recv(s->socket, data, sizeof(data), MSG_DONTWAIT);
+        if (r > 0) {
+            client_request(s, data, r);
+            continue;
+        }
+        if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            client_complete(s);
+        }
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        return;
+    }
+}
+
+// unlink and free every completed client
+static void server_reap(server_t * server) {
+    socket_list_t * dead = NULL;
+
+    pthread_mutex_lock(&server->mutex);
+    for(socket_list_t ** l = &server->sockets; *l;) { 
+        socket_list_t * p = *l;
+
+        if (p->completed) {
+            // cut this one out of the list, which also advances l
+            *l = p->next;
+            p->next = dead;
+            dead = p;
+            server->socket_count--;
+        } else {
+            // advance the iterator
+            l = &p->next;
+        }
+    }
+    pthread_mutex_unlock(&server->mutex);
+
+    // once unlinked server_write can no longer reach them, so close 
+    // outside the lock
+    while(dead) {
+        socket_list_t * p = dead;
+        dead = p->next;
+
+        fprintf(stderr, "socket completed, removing from list\n");
+        epoll_ctl(server->epollfd, EPOLL_CTL_DEL, p->socket, NULL);
+        uint64_t completed_at = p->completed_at;
+        client_destroy(p);
+
+        uint64_t latency = now_us() - completed_at;
+        server->reaped++;
+        server->reap_total_us += latency;
+        if (latency > server->reap_max_us) {
+            server->reap_max_us = latency;
+        }
+    }
+}
+
+// send a pending idr request unless the last one was too recent.  returns
+// how long epoll_wait may sleep before it is due
+static int server_keyframe(server_t * server) {
+    if (!server->keyframe_pending) {
+        return -1;
+    }
+
+    uint64_t now = now_ms();
+    uint64_t due = server->keyframe_last + server->keyframe_interval_ms;
+    if (server->keyframe_last != 0 && now < due) {
+        return (int)(due - now);
+    }
+
+    server->keyframe_pending = 0;
+    server->keyframe_last = now;
+    server->keyframe_requests++;
+    if (server->encoder_control->request_keyframe(server->encoder_control) != 0) {
+        fprintf(stderr, "idr request failed\n");
+    }
+
+    return -1;
+}
 
-    // cleanup all the sockets
-    for(socket_list_t * l = server->sockets; l;) {
-        close(l->socket);
-        pthread_join(l->thread, NULL);
-        server->socket_count--;
+static void * loop_thread(void * user) {
+    fprintf(stderr, "server loop start.\n");
+    server_t * server = (server_t*)user;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+
+    int timeout = -1;
+
+    while(!server->completed) {
+        int n = epoll_wait(server->epollfd, events, SERVER_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("server epoll_wait");
+            break;
+        }
+
+        int flush_all = 0;
+        int reap = 0;
+
+        for(int i = 0; i < n; i++) {
+            void * ptr = events[i].data.ptr;
+
+            if (ptr == &server->socketfd) {
+                server_accept(server);
+            } else if (ptr == &server->wakefd) {
+                uint64_t count;
+                atomic_store(&server->wake_pending, 0);
+                if (read(server->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    perror("could not read server wakeup");
+                }
+                flush_all = 1;
+            } else {
+                socket_list_t * s = (socket_list_t*)ptr;
+
+                if (events[i].events & EPOLLERR && s->zerocopy) {
+                    // usually just zerocopy completions on the error queue
+                    int err = 0;
+                    socklen_t len = sizeof(err);
+                    if (client_completions(s) != 0 ||
+                        getsockopt(s->socket, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) 
+                    {
+                        client_complete(s);
+                    }
+                    if (s->zc_active && s->zc_copied >= SERVER_ZEROCOPY_COPIED_LIMIT) {
+                        fprintf(stderr, "kernel copies zerocopy sends for this client, copying instead\n");
+                        s->zc_active = 0;
+                    }
+                } else if (events[i].events & EPOLLERR) {
+                    client_complete(s);
+                }
+                if (events[i].events & (EPOLLHUP | EPOLLRDHUP)) {
+                    client_complete(s);
+                } 
+                if (events[i].events & EPOLLIN) {
+                    client_read(s);
+                } 
+                if (events[i].events & EPOLLOUT) {
+                    s->blocked = 0;
+                    client_flush(s);
+                }
+                reap |= s->completed;
+            }
+        }
+
+        if (flush_all) {
+            // new chunks were queued, push them to every client that can take them.
+            // only this thread ever unlinks clients so the list is stable here
+            for(socket_list_t * s = server->sockets; s; s = s->next) {
+                client_flush(s);
+                reap |= s->completed;
+            }
+        }
+
+        if (reap) {
+            server_reap(server);
+        }
+
+        timeout = server_keyframe(server);
+    }
+
+    // now clean up the sockets
+
+    pthread_mutex_lock(&server->mutex);
+    socket_list_t * l = server->sockets;
+    server->sockets = NULL;
+    server->socket_count = 0;
+    pthread_mutex_unlock(&server->mutex);
+
+    while(l) {
         socket_list_t * t = l;
         l = l->next;
-        free(t);
+        client_destroy(t);
     }
-    server->sockets = NULL;
-    vcos_mutex_unlock(&server->mutex);
 
-    // fprintf(stderr, "listen thread end.\n");
+    if (server->encoder_control != NULL) {
+        fprintf(stderr, "%u idr requests\n", server->keyframe_requests);
+    }
+    fprintf(stderr, "%u clients reaped, %llu us average and %llu us worst from disconnect to freed\n",
+        server->reaped, 
+        (unsigned long long)(server->reaped ? server->reap_total_us / server->reaped : 0),
+        (unsigned long long)server->reap_max_us);
+    fprintf(stderr, "longest wait for the server lock on the write path: %llu us\n",
+        (unsigned long long)server->write_wait_max_us);
+    fprintf(stderr, "server loop end.\n");
     return NULL;
 }
 
@@ -182,44 +868,88 @@ int server_close(server_t * server) {
         return 0;
     }
 
-    fprintf(stderr, "closing socket: %d...", server->socketfd);
-    // closing the main socket should kill the main thread
-    if(shutdown(server->socketfd, SHUT_RDWR) != 0) {
-        perror("close error");
-        exit(-1);
+    // tell the loop to exit
+    server->completed = 1;
+    uint64_t one = 1;
+    if (write(server->wakefd, &one, sizeof(one)) < 0) {
+        perror("could not wake server loop");
     }
-    close(server->socketfd);
 
-    fprintf(stderr, "joining listener thread...");
-    pthread_join(server->listen_thread, NULL);
+    fprintf(stderr, "joining server loop...");
+    pthread_join(server->loop_thread, NULL);
+
+    close(server->socketfd);
+    close(server->wakefd);
+    close(server->epollfd);
 
-    vcos_mutex_delete(&server->mutex);
-    vcos_semaphore_delete(&server->write_ready);
-    vcos_semaphore_delete(&server->write_complete);
+    gop_clear(server);
+    config_clear(server);
+    pthread_mutex_destroy(&server->mutex);
 
     return 0;
 }
 
+int server_add_variant(server_t * server, const char * name) {
+    if (server->variant_count == SERVER_MAX_VARIANTS || strlen(name) >= SERVER_VARIANT_NAME_MAX) {
+        return -1;
+    }
+
+    int variant = server->variant_count++;
+    strcpy(server->variant_names[variant], name);
+    return variant;
+}
+
+int server_variant_clients(server_t * server, int variant) {
+    return atomic_load(&server->variant_clients[variant]);
+}
+
+int server_variant_joined(server_t * server, int variant) {
+    return atomic_exchange(&server->variant_joined[variant], 0);
+}
+
+void server_enable_gop_cache(server_t * server) {
+    server->gop_cache = 1;
+}
+
+void server_enable_zerocopy(server_t * server) {
+    server->zerocopy = 1;
+}
+
+void server_set_encoder_control(server_t * server, encoder_control_t * control, unsigned int interval_ms) {
+    server->encoder_control = control;
+    server->keyframe_interval_ms = interval_ms;
+}
+
+void server_set_latency(server_t * server, latency_t * latency, int type) {
+    server->latency = latency;
+    server->latency_type = type;
+}
+
 int server_create(server_t * server, int portno) {
     struct sockaddr_in serv_addr; 
+    struct epoll_event ev;
     int opt = 1; 
     int socketfd = -1;
+    int epollfd = -1;
+    int wakefd = -1;
+    int mutex_created = 0;
 
-    if (vcos_mutex_create(&server->mutex, "simplecam_server") != VCOS_SUCCESS) {
-        vcos_log_error("could not create server mutex");
+    if (pthread_mutex_init(&server->mutex, NULL) != 0) {
+        fprintf(stderr, "could not create server mutex\n");
         goto error;
     }
+    mutex_created = 1;
 
-    server->wait_queue = 1;
+    server->wait_queue = 16;
 
-    socketfd = socket(AF_INET, SOCK_STREAM, 0);
+    socketfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (socketfd < 0) {
-        vcos_log_error("error opening socket");
+        fprintf(stderr, "error opening socket\n");
         goto error;
     }
     if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, 
                                                   &opt, sizeof(opt)) != 0) { 
-        vcos_log_error("could not set socket options");
+        fprintf(stderr, "could not set socket options\n");
         goto error;
     } 
 
@@ -229,39 +959,95 @@ int server_create(server_t * server, int portno) {
     serv_addr.sin_port = htons(portno);
 
     if (bind(socketfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        vcos_log_error("error binding socket to port %d", portno);
+        fprintf(stderr, "error binding socket to port %d\n", portno);
         perror("could not bind socket");
         goto error;
     }
 
+    if (listen(socketfd, server->wait_queue) != 0) {
+        perror("could not listen on socket");
+        goto error;
+    }
+
+    if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("could not create epoll instance");
+        goto error;
+    }
+
+    if ((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("could not create server eventfd");
+        goto error;
+    }
+
+    server->socketfd = socketfd;
+    server->epollfd = epollfd;
+    server->wakefd = wakefd;
     server->socket_count = 0;
     server->completed = 0;
     server->sockets = NULL;
-    server->buffer.data = NULL;
-    server->buffer.length = 0;
+    atomic_init(&server->wake_pending, 0);
+    server->gop_cache = 0;
+    server->config_count = 0;
+    server->gop_count = 0;
+    server->gop_bytes = 0;
+    server->gop_last_types = 0;
+    server->nal_last[0] = server->nal_last[1] = 0xff;
+    server->nal_pending = 0;
+    server->encoder_control = NULL;
+    server->keyframe_interval_ms = SERVER_KEYFRAME_INTERVAL_MS;
+    server->keyframe_pending = 0;
+    server->keyframe_last = 0;
+    server->keyframe_requests = 0;
+    server->zerocopy = 0;
+    server->reaped = 0;
+    server->reap_total_us = 0;
+    server->reap_max_us = 0;
+    server->write_wait_max_us = 0;
+    strcpy(server->variant_names[0], "raw");
+    server->variant_count = 1;
+    server->latency = NULL;
+    server->latency_type = 0;
+    for(int i = 0; i < SERVER_MAX_VARIANTS; i++) {
+        atomic_init(&server->variant_clients[i], 0);
+        atomic_init(&server->variant_joined[i], 0);
+    }
 
-    if(vcos_semaphore_create(&server->write_ready, "simplecam_writeready", 0) != VCOS_SUCCESS) {
-        vcos_log_error("could not create writeready semaphore");
+    // the listening socket and the eventfd are told apart from clients by 
+    // pointing at their fields in the server
+    ev.events = EPOLLIN;
+    ev.data.ptr = &server->socketfd;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, socketfd, &ev) != 0) {
+        perror("could not add listening socket to epoll");
         goto error;
     }
-    if(vcos_semaphore_create(&server->write_complete, "simplecam_writecomplete", 0) != VCOS_SUCCESS) {
-        vcos_log_error("could not create writeready semaphore");
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &server->wakefd;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &ev) != 0) {
+        perror("could not add eventfd to epoll");
         goto error;
     }
 
-    int s = pthread_create(&server->listen_thread, NULL, listen_thread, (void*)server);
+    int s = pthread_create(&server->loop_thread, NULL, loop_thread, (void*)server);
     if (s != 0) {
-        vcos_log_error("could not create listener thread: %d", s);
+        fprintf(stderr, "could not create server loop thread: %d\n", s);
         goto error;
     }
 
-
-    server->socketfd = socketfd;
-
     return 0;
 
 error:
-    close(socketfd);
+    if (socketfd >= 0) 
+        close(socketfd);
+    if (epollfd >= 0)
+        close(epollfd);
+    if (wakefd >= 0)
+        close(wakefd);
+    if (mutex_created)
+        pthread_mutex_destroy(&server->mutex);
+
+    // make server_close a no-op
+    server->completed = 1;
 
     return -1;
-}
\ No newline at end of file
+}
@@ -0,0 +1,203 @@
+#include "snapshot.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+snapshot_t * snapshot_alloc(size_t capacity) {
+    snapshot_t * s = (snapshot_t*)malloc(sizeof(snapshot_t) + capacity);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    atomic_init(&s->refs, 1);
+    s->seq = 0;
+    s->length = 0;
+    s->data = (uint8_t*)(s + 1);
+    s->pts = 0;
+    s->flags = 0;
+    s->time_us = 0;
+    s->sensor_us = 0;
+    s->callback_us = 0;
+    s->published_us = 0;
+    s->capacity = capacity;
+    s->recycle = NULL;
+    s->user = NULL;
+    s->next = NULL;
+
+    return s;
+}
+
+snapshot_t * snapshot_create(const uint8_t * data, size_t length) {
+    snapshot_t * s = snapshot_alloc(length);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    if (data != NULL) {
+        memcpy(s->data, data, length);
+    }
+    s->length = length;
+
+    return s;
+}
+
+snapshot_t * snapshot_wrap(uint8_t * data, size_t length, snapshot_recycle_fn recycle, void * user) {
+    snapshot_t * s = snapshot_alloc(0);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    s->data = data;
+    s->length = length;
+    s->capacity = length;
+    s->recycle = recycle;
+    s->user = user;
+
+    return s;
+}
+
+snapshot_t * snapshot_retain(snapshot_t * s) {
+    atomic_fetch_add(&s->refs, 1);
+    return s;
+}
+
+void snapshot_release(snapshot_t * s) {
+    if (s != NULL && atomic_fetch_sub(&s->refs, 1) == 1) {
+        if (s->recycle != NULL) {
+            s->recycle(s);
+        } else {
+            free(s);
+        }
+    }
+}
+
+int snapshot_slot_init(snapshot_slot_t * slot) {
+    atomic_init(&slot->current, NULL);
+    atomic_init(&slot->epoch, 0);
+    atomic_init(&slot->active[0], 0);
+    atomic_init(&slot->active[1], 0);
+    atomic_init(&slot->sequence, 0);
+
+    return pthread_mutex_init(&slot->publish, NULL);
+}
+
+void snapshot_slot_destroy(snapshot_slot_t * slot) {
+    snapshot_release(atomic_exchange(&slot->current, NULL));
+    pthread_mutex_destroy(&slot->publish);
+}
+
+void snapshot_slot_publish(snapshot_slot_t * slot, snapshot_t * s) {
+    pthread_mutex_lock(&slot->publish);
+
+    if (s != NULL) {
+        s->seq = atomic_load(&slot->sequence) + 1;
+        atomic_store(&slot->sequence, s->seq);
+    }
+
+    snapshot_t * old = atomic_exchange(&slot->current, s);
+
+    // move new readers to the other counter, then wait for the ones that 
+    // may have loaded old to finish taking their reference.  that window
+    // is a handful of instructions so this hardly ever spins
+    unsigned int e = atomic_load(&slot->epoch);
+    atomic_store(&slot->epoch, e + 1);
+
+    while (atomic_load(&slot->active[e & 1]) != 0) {
+        sched_yield();
+    }
+
+    pthread_mutex_unlock(&slot->publish);
+
+    snapshot_release(old);
+}
+
+snapshot_t * snapshot_slot_pin(snapshot_slot_t * slot) {
+    for(;;) {
+        unsigned int e = atomic_load(&slot->epoch);
+        atomic_fetch_add(&slot->active[e & 1], 1);
+
+        if (atomic_load(&slot->epoch) == e) {
+            snapshot_t * s = atomic_load(&slot->current);
+            if (s != NULL) {
+                atomic_fetch_add(&s->refs, 1);
+            }
+            atomic_fetch_sub(&slot->active[e & 1], 1);
+            return s;
+        }
+
+        // a publisher flipped the epoch under us, register again
+        atomic_fetch_sub(&slot->active[e & 1], 1);
+    }
+}
+
+static void pool_recycle(snapshot_t * s) {
+    snapshot_pool_t * pool = (snapshot_pool_t*)s->user;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->count < pool->max) {
+        s->next = pool->free;
+        pool->free = s;
+        pool->count++;
+        s = NULL;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    // the pool is full
+    free(s);
+}
+
+int snapshot_pool_init(snapshot_pool_t * pool, int max) {
+    pool->free = NULL;
+    pool->count = 0;
+    pool->max = max;
+
+    return pthread_mutex_init(&pool->mutex, NULL);
+}
+
+void snapshot_pool_destroy(snapshot_pool_t * pool) {
+    while (pool->free != NULL) {
+        snapshot_t * s = pool->free;
+        pool->free = s->next;
+        free(s);
+    }
+    pool->count = 0;
+    pthread_mutex_destroy(&pool->mutex);
+}
+
+snapshot_t * snapshot_pool_get(snapshot_pool_t * pool, size_t capacity) {
+    pthread_mutex_lock(&pool->mutex);
+    snapshot_t * s = pool->free;
+    if (s != NULL) {
+        pool->free = s->next;
+        pool->count--;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (s != NULL && s->capacity < capacity) {
+        // too small for what we are producing now, replace it
+        free(s);
+        s = NULL;
+    }
+
+    if (s == NULL) {
+        if ((s = snapshot_alloc(capacity)) == NULL) {
+            return NULL;
+        }
+        s->recycle = pool_recycle;
+        s->user = pool;
+    }
+
+    atomic_store(&s->refs, 1);
+    s->seq = 0;
+    s->length = 0;
+    s->pts = 0;
+    s->flags = 0;
+    s->time_us = 0;
+    s->sensor_us = 0;
+    s->callback_us = 0;
+    s->published_us = 0;
+    s->next = NULL;
+
+    return s;
+}
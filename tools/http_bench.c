@@ -0,0 +1,216 @@
+/*
+ * http_bench: request rate against the api server, with and without 
+ * keep-alive and pipelining.
+ *
+ *   tools/http_bench [-h 127.0.0.1] [-P 8080] [-c connections] [-t seconds] 
+ *                    [-k] [-d depth] [path]
+ *
+ * Without -k every request opens a new connection, which is what pollers
+ * did before the server supported keep-alive.  -d sends that many requests
+ * back to back before reading the responses.  Run once with and once 
+ * without -k to see the gain, e.g.
+ *
+ *   tools/http_bench -c 8 /motion.bin
+ *   tools/http_bench -c 8 -k /motion.bin
+ *   tools/http_bench -c 8 -k -d 4 /motion.bin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static struct sockaddr_in addr;
+static const char * path = "/ping";
+static int keep_alive = 0;
+static int depth = 1;
+static double duration = 10;
+
+static atomic_ullong requests;
+static atomic_ullong bytes;
+static atomic_ullong errors;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_client() {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+typedef struct {
+    int sock;
+    char buf[1 << 16];
+    size_t length;
+} reader_t;
+
+// read one response, returns the body length or -1
+static long read_response(reader_t * r) {
+    char * end;
+
+    // headers
+    while ((end = memmem(r->buf, r->length, "\r\n\r\n", 4)) == NULL) {
+        if (r->length == sizeof(r->buf)) {
+            return -1;
+        }
+        ssize_t n = recv(r->sock, r->buf + r->length, sizeof(r->buf) - r->length, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        r->length += n;
+    }
+
+    size_t header_length = end + 4 - r->buf;
+    long content_length = 0;
+    char * cl = memmem(r->buf, header_length, "Content-Length:", 15);
+    if (cl != NULL) {
+        content_length = strtol(cl + 15, NULL, 10);
+    }
+
+    // body, most of which is discarded without buffering
+    size_t remaining = header_length + content_length;
+    while (r->length < remaining) {
+        remaining -= r->length;
+        r->length = 0;
+        ssize_t n = recv(r->sock, r->buf, sizeof(r->buf), 0);
+        if (n <= 0) {
+            return -1;
+        }
+        r->length = n;
+    }
+
+    memmove(r->buf, r->buf + remaining, r->length - remaining);
+    r->length -= remaining;
+
+    return content_length;
+}
+
+static void * client_thread(void * user) {
+    static __thread reader_t r;
+    char request[512];
+    int request_length = snprintf(request, sizeof(request),
+        "GET %s HTTP/1.1\r\nHost: bench\r\nConnection: %s\r\n\r\n",
+        path, keep_alive ? "keep-alive" : "close");
+
+    double end = now_seconds() + duration;
+    r.sock = -1;
+
+    while (now_seconds() < end) {
+        if (r.sock < 0) {
+            r.length = 0;
+            if ((r.sock = connect_client()) < 0) {
+                atomic_fetch_add(&errors, 1);
+                continue;
+            }
+        }
+
+        int batch = keep_alive ? depth : 1;
+        int ok = 1;
+
+        for(int i = 0; i < batch && ok; i++) {
+            ok = send(r.sock, request, request_length, MSG_NOSIGNAL) == request_length;
+        }
+        for(int i = 0; i < batch && ok; i++) {
+            long body = read_response(&r);
+            if (body < 0) {
+                ok = 0;
+                break;
+            }
+            atomic_fetch_add(&requests, 1);
+            atomic_fetch_add(&bytes, body);
+        }
+
+        if (!ok) {
+            atomic_fetch_add(&errors, 1);
+        }
+        if (!ok || !keep_alive) {
+            close(r.sock);
+            r.sock = -1;
+        }
+    }
+
+    if (r.sock >= 0) {
+        close(r.sock);
+    }
+    return NULL;
+}
+
+static void usage(const char * name) {
+    fprintf(stderr, "usage: %s [-h host] [-P port] [-c connections] [-t seconds] [-k] [-d depth] [path]\n", name);
+}
+
+int main(int ac, char ** av) {
+    const char * host = "127.0.0.1";
+    int port = 8080;
+    int connections = 8;
+    int opt;
+
+    while((opt = getopt(ac, av, "h:P:c:t:kd:")) != -1) {
+        switch(opt) {
+        case 'h': host = optarg; break;
+        case 'P': port = atoi(optarg); break;
+        case 'c': connections = atoi(optarg); break;
+        case 't': duration = atof(optarg); break;
+        case 'k': keep_alive = 1; break;
+        case 'd': depth = atoi(optarg); break;
+        default: usage(av[0]); return 1;
+        }
+    }
+    if (optind < ac) {
+        path = av[optind];
+    }
+    if (connections < 1 || depth < 1) {
+        usage(av[0]);
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "invalid host: %s\n", host);
+        return 1;
+    }
+
+    pthread_t * threads = (pthread_t*)calloc(connections, sizeof(pthread_t));
+    double start = now_seconds();
+
+    for(int i = 0; i < connections; i++) {
+        pthread_create(&threads[i], NULL, client_thread, NULL);
+    }
+    for(int i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    double elapsed = now_seconds() - start;
+    unsigned long long n = atomic_load(&requests);
+
+    printf("%s %s keep-alive=%d depth=%d connections=%d\n", 
+        host, path, keep_alive, keep_alive ? depth : 1, connections);
+    printf("requests: %llu  errors: %llu  req/s: %.1f  MB/s: %.2f\n",
+        n, atomic_load(&errors), n / elapsed, atomic_load(&bytes) / elapsed / 1e6);
+
+    free(threads);
+    return 0;
+}
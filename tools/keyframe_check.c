@@ -0,0 +1,172 @@
+/*
+ * keyframe_check: run the video server against a mock encoder control and
+ * check when it asks for idrs, no camera needed.
+ *
+ *   tools/keyframe_check [-P 18888] [-i interval-ms]
+ *
+ * The server listens on -P with the gop cache on and a request interval
+ * of -i ms.  It checks that a client joining with nothing cached asks for
+ * an idr, that joins within the interval share the next request instead
+ * of each sending one, and that a client primed from a cached gop asks
+ * for none.  It exits non-zero on the first failure.
+ */
+
+#include "server.h"
+#include "encoder_control.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// long enough for the server loop to have accepted and flushed
+#define SETTLE_MS 50
+#define MAX_CLIENTS 16
+
+static atomic_int requests;
+
+static int mock_request_keyframe(encoder_control_t * control) {
+    atomic_fetch_add(&requests, 1);
+    return 0;
+}
+
+static void sleep_ms(unsigned int ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+static int connect_client(int port) {
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror("connect");
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+static int expect(const char * what, int want) {
+    int got = atomic_load(&requests);
+    if (got != want) {
+        fprintf(stderr, "FAIL %s: %d idr requests, expected %d\n", what, got, want);
+        return -1;
+    }
+    fprintf(stderr, "ok   %s: %d idr requests\n", what, got);
+    return 0;
+}
+
+int main(int ac, char ** av) {
+    static uint8_t sps[] = { 0, 0, 0, 1, 0x67, 0x64, 0x00, 0x28, 0xac };
+    static uint8_t pps[] = { 0, 0, 0, 1, 0x68, 0xee, 0x3c, 0xb0 };
+    static uint8_t idr[] = { 0, 0, 0, 1, 0x65, 0x88, 0x84, 0x00, 0x33 };
+    static uint8_t slice[] = { 0, 0, 0, 1, 0x41, 0x9a, 0x02, 0x04 };
+
+    server_t server;
+    encoder_control_t control;
+    int port = 18888;
+    unsigned int interval_ms = 300;
+    int clients[MAX_CLIENTS];
+    int client_count = 0;
+    int result = 1;
+    int opt;
+
+    while ((opt = getopt(ac, av, "P:i:")) != -1) {
+        switch(opt) {
+        case 'P': port = atoi(optarg); break;
+        case 'i': interval_ms = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-P port] [-i interval-ms]\n", av[0]);
+            return 1;
+        }
+    }
+
+    atomic_init(&requests, 0);
+    control.request_keyframe = mock_request_keyframe;
+    control.user = NULL;
+
+    if (server_create(&server, port) != 0) {
+        return 1;
+    }
+    server_enable_gop_cache(&server);
+    server_set_encoder_control(&server, &control, interval_ms);
+
+    // nothing has been encoded yet, the first client needs an idr
+    if ((clients[client_count++] = connect_client(port)) < 0) {
+        goto cleanup;
+    }
+    sleep_ms(SETTLE_MS);
+    if (expect("first join", 1) != 0) {
+        goto cleanup;
+    }
+
+    // more joins right after it wait for the interval, then share one
+    for(int i = 0; i < 4; i++) {
+        if ((clients[client_count++] = connect_client(port)) < 0) {
+            goto cleanup;
+        }
+    }
+    sleep_ms(SETTLE_MS);
+    if (expect("joins within the interval", 1) != 0) {
+        goto cleanup;
+    }
+    sleep_ms(interval_ms);
+    if (expect("joins after the interval", 2) != 0) {
+        goto cleanup;
+    }
+    sleep_ms(interval_ms + SETTLE_MS);
+    if (expect("no joins", 2) != 0) {
+        goto cleanup;
+    }
+
+    // with a gop cached a new client starts from it
+    server_write(&server, sps, sizeof(sps));
+    server_write(&server, pps, sizeof(pps));
+    server_write(&server, idr, sizeof(idr));
+    server_write(&server, slice, sizeof(slice));
+    sleep_ms(interval_ms + SETTLE_MS);
+
+    int primed = connect_client(port);
+    if (primed < 0) {
+        goto cleanup;
+    }
+    clients[client_count++] = primed;
+
+    uint8_t head[sizeof(sps)];
+    if (recv(primed, head, sizeof(head), MSG_WAITALL) != (ssize_t)sizeof(head) || memcmp(head, sps, sizeof(sps)) != 0) {
+        fprintf(stderr, "FAIL primed join: did not start with the cached sps\n");
+        goto cleanup;
+    }
+    sleep_ms(interval_ms + SETTLE_MS);
+    if (expect("primed join", 2) != 0) {
+        goto cleanup;
+    }
+
+    fprintf(stderr, "all passed\n");
+    result = 0;
+
+cleanup:
+    for(int i = 0; i < client_count; i++) {
+        if (clients[i] >= 0) {
+            close(clients[i]);
+        }
+    }
+    server_close(&server);
+    return result;
+}
@@ -0,0 +1,670 @@
+/*
+ * load_bench: drive a running simplecam with a mix of clients and report
+ * what each kind of client got and what it cost the server.
+ *
+ *   tools/load_bench [-p pid] [-h 127.0.0.1] [-t seconds] [-s 1920x1080] group...
+ *
+ * A group is kind:count[:behaviour].  The kinds are
+ *
+ *   video    raw h264 readers on 8888
+ *   motion   raw motion vector readers on 8889
+ *   frame    /frame.jpg long polls on 8080
+ *   vectors  /motion.bin long polls on 8080
+ *
+ * and the behaviours
+ *
+ *   fast     read everything as it arrives, the default
+ *   slow=N   read at most N kB/s
+ *   stall    connect and never read
+ *
+ * e.g.
+ *
+ *   tools/load_bench -p $(pidof simplecam) video:32 video:4:slow=20 video:2:stall motion:8 frame:16
+ *
+ * Latency on the api is from the frame entering the frame bus, which the
+ * server sends as X-Timestamp, to the last byte of the response.  That
+ * clock is only shared with the bench on the same host.  The stream ports
+ * carry no timestamps, so there latency is how far a client is behind a
+ * reference reader the bench keeps on the port, with frames matched by
+ * content, measured to the first bytes of each frame.
+ *
+ * Drops on the stream ports are frames the reference got while a client
+ * was connected that the client did not, on the api they are skipped
+ * sequence numbers.  -s has to match the camera resolution for the motion
+ * fields to line up.
+ *
+ * Against simplecam-replay -l with the same capture the numbers compare
+ * across builds on any machine.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_EVENTS 256
+#define MAX_GROUPS 16
+// how often slow readers get their next slice
+#define TICK_MS 10
+// bytes of a video frame's first slice hashed to recognise it
+#define VIDEO_HASH_BYTES 16
+// frames the reference readers remember
+#define REFERENCE_FRAMES 1024
+#define HEADER_MAX 2048
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+typedef enum {
+    KIND_VIDEO = 0,
+    KIND_MOTION,
+    KIND_FRAME,
+    KIND_VECTORS,
+    KIND_COUNT
+} kind_t;
+
+static const char * kind_names[KIND_COUNT] = { "video", "motion", "frame", "vectors" };
+static const int kind_ports[KIND_COUNT] = { 8888, 8889, 8080, 8080 };
+static const char * kind_paths[KIND_COUNT] = { NULL, NULL, "/frame.jpg", "/motion.bin" };
+
+typedef enum {
+    BEHAVIOUR_FAST = 0,
+    BEHAVIOUR_SLOW,
+    BEHAVIOUR_STALL
+} behaviour_t;
+
+typedef struct {
+    double * values;
+    size_t count;
+    size_t capacity;
+} samples_t;
+
+typedef struct {
+    char name[48];
+    kind_t kind;
+    behaviour_t behaviour;
+    // bytes per second for slow readers
+    double rate;
+    int count;
+
+    int connected;
+    unsigned long long frames;
+    unsigned long long bytes;
+    unsigned long long drops;
+    samples_t latency;
+} group_t;
+
+typedef struct {
+    uint64_t hash;
+    double time;
+} reference_frame_t;
+
+// what the reference reader on a stream port saw, newest last
+typedef struct {
+    reference_frame_t frames[REFERENCE_FRAMES];
+    unsigned long long count;
+} reference_t;
+
+typedef struct {
+    int sock;
+    kind_t kind;
+    // NULL for a reference reader
+    group_t * group;
+    double connected_at;
+    unsigned long long bytes;
+    unsigned long long frames;
+    unsigned long long reference_at_connect;
+
+    // h264 start code scanner
+    int zeros;
+    int after_start;
+    int nal_type;
+    int expect_slice;
+    int collecting;
+
+    // the frame being read, its hash so far and when it started
+    uint64_t hash;
+    double frame_start;
+    size_t field_offset;
+
+    // http response being read
+    char header[HEADER_MAX];
+    size_t header_length;
+    long body_remaining;
+    int in_body;
+    int status;
+    unsigned long long seq;
+    unsigned long long last_seq;
+    unsigned long long timestamp;
+} client_t;
+
+static struct sockaddr_in host_addr;
+static size_t field_length;
+static reference_t references[KIND_COUNT];
+static double start_time;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// cpu seconds used by a process, -1 if it could not be read
+static double process_cpu_seconds(int pid) {
+    char path[64];
+    char buf[1024];
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE * f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    // skip past the command name, which may contain spaces
+    char * p = strrchr(buf, ')');
+    if (p == NULL) {
+        return -1;
+    }
+
+    unsigned long utime = 0, stime = 0;
+    // fields after ')' start at 3 (state), utime and stime are 14 and 15
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return -1;
+    }
+
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void samples_add(samples_t * s, double value) {
+    if (s->count == s->capacity) {
+        size_t capacity = s->capacity ? s->capacity * 2 : 1024;
+        double * values = (double*)realloc(s->values, capacity * sizeof(double));
+        if (values == NULL) {
+            return;
+        }
+        s->values = values;
+        s->capacity = capacity;
+    }
+    s->values[s->count++] = value;
+}
+
+static int compare_doubles(const void * a, const void * b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// the q quantile of samples already sorted in place
+static double percentile(samples_t * s, double q) {
+    if (s->count == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(q * s->count);
+    return s->values[i < s->count ? i : s->count - 1];
+}
+
+static int connect_client(kind_t kind) {
+    struct sockaddr_in addr = host_addr;
+    addr.sin_port = htons(kind_ports[kind]);
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror("connect");
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+static int send_poll(client_t * c) {
+    char request[256];
+    int length = snprintf(request, sizeof(request),
+        "GET %s?after=%llu HTTP/1.1\r\nHost: bench\r\n\r\n", kind_paths[c->kind], c->last_seq);
+    return send(c->sock, request, length, MSG_NOSIGNAL) == length ? 0 : -1;
+}
+
+// a whole frame arrived on a stream port
+static void stream_frame(client_t * c) {
+    reference_t * ref = &references[c->kind];
+
+    if (c->group == NULL) {
+        reference_frame_t * f = &ref->frames[ref->count % REFERENCE_FRAMES];
+        f->hash = c->hash;
+        f->time = c->frame_start;
+        ref->count++;
+        return;
+    }
+
+    c->frames++;
+    if (c->frame_start < start_time) {
+        return;
+    }
+
+    // newest first, a repeated frame counts from its latest showing
+    unsigned long long oldest = ref->count > REFERENCE_FRAMES ? ref->count - REFERENCE_FRAMES : 0;
+    for(unsigned long long i = ref->count; i > oldest; i--) {
+        reference_frame_t * f = &ref->frames[(i - 1) % REFERENCE_FRAMES];
+        if (f->hash == c->hash && f->time <= c->frame_start + 0.001) {
+            double latency = c->frame_start - f->time;
+            samples_add(&c->group->latency, latency > 0 ? latency : 0);
+            break;
+        }
+    }
+}
+
+// frames start at a slice with first_mb_in_slice 0, whose exp-golomb code
+// is a single 1 bit
+static void parse_video(client_t * c, const uint8_t * data, size_t length, double now) {
+    for(size_t i = 0; i < length; i++) {
+        uint8_t b = data[i];
+
+        if (c->collecting > 0) {
+            c->hash = (c->hash ^ b) * FNV_PRIME;
+            if (--c->collecting == 0) {
+                stream_frame(c);
+            }
+        } else if (c->after_start) {
+            c->nal_type = b & 0x1f;
+            c->expect_slice = c->nal_type == 1 || c->nal_type == 5;
+            c->after_start = 0;
+            c->hash = (FNV_OFFSET ^ b) * FNV_PRIME;
+            continue;
+        } else if (c->expect_slice) {
+            c->expect_slice = 0;
+            if (b & 0x80) {
+                c->frame_start = now;
+                c->hash = (c->hash ^ b) * FNV_PRIME;
+                c->collecting = VIDEO_HASH_BYTES - 2;
+            }
+        }
+
+        if (b == 0) {
+            c->zeros++;
+        } else {
+            if (b == 1 && c->zeros >= 2) {
+                c->after_start = 1;
+                c->expect_slice = 0;
+                c->collecting = 0;
+            }
+            c->zeros = 0;
+        }
+    }
+}
+
+static void parse_motion(client_t * c, const uint8_t * data, size_t length, double now) {
+    for(size_t i = 0; i < length; i++) {
+        if (c->field_offset == 0) {
+            c->frame_start = now;
+            c->hash = FNV_OFFSET;
+        }
+        c->hash = (c->hash ^ data[i]) * FNV_PRIME;
+        if (++c->field_offset == field_length) {
+            c->field_offset = 0;
+            stream_frame(c);
+        }
+    }
+}
+
+static unsigned long long header_value(const char * header, size_t length, const char * name) {
+    const char * p = memmem(header, length, name, strlen(name));
+    return p != NULL ? strtoull(p + strlen(name), NULL, 10) : 0;
+}
+
+// a response to a long poll, returns -1 when the connection is no good
+static int parse_http(client_t * c, const uint8_t * data, size_t length, double now) {
+    size_t i = 0;
+
+    while (i < length) {
+        if (!c->in_body) {
+            size_t n = length - i;
+            if (n > HEADER_MAX - c->header_length) {
+                n = HEADER_MAX - c->header_length;
+            }
+            memcpy(c->header + c->header_length, data + i, n);
+
+            char * end = memmem(c->header, c->header_length + n, "\r\n\r\n", 4);
+            if (end == NULL) {
+                c->header_length += n;
+                i += n;
+                if (c->header_length == HEADER_MAX) {
+                    return -1;
+                }
+                continue;
+            }
+
+            size_t header_length = end + 4 - c->header;
+            i += header_length - c->header_length;
+            c->header_length = header_length;
+            c->status = atoi(c->header + 9);
+            c->body_remaining = header_value(c->header, header_length, "Content-Length: ");
+            c->seq = header_value(c->header, header_length, "X-Sequence: ");
+            c->timestamp = header_value(c->header, header_length, "X-Timestamp: ");
+            c->in_body = 1;
+        }
+
+        size_t n = length - i;
+        if ((long)n > c->body_remaining) {
+            n = c->body_remaining;
+        }
+        c->body_remaining -= n;
+        i += n;
+
+        if (c->body_remaining > 0) {
+            continue;
+        }
+
+        // the whole response is in
+        c->in_body = 0;
+        c->header_length = 0;
+
+        if (c->status == 200 && c->seq > c->last_seq) {
+            c->frames++;
+            if (c->last_seq > 0) {
+                c->group->drops += c->seq - c->last_seq - 1;
+            }
+            c->last_seq = c->seq;
+
+            if (c->timestamp > 0 && now >= start_time) {
+                struct timespec ts;
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                double sent = c->timestamp / 1e6;
+                double latency = ts.tv_sec + ts.tv_nsec / 1e9 - sent;
+                samples_add(&c->group->latency, latency > 0 ? latency : 0);
+            }
+        } else if (c->status != 200 && c->status != 204 && c->status != 304) {
+            return -1;
+        }
+
+        if (send_poll(c) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// read what there is, or what a slow reader is allowed.  returns -1 once
+// the connection is gone
+static int client_read(client_t * c, double now) {
+    static uint8_t buf[1 << 16];
+    size_t want = sizeof(buf);
+
+    if (c->group != NULL && c->group->behaviour == BEHAVIOUR_SLOW) {
+        double allowed = c->group->rate * (now - c->connected_at) - c->bytes;
+        if (allowed < 1) {
+            return 0;
+        }
+        if (allowed < want) {
+            want = (size_t)allowed;
+        }
+    }
+
+    ssize_t r = recv(c->sock, buf, want, MSG_DONTWAIT);
+    if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+        return -1;
+    }
+    if (r < 0) {
+        return 0;
+    }
+
+    c->bytes += r;
+    if (c->group != NULL && now >= start_time) {
+        c->group->bytes += r;
+    }
+
+    switch(c->kind) {
+    case KIND_VIDEO: parse_video(c, buf, r, now); break;
+    case KIND_MOTION: parse_motion(c, buf, r, now); break;
+    default: return parse_http(c, buf, r, now);
+    }
+    return 0;
+}
+
+static int client_open(client_t * c, kind_t kind, group_t * group, int epollfd) {
+    memset(c, 0, sizeof(*c));
+    c->kind = kind;
+    c->group = group;
+    c->connected_at = now_seconds();
+    c->reference_at_connect = references[kind].count;
+
+    if ((c->sock = connect_client(kind)) < 0) {
+        return -1;
+    }
+    if (kind_paths[kind] != NULL && send_poll(c) != 0) {
+        close(c->sock);
+        c->sock = -1;
+        return -1;
+    }
+
+    // slow readers are read on the tick, stalled ones never
+    if (group == NULL || group->behaviour == BEHAVIOUR_FAST) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, c->sock, &ev);
+    }
+    return 0;
+}
+
+static void client_close(client_t * c, int epollfd) {
+    if (c->sock < 0) {
+        return;
+    }
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, c->sock, NULL);
+    close(c->sock);
+    c->sock = -1;
+
+    // frames the reference saw while this stream client was connected
+    if (c->group != NULL && kind_paths[c->kind] == NULL) {
+        unsigned long long seen = references[c->kind].count - c->reference_at_connect;
+        if (seen > c->frames) {
+            c->group->drops += seen - c->frames;
+        }
+    }
+    if (c->group != NULL) {
+        c->group->frames += c->frames;
+    }
+}
+
+static int parse_group(group_t * g, const char * spec) {
+    char kind[16] = "";
+    char behaviour[32] = "fast";
+
+    memset(g, 0, sizeof(*g));
+    snprintf(g->name, sizeof(g->name), "%s", spec);
+    if (sscanf(spec, "%15[^:]:%d:%31s", kind, &g->count, behaviour) < 2 || g->count < 1) {
+        return -1;
+    }
+
+    g->kind = KIND_COUNT;
+    for(int k = 0; k < KIND_COUNT; k++) {
+        if (strcmp(kind, kind_names[k]) == 0) {
+            g->kind = k;
+        }
+    }
+    if (g->kind == KIND_COUNT) {
+        return -1;
+    }
+
+    if (strcmp(behaviour, "fast") == 0) {
+        g->behaviour = BEHAVIOUR_FAST;
+    } else if (strcmp(behaviour, "stall") == 0) {
+        g->behaviour = BEHAVIOUR_STALL;
+    } else if (strncmp(behaviour, "slow=", 5) == 0 && atof(behaviour + 5) > 0) {
+        g->behaviour = BEHAVIOUR_SLOW;
+        g->rate = atof(behaviour + 5) * 1000;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char * name) {
+    fprintf(stderr, "usage: %s [-p pid] [-h host] [-t seconds] [-s widthxheight] kind:count[:fast|slow=kB/s|stall]...\n", name);
+    fprintf(stderr, "kinds: video motion frame vectors\n");
+}
+
+int main(int ac, char ** av) {
+    const char * host = "127.0.0.1";
+    double duration = 10;
+    int width = 1920, height = 1080;
+    int pid = -1;
+    group_t groups[MAX_GROUPS];
+    int group_count = 0;
+    int opt;
+
+    while((opt = getopt(ac, av, "h:p:t:s:")) != -1) {
+        switch(opt) {
+        case 'h': host = optarg; break;
+        case 'p': pid = atoi(optarg); break;
+        case 't': duration = atof(optarg); break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2) {
+                usage(av[0]);
+                return 1;
+            }
+            break;
+        default: usage(av[0]); return 1;
+        }
+    }
+    for(int i = optind; i < ac; i++) {
+        if (group_count == MAX_GROUPS || parse_group(&groups[group_count], av[i]) != 0) {
+            usage(av[0]);
+            return 1;
+        }
+        group_count++;
+    }
+    if (group_count == 0) {
+        usage(av[0]);
+        return 1;
+    }
+
+    // same layout as the camera's: a column per macroblock plus one
+    field_length = (size_t)((width + 15) / 16 + 1) * ((height + 15) / 16) * 4;
+
+    memset(&host_addr, 0, sizeof(host_addr));
+    host_addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, host, &host_addr.sin_addr) != 1) {
+        fprintf(stderr, "invalid host: %s\n", host);
+        return 1;
+    }
+
+    int epollfd = epoll_create1(0);
+    if (epollfd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    int total = KIND_COUNT;
+    for(int i = 0; i < group_count; i++) {
+        total += groups[i].count;
+    }
+    client_t * clients = (client_t*)calloc(total, sizeof(client_t));
+    if (clients == NULL) {
+        fprintf(stderr, "could not allocate %d clients\n", total);
+        close(epollfd);
+        return 1;
+    }
+    int client_count = 0;
+
+    // the references come first so they see every frame the others do
+    int wanted[KIND_COUNT] = {0};
+    for(int i = 0; i < group_count; i++) {
+        wanted[groups[i].kind] = 1;
+    }
+    for(int k = 0; k < KIND_COUNT; k++) {
+        if (wanted[k] && kind_paths[k] == NULL) {
+            if (client_open(&clients[client_count], k, NULL, epollfd) != 0) {
+                return 1;
+            }
+            client_count++;
+        }
+    }
+    int reference_count = client_count;
+
+    for(int i = 0; i < group_count; i++) {
+        for(int n = 0; n < groups[i].count; n++) {
+            if (client_open(&clients[client_count], groups[i].kind, &groups[i], epollfd) == 0) {
+                groups[i].connected++;
+                client_count++;
+            }
+        }
+    }
+
+    double cpu_start = pid > 0 ? process_cpu_seconds(pid) : -1;
+    start_time = now_seconds();
+    double end = start_time + duration;
+    double next_tick = start_time;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (now_seconds() < end) {
+        int n = epoll_wait(epollfd, events, MAX_EVENTS, TICK_MS);
+        double now = now_seconds();
+
+        // references before everyone else, so a frame is known before a
+        // client that got it in the same wake up looks for it
+        for(int pass = 0; pass < 2; pass++) {
+            for(int i = 0; i < n; i++) {
+                client_t * c = (client_t*)events[i].data.ptr;
+                if ((c->group == NULL) == (pass == 0) && c->sock >= 0 && client_read(c, now) != 0) {
+                    client_close(c, epollfd);
+                }
+            }
+        }
+
+        if (now >= next_tick) {
+            next_tick = now + TICK_MS / 1000.0;
+            for(int i = reference_count; i < client_count; i++) {
+                client_t * c = &clients[i];
+                if (c->sock >= 0 && c->group->behaviour == BEHAVIOUR_SLOW && client_read(c, now) != 0) {
+                    client_close(c, epollfd);
+                }
+            }
+        }
+    }
+
+    double elapsed = now_seconds() - start_time;
+    double cpu = cpu_start >= 0 ? process_cpu_seconds(pid) - cpu_start : -1;
+
+    for(int i = 0; i < client_count; i++) {
+        client_close(&clients[i], epollfd);
+    }
+
+    printf("%-24s %7s %10s %10s %9s %9s %9s %9s\n",
+        "group", "clients", "fps/client", "MB", "p50 ms", "p99 ms", "p999 ms", "drops");
+    for(int i = 0; i < group_count; i++) {
+        group_t * g = &groups[i];
+        samples_t * s = &g->latency;
+        qsort(s->values, s->count, sizeof(double), compare_doubles);
+
+        printf("%-24s %7d %10.1f %10.2f %9.2f %9.2f %9.2f %9llu\n",
+            g->name, g->connected,
+            g->connected > 0 ? g->frames / elapsed / g->connected : 0.0,
+            g->bytes / 1e6,
+            percentile(s, 0.5) * 1000, percentile(s, 0.99) * 1000, percentile(s, 0.999) * 1000,
+            g->drops);
+        free(s->values);
+    }
+    if (cpu >= 0) {
+        printf("server cpu: %.2f s in %.1f s, %.1f%%\n", cpu, elapsed, cpu * 100.0 / elapsed);
+    }
+
+    close(epollfd);
+    free(clients);
+    return 0;
+}
@@ -0,0 +1,234 @@
+/*
+ * motion_bench: time the motion vector kernels against recorded fields.
+ *
+ * Record some motion first, either single fields from the http api or a
+ * stretch of the raw stream:
+ *
+ *   curl -s http://pi:8080/motion.bin > field.bin
+ *   timeout 10 nc pi 8889 > walk.bin
+ *
+ * then decode, analyse and feed a background model every field in the 
+ * dumps with the scalar kernels and with the NEON or SSE2 ones this build 
+ * has:
+ *
+ *   tools/motion_bench [-w 1920] [-h 1080] [-n 200] [-t 16] walk.bin ...
+ *
+ * A dump is cut into fields of the size the resolution implies, a partial
+ * field at the end is ignored.  Without dumps it runs on random vectors.
+ * Both kernel sets must agree on every field, decode and analyze exactly
+ * and the background update to within rounding, or it fails.  Build it on the
+ * target with the same flags as src/motion.o to get meaningful numbers.
+ */
+
+#include "motion.h"
+#include "motion_background.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// append every whole field in path to fields, returns the new field count
+static int load_dump(const char * path, size_t length, uint8_t ** fields, int count) {
+    FILE * f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    uint8_t * field = malloc(length);
+    while(fread(field, 1, length, f) == length) {
+        *fields = realloc(*fields, (count + 1) * length);
+        memcpy(*fields + count * length, field, length);
+        count++;
+    }
+
+    free(field);
+    fclose(f);
+    return count;
+}
+
+// seconds per field over iterations passes of every field for decode and 
+// analyze, and for the background update.  stats of every field are left 
+// in stats
+static double run(motion_field_t * field, const motion_kernels_t * kernels, const uint8_t * fields, 
+        int count, int iterations, uint16_t threshold, motion_stats_t * stats, double * background) 
+{
+    motion_background_t bg;
+    double analyze = 0;
+
+    field->kernels = kernels;
+    *background = 0;
+    if (motion_background_init(&bg, field) != 0) {
+        exit(1);
+    }
+
+    for(int i = 0; i < iterations; i++) {
+        for(int k = 0; k < count; k++) {
+            double start = now_seconds();
+            motion_field_decode(field, fields + k * field->length, field->length);
+            motion_field_analyze(field, threshold, &stats[k]);
+            double middle = now_seconds();
+            motion_background_apply(&bg, field);
+
+            analyze += middle - start;
+            *background += now_seconds() - middle;
+        }
+    }
+
+    motion_background_destroy(&bg);
+    *background /= (double)iterations * count;
+    return analyze / ((double)iterations * count);
+}
+
+// do the two background kernels agree on a value, the vector ones may 
+// estimate the square root and round differently
+static int close_enough(float a, float b) {
+    return fabsf(a - b) <= 1e-3f * fmaxf(1, fabsf(b));
+}
+
+// run the scalar and the other background kernel over the magnitudes of 
+// every field, starting from the model a scalar background has learned so
+// far, and compare what they leave.  -1 on the first disagreement
+static int check_background(motion_field_t * field, const motion_kernels_t * kernels, 
+        const uint8_t * fields, int count) 
+{
+    motion_background_t bg;
+    int n = field->count;
+    int result = 0;
+
+    field->kernels = &motion_kernels_scalar;
+    if (motion_background_init(&bg, field) != 0) {
+        exit(1);
+    }
+
+    uint16_t * value[2] = { malloc(n * sizeof(uint16_t)), malloc(n * sizeof(uint16_t)) };
+    float * mean[2] = { malloc(n * sizeof(float)), malloc(n * sizeof(float)) };
+    float * variance[2] = { malloc(n * sizeof(float)), malloc(n * sizeof(float)) };
+    const motion_kernels_t * both[2] = { &motion_kernels_scalar, kernels };
+
+    for(int k = 0; k < count && result == 0; k++) {
+        motion_field_decode(field, fields + k * field->length, field->length);
+
+        for(int j = 0; j < 2; j++) {
+            memcpy(value[j], field->magnitude, n * sizeof(uint16_t));
+            memcpy(mean[j], bg.magnitude_mean, n * sizeof(float));
+            memcpy(variance[j], bg.magnitude_variance, n * sizeof(float));
+            both[j]->background(value[j], mean[j], variance[j], n, &bg.params);
+        }
+
+        for(int i = 0; i < n; i++) {
+            if (abs(value[0][i] - value[1][i]) > 1 || !close_enough(mean[1][i], mean[0][i]) || 
+                !close_enough(variance[1][i], variance[0][i])) 
+            {
+                fprintf(stderr, "%s and scalar background kernels disagree on field %d macroblock %d\n", 
+                    kernels->name, k, i);
+                result = -1;
+                break;
+            }
+        }
+
+        motion_background_apply(&bg, field);
+    }
+
+    for(int j = 0; j < 2; j++) {
+        free(value[j]);
+        free(mean[j]);
+        free(variance[j]);
+    }
+    motion_background_destroy(&bg);
+    return result;
+}
+
+static void usage(const char * name) {
+    fprintf(stderr, "usage: %s [-w width] [-h height] [-n iterations] [-t threshold] [dumps...]\n", name);
+}
+
+int main(int ac, char ** av) {
+    int width = 1920;
+    int height = 1080;
+    int iterations = 200;
+    int threshold = MOTION_DEFAULT_THRESHOLD;
+    int opt;
+
+    while((opt = getopt(ac, av, "w:h:n:t:")) != -1) {
+        switch(opt) {
+        case 'w': width = atoi(optarg); break;
+        case 'h': height = atoi(optarg); break;
+        case 'n': iterations = atoi(optarg); break;
+        case 't': threshold = atoi(optarg); break;
+        default: usage(av[0]); return 1;
+        }
+    }
+
+    motion_field_t field;
+    if (motion_field_init(&field, width, height) != 0) {
+        return 1;
+    }
+
+    uint8_t * fields = NULL;
+    int count = 0;
+
+    for(int i = optind; i < ac; i++) {
+        if ((count = load_dump(av[i], field.length, &fields, count)) < 0) {
+            return 1;
+        }
+    }
+
+    if (optind == ac) {
+        count = 16;
+        fields = malloc(count * field.length);
+        srand(1);
+        for(size_t i = 0; i < count * field.length; i++) {
+            fields[i] = rand();
+        }
+    }
+
+    if (count == 0) {
+        fprintf(stderr, "no whole %dx%d fields (%zu bytes) in the dumps\n", width, height, field.length);
+        return 1;
+    }
+
+    motion_stats_t * reference = calloc(count, sizeof(motion_stats_t));
+    motion_stats_t * stats = calloc(count, sizeof(motion_stats_t));
+
+    double scalar_background, best_background;
+    double scalar = run(&field, &motion_kernels_scalar, fields, count, iterations, threshold, reference, &scalar_background);
+    double best = run(&field, motion_kernels_best, fields, count, iterations, threshold, stats, &best_background);
+
+    for(int k = 0; k < count; k++) {
+        if (memcmp(&reference[k], &stats[k], sizeof(motion_stats_t)) != 0) {
+            fprintf(stderr, "%s and scalar kernels disagree on field %d\n", motion_kernels_best->name, k);
+            return 1;
+        }
+    }
+    if (check_background(&field, motion_kernels_best, fields, count) != 0) {
+        return 1;
+    }
+
+    printf("%d fields of %dx%d macroblocks, %d passes\n", count, field.width, field.height, iterations);
+    printf("%-8s %10s %12s %14s\n", "kernels", "us/field", "Mmb/s", "background us");
+    printf("%-8s %10.2f %12.1f %14.2f\n", "scalar", scalar * 1e6, field.count / scalar / 1e6, scalar_background * 1e6);
+    if (motion_kernels_best != &motion_kernels_scalar) {
+        printf("%-8s %10.2f %12.1f %14.2f  (%.2fx, %.2fx)\n", motion_kernels_best->name, best * 1e6, field.count / best / 1e6, 
+            best_background * 1e6, scalar / best, scalar_background / best_background);
+    }
+
+    motion_stats_t * last = &stats[count - 1];
+    printf("last field: %u active (%.1f%%), magnitude sum %llu\n", 
+        last->active, last->activity * 100, (unsigned long long)last->magnitude_sum);
+
+    free(reference);
+    free(stats);
+    free(fields);
+    motion_field_destroy(&field);
+    return 0;
+}
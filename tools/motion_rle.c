@@ -0,0 +1,376 @@
+/*
+ * motion_rle: reference decoder and round trip tests for the motion codec.
+ *
+ * Decode the compressed motion stream back into raw INLINE_VECTORS fields,
+ * ready for anything that reads port 8889 today:
+ *
+ *   tools/motion_rle decode [-h 127.0.0.1] [-P 8889] > fields.bin
+ *
+ * It asks for the stream with "enc=rle", waits for a keyframe after any 
+ * gap and prints the compression ratio to stderr every few seconds.
+ *
+ * Round trip every field of some raw dumps, or synthetic scenes without 
+ * any, through the codec and check what comes back:
+ *
+ *   tools/motion_rle test [-w 1920] [-h 1080] [dumps...]
+ *
+ * It checks exact round trips with no sad tolerance, vectors exact and 
+ * sads within the tolerance with the default one, standalone keyframes,
+ * recovery after a lost frame and that truncated or corrupted frames are
+ * rejected rather than decoded.  It exits non-zero on the first failure.
+ */
+
+#include "motion_codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int decode_stream(const char * host, int port) {
+    struct sockaddr_in addr;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host, &addr.sin_addr);
+
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror("could not connect");
+        return 1;
+    }
+
+    const char request[] = "enc=rle\n";
+    if (write(sock, request, sizeof(request) - 1) != sizeof(request) - 1) {
+        perror("could not ask for the rle stream");
+        return 1;
+    }
+
+    motion_codec_t codec;
+    int have_codec = 0;
+    uint8_t * raw = NULL;
+    size_t size = 1 << 20;
+    size_t length = 0;
+    uint8_t * in = malloc(size);
+    unsigned long long bytes_in = 0, bytes_out = 0, frames = 0, skipped = 0;
+    double reported = now_seconds();
+
+    for(;;) {
+        ssize_t r = read(sock, in + length, size - length);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        length += r;
+        bytes_in += r;
+
+        size_t pos = 0;
+        for(;;) {
+            long frame = motion_codec_frame_length(in + pos, length - pos);
+            if (frame < 0) {
+                // not a frame boundary, look for the next one
+                pos++;
+                continue;
+            }
+            if (frame == 0 || (size_t)frame > length - pos) {
+                break;
+            }
+
+            uint32_t raw_length = in[pos + 8] | (in[pos + 9] << 8) | (in[pos + 10] << 16) | ((uint32_t)in[pos + 11] << 24);
+            if (!have_codec || codec.length != raw_length) {
+                if (have_codec) {
+                    motion_codec_destroy(&codec);
+                }
+                if (motion_codec_init(&codec, raw_length, 0, 0) != 0) {
+                    return 1;
+                }
+                have_codec = 1;
+                raw = realloc(raw, raw_length);
+            }
+
+            int n = motion_codec_decode(&codec, in + pos, frame, raw, raw_length);
+            if (n > 0) {
+                if (fwrite(raw, 1, n, stdout) != (size_t)n) {
+                    return 1;
+                }
+                bytes_out += n;
+                frames++;
+            } else {
+                skipped++;
+            }
+            pos += frame;
+        }
+
+        memmove(in, in + pos, length - pos);
+        length -= pos;
+        if (length == size) {
+            size *= 2;
+            in = realloc(in, size);
+        }
+
+        double now = now_seconds();
+        if (now - reported >= 5) {
+            fprintf(stderr, "%llu fields, %llu skipped, %.1f KB/s for %.1f KB/s raw, %.1fx\n",
+                frames, skipped, bytes_in / 1024.0 / (now - reported), bytes_out / 1024.0 / (now - reported),
+                bytes_in ? (double)bytes_out / bytes_in : 0);
+            bytes_in = bytes_out = 0;
+            reported = now;
+        }
+    }
+
+    close(sock);
+    return 0;
+}
+
+static int failures = 0;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+        return -1; \
+    } \
+} while(0)
+
+// synthetic fields: a static scene with sad jitter, a few noisy vectors 
+// and an object crossing it
+static void synthesize(uint8_t * fields, int count, int width, int height) {
+    int stride = width + 1;
+    size_t length = (size_t)stride * height * 4;
+    uint16_t * base = malloc(stride * height * sizeof(uint16_t));
+
+    srand(1);
+    for(int i = 0; i < stride * height; i++) {
+        base[i] = 200 + rand() % 2000;
+    }
+
+    for(int f = 0; f < count; f++) {
+        uint8_t * raw = fields + f * length;
+        for(int i = 0; i < stride * height; i++) {
+            int x = i % stride, y = i / stride;
+            int8_t vx = 0, vy = 0;
+            int sad = base[i] + rand() % 41 - 20;
+
+            if (rand() % 200 == 0) {
+                vx = rand() % 3 - 1;
+            }
+            if (f >= count / 2 && x >= (f - count / 2) % width && x < (f - count / 2) % width + 6 && y >= 10 && y < 16) {
+                vx = 3;
+                vy = -1;
+                sad += 1500;
+            }
+            raw[i * 4] = vx;
+            raw[i * 4 + 1] = vy;
+            raw[i * 4 + 2] = sad;
+            raw[i * 4 + 3] = sad >> 8;
+        }
+    }
+
+    free(base);
+}
+
+static int compare(const uint8_t * a, const uint8_t * b, size_t length, int tolerance) {
+    for(size_t i = 0; i < length; i += 4) {
+        if (a[i] != b[i] || a[i + 1] != b[i + 1]) {
+            return -1;
+        }
+        int sa = a[i + 2] | (a[i + 3] << 8);
+        int sb = b[i + 2] | (b[i + 3] << 8);
+        if (abs(sa - sb) > tolerance) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// encode and decode every field, optionally losing one.  returns the
+// encoded bytes
+static long round_trip(const uint8_t * fields, int count, size_t length, uint16_t tolerance, int lose) {
+    motion_codec_t encoder, decoder;
+    size_t bound = motion_codec_bound(length);
+    uint8_t * out = malloc(bound);
+    uint8_t * raw = malloc(length);
+    long total = 0;
+    int waiting = 0;
+
+    motion_codec_init(&encoder, length, MOTION_CODEC_KEY_INTERVAL, tolerance);
+    motion_codec_init(&decoder, length, 0, 0);
+
+    for(int f = 0; f < count; f++) {
+        size_t n = motion_codec_encode(&encoder, fields + f * length, length, 0, out, bound);
+        CHECK(n > 0, "field %d did not encode", f);
+        total += n;
+
+        if (f == lose) {
+            waiting = 1;
+            continue;
+        }
+
+        int key = out[2] == MOTION_CODEC_KEY;
+        int r = motion_codec_decode(&decoder, out, n, raw, length);
+        if (waiting && !key) {
+            CHECK(r == MOTION_CODEC_NEED_KEY, "field %d decoded after a lost frame: %d", f, r);
+            continue;
+        }
+        waiting = 0;
+
+        CHECK(r == (int)length, "field %d did not decode: %d", f, r);
+        CHECK(compare(fields + f * length, raw, length, key ? 0 : tolerance) == 0, 
+            "field %d differs after a round trip with tolerance %d", f, tolerance);
+    }
+
+    motion_codec_destroy(&encoder);
+    motion_codec_destroy(&decoder);
+    free(out);
+    free(raw);
+    return total;
+}
+
+// standalone keyframes, and damaged frames that must not decode
+static int robustness(const uint8_t * fields, int count, size_t length) {
+    motion_codec_t decoder;
+    size_t bound = motion_codec_bound(length);
+    uint8_t * out = malloc(bound);
+    uint8_t * damaged = malloc(bound);
+    uint8_t * raw = malloc(length);
+
+    motion_codec_init(&decoder, length, 0, 0);
+    srand(2);
+
+    for(int f = 0; f < count; f++) {
+        size_t n = motion_codec_encode_key(fields + f * length, length, f + 1, out, bound);
+        CHECK(n > 0, "keyframe %d did not encode", f);
+        CHECK(motion_codec_decode(&decoder, out, n, raw, length) == (int)length, "keyframe %d did not decode", f);
+        CHECK(memcmp(raw, fields + f * length, length) == 0, "keyframe %d differs", f);
+
+        CHECK(motion_codec_decode(&decoder, out, n - 1 - rand() % (n - MOTION_CODEC_HEADER), raw, length) < 0,
+            "truncated keyframe %d decoded", f);
+
+        // flipped bits may still decode to something, but never past the
+        // buffers, and the decoder must accept the next good keyframe
+        memcpy(damaged, out, n);
+        for(int k = 0; k < 8; k++) {
+            damaged[MOTION_CODEC_HEADER + rand() % (n - MOTION_CODEC_HEADER)] ^= 1 << (rand() % 8);
+        }
+        motion_codec_decode(&decoder, damaged, n, raw, length);
+        CHECK(motion_codec_decode(&decoder, out, n, raw, length) == (int)length, 
+            "keyframe %d did not decode after a damaged one", f);
+
+        damaged[0] = 'X';
+        CHECK(motion_codec_frame_length(damaged, n) < 0, "bad magic accepted");
+    }
+
+    motion_codec_destroy(&decoder);
+    free(out);
+    free(damaged);
+    free(raw);
+    return 0;
+}
+
+static int test(int width, int height, char ** dumps, int dump_count) {
+    size_t length = (size_t)(width + 15) / 16 * 4 + 4;
+    length *= (height + 15) / 16;
+    uint8_t * fields = NULL;
+    int count = 0;
+
+    for(int i = 0; i < dump_count; i++) {
+        FILE * f = fopen(dumps[i], "rb");
+        if (f == NULL) {
+            perror(dumps[i]);
+            return 1;
+        }
+        fields = realloc(fields, (count + 1) * length);
+        while(fread(fields + count * length, 1, length, f) == length) {
+            count++;
+            fields = realloc(fields, (count + 1) * length);
+        }
+        fclose(f);
+    }
+
+    if (dump_count == 0) {
+        count = 200;
+        fields = malloc(count * length);
+        synthesize(fields, count, (width + 15) / 16, (height + 15) / 16);
+    }
+    if (count == 0) {
+        fprintf(stderr, "no whole %dx%d fields (%zu bytes) in the dumps\n", width, height, length);
+        return 1;
+    }
+
+    long exact = round_trip(fields, count, length, 0, -1);
+    long lossy = round_trip(fields, count, length, MOTION_CODEC_SAD_TOLERANCE, -1);
+    round_trip(fields, count, length, MOTION_CODEC_SAD_TOLERANCE, count > 3 ? 3 : -1);
+    robustness(fields, count < 20 ? count : 20, length);
+
+    if (failures == 0) {
+        double raw = (double)count * length;
+        printf("%d fields of %zu bytes\n", count, length);
+        printf("tolerance 0:  %.1f bytes/field, %.1fx\n", (double)exact / count, raw / exact);
+        printf("tolerance %d: %.1f bytes/field, %.1fx\n", MOTION_CODEC_SAD_TOLERANCE, (double)lossy / count, raw / lossy);
+        printf("all round trips passed\n");
+    }
+
+    free(fields);
+    return failures ? 1 : 0;
+}
+
+static void usage(const char * name) {
+    fprintf(stderr, "usage: %s decode [-h host] [-P port]\n"
+                    "       %s test [-w width] [-h height] [dumps...]\n", name, name);
+}
+
+int main(int ac, char ** av) {
+    const char * host = "127.0.0.1";
+    int port = 8889;
+    int width = 1920;
+    int height = 1080;
+    int opt;
+
+    if (ac < 2) {
+        usage(av[0]);
+        return 1;
+    }
+    const char * mode = av[1];
+    optind = 2;
+
+    while((opt = getopt(ac, av, "h:P:w:")) != -1) {
+        switch(opt) {
+        case 'h':
+            if (strcmp(mode, "test") == 0) {
+                height = atoi(optarg);
+            } else {
+                host = optarg;
+            }
+            break;
+        case 'P': port = atoi(optarg); break;
+        case 'w': width = atoi(optarg); break;
+        default: usage(av[0]); return 1;
+        }
+    }
+
+    if (strcmp(mode, "decode") == 0) {
+        return decode_stream(host, port);
+    } else if (strcmp(mode, "test") == 0) {
+        return test(width, height, av + optind, ac - optind);
+    }
+
+    usage(av[0]);
+    return 1;
+}
@@ -0,0 +1,202 @@
+/*
+ * stream_bench: measure the server CPU spent per delivered megabyte on the
+ * raw stream ports.
+ *
+ * For each client count it opens that many connections to host:port, reads
+ * everything as fast as it can for the given duration and samples the
+ * utime+stime of the server process from /proc before and after.
+ *
+ *   tools/stream_bench -p $(pidof simplecam) [-h 127.0.0.1] [-P 8888] [-t 10] [1 8 32 128]
+ *
+ * To compare designs run it against each build in turn with the camera
+ * pointed at the same scene, since the bitrate drives the numbers.
+ *
+ * For MSG_ZEROCOPY run it once with video_zerocopy off and once with it on
+ * and compare the cpu %/client column.  Run it from another machine: over
+ * loopback the kernel copies zerocopy sends anyway, and the server
+ * gives up on zerocopy for that client after a few of them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_EVENTS 128
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// cpu seconds used by a process, -1 if it could not be read
+static double process_cpu_seconds(int pid) {
+    char path[64];
+    char buf[1024];
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE * f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    // skip past the command name, which may contain spaces
+    char * p = strrchr(buf, ')');
+    if (p == NULL) {
+        return -1;
+    }
+
+    unsigned long utime = 0, stime = 0;
+    // fields after ')' start at 3 (state), utime and stime are 14 and 15
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return -1;
+    }
+
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static int connect_client(struct sockaddr_in * addr) {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(s, (struct sockaddr*)addr, sizeof(*addr)) != 0) {
+        perror("connect");
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+static int run(struct sockaddr_in * addr, int pid, int clients, double duration) {
+    static char buf[1 << 16];
+    unsigned long long total = 0;
+    int connected = 0;
+
+    int epollfd = epoll_create1(0);
+    if (epollfd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    int * socks = (int*)calloc(clients, sizeof(int));
+    if (socks == NULL) {
+        fprintf(stderr, "could not allocate %d clients\n", clients);
+        close(epollfd);
+        return -1;
+    }
+
+    for(int i = 0; i < clients; i++) {
+        if ((socks[i] = connect_client(addr)) < 0) {
+            break;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = socks[i];
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, socks[i], &ev);
+        connected++;
+    }
+
+    double cpu_start = process_cpu_seconds(pid);
+    double start = now_seconds();
+    double end = start + duration;
+    struct epoll_event events[MAX_EVENTS];
+
+    while(now_seconds() < end) {
+        int n = epoll_wait(epollfd, events, MAX_EVENTS, 100);
+        for(int i = 0; i < n; i++) {
+            ssize_t r = recv(events[i].data.fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (r > 0) {
+                total += r;
+            } else if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+            }
+        }
+    }
+
+    double elapsed = now_seconds() - start;
+    double cpu = process_cpu_seconds(pid) - cpu_start;
+    double mb = total / 1e6;
+
+    printf("%7d %9d %10.2f %10.2f %10.3f %12.3f %12.3f\n",
+        clients, connected, mb, mb / elapsed, cpu, 
+        mb > 0 ? cpu * 1000.0 / mb : 0.0,
+        connected > 0 ? cpu * 100.0 / elapsed / connected : 0.0);
+    fflush(stdout);
+
+    for(int i = 0; i < connected; i++) {
+        close(socks[i]);
+    }
+    close(epollfd);
+    free(socks);
+
+    return 0;
+}
+
+static void usage(const char * name) {
+    fprintf(stderr, "usage: %s -p pid [-h host] [-P port] [-t seconds] [clients...]\n", name);
+}
+
+int main(int ac, char ** av) {
+    const char * host = "127.0.0.1";
+    int port = 8888;
+    int pid = -1;
+    double duration = 10;
+    int opt;
+
+    while((opt = getopt(ac, av, "h:P:p:t:")) != -1) {
+        switch(opt) {
+        case 'h': host = optarg; break;
+        case 'P': port = atoi(optarg); break;
+        case 'p': pid = atoi(optarg); break;
+        case 't': duration = atof(optarg); break;
+        default: usage(av[0]); return 1;
+        }
+    }
+
+    if (pid <= 0) {
+        usage(av[0]);
+        return 1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "invalid host: %s\n", host);
+        return 1;
+    }
+
+    static const int default_counts[] = {1, 8, 32, 128};
+
+    printf("%7s %9s %10s %10s %10s %12s %12s\n", 
+        "clients", "connected", "MB", "MB/s", "cpu s", "cpu ms/MB", "cpu %/client");
+
+    if (optind < ac) {
+        for(int i = optind; i < ac; i++) {
+            if (run(&addr, pid, atoi(av[i]), duration) != 0) {
+                return 1;
+            }
+        }
+    } else {
+        for(size_t i = 0; i < sizeof(default_counts) / sizeof(default_counts[0]); i++) {
+            if (run(&addr, pid, default_counts[i], duration) != 0) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}